@@ -1,6 +1,35 @@
 
 #include "fs.h"
 
+// The block cache holds at most BC_MAXBLOCKS blocks. Each block that is
+// read from disk first takes a slot with bc_reserve, which evicts a
+// block with the CLOCK algorithm when the cache is full: the hand sweeps
+// the mapped blocks in block number order, giving blocks whose PTE_A bit
+// is set a second chance (and clearing the bit), and evicting the first
+// block that was not accessed since the last sweep. Dirty blocks are
+// written back before their accessed bit is cleared or they are evicted,
+// since sys_page_map can't preserve PTE_D.
+//
+// Evicting a block is always safe: the next access faults it back in.
+// The superblock and bitmap blocks stay, since they are used on every
+// fault and allocation.
+//
+// The cache is write-back. Code that modifies a block notes it with
+// bc_dirty instead of writing it right away. Noted blocks are written
+// when the list fills up and when the file server's flush timer fires
+// (every BC_FLUSH_MS); bc_sync writes every dirty block. Writes are
+// sorted by block number, and blocks that follow each other on disk
+// go out with a single disk command.
+
+struct BcStats bc_stats = { .bs_max = BC_MAXBLOCKS };
+static uint32_t bc_hand;	// Block number the CLOCK hand points at
+
+static uint32_t bc_dirtylist[BC_MAXDIRTY];	// Blocks noted by bc_dirty
+static int bc_ndirty;
+
+// Run of consecutive dirty blocks being collected for one write (see bc_run_add)
+static uint32_t bc_run_start, bc_run_len;
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
@@ -24,6 +53,71 @@ va_is_dirty(void *va)
 	return (uvpt[PGNUM(va)] & PTE_D) != 0;
 }
 
+// Blocks that are never evicted: the boot block, the superblock and the bitmap.
+static uint32_t
+bc_npinned(void)
+{
+	return 2 + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+}
+
+// Evict one block (see above). Returns false if it could not find one,
+// e.g. because every cached block is still on its way from the disk.
+static bool
+bc_evict(void)
+{
+	uint32_t n, pte;
+	void *va;
+
+	for (n = 0; n < 3 * super->s_nblocks; n++) {
+		if (++bc_hand >= super->s_nblocks || bc_hand < bc_npinned())
+			bc_hand = bc_npinned();
+		va = diskaddr(bc_hand);
+		if (!(uvpd[PDX(va)] & PTE_P)) {
+			// Skip the rest of this page table; the loop increments bc_hand.
+			bc_hand = ROUNDUP(bc_hand + 1, NPTENTRIES) - 1;
+			continue;
+		}
+		pte = uvpt[PGNUM(va)];
+		if (!(pte & PTE_P))
+			continue;
+
+		if (pte & PTE_D) {
+			// flush_block clears PTE_A along with PTE_D
+			flush_block(va);
+			bc_stats.bs_writebacks++;
+			if (pte & PTE_A)
+				continue;
+		} else if (pte & PTE_A) {
+			// Second chance
+			sys_page_map(0, va, 0, va, pte & PTE_SYSCALL);
+			continue;
+		}
+
+		sys_page_unmap(0, va);
+		bc_stats.bs_cached--;
+		bc_stats.bs_evictions++;
+		return 1;
+	}
+	return 0;
+}
+
+// Take a cache slot for a block that is about to be read from disk,
+// evicting another block if the cache is full. If no block can be
+// evicted, write back the noted dirty blocks and try once more.
+// Returns 0 on success, or -E_NO_MEM (and takes no slot) if the cache
+// is still full, e.g. of blocks that are still being read.
+int
+bc_reserve(void)
+{
+	if (super && bc_stats.bs_cached >= BC_MAXBLOCKS && !bc_evict()) {
+		bc_flush_dirty();
+		if (!bc_evict())
+			return -E_NO_MEM;
+	}
+	bc_stats.bs_cached++;
+	return 0;
+}
+
 // Fault any disk block that is read in to memory by
 // loading it from disk.
 static void
@@ -49,14 +143,9 @@ bc_pgfault(struct UTrapframe *utf)
 	//
 	// LAB 5: you code here:
 	
-	// Allocate page in disk map region
-	char *addr_base = (char *) ROUNDDOWN((uint32_t ) addr, PGSIZE); 
-	if ((r = sys_page_alloc(thisenv->env_id, addr_base, PTE_P|PTE_U|PTE_W)) < 0)
-		panic("bc_pgfault: sys_page_alloc: %e", r);
-		
-	// Read the contents of the block from the disk into that page. 
-	if ((r = ide_read(blockno*BLKSECTS, addr_base, BLKSECTS)) < 0)
-		panic("bc_pgfault: ide_read: %e", r);
+	// Allocate page in disk map region, and read the contents of the block from the disk into that page. 
+	// The read goes through the disk queue (ioq.c), since other requests may be in flight. 
+	ioq_read(blockno); 
 	
 
 	// Clear the dirty bit for the disk block page since we just read the
@@ -92,9 +181,8 @@ flush_block(void *addr)
 	if (va_is_mapped(addr) && va_is_dirty(addr)) {
 		char *addr_base = (char *) ROUNDDOWN((uint32_t ) addr, PGSIZE); 
 		
-		// Flush contents of the block containing VA out to disk
-		if ((r = ide_write(blockno*BLKSECTS, addr_base, BLKSECTS)) < 0)
-			panic("flush_block: ide_write: %e", r);
+		// Flush contents of the block containing VA out to disk (through the disk queue)
+		ioq_write(blockno, 1); 
 	
 		// Clear PTE_D using sys_page_map and PTE_SYSCALL
 		if ((r = sys_page_map(thisenv->env_id, addr_base, thisenv->env_id, addr_base, uvpt[PGNUM(addr_base)] & PTE_SYSCALL)) < 0)
@@ -103,6 +191,154 @@ flush_block(void *addr)
 	}
 }
 
+// The page of the block at addr is also mapped at shared (as program
+// text, see text.c), where it must keep its current contents.  Give the
+// block cache a copy of its own, so that later writes to the block don't
+// show through shared.  A dirty block stays dirty.  If there is no memory
+// for the copy, the block is written back and evicted instead.
+void
+bc_unshare(void *addr, const void *shared)
+{
+	bool dirty;
+	int r;
+
+	if (!va_is_mapped(addr) || PTE_ADDR(uvpt[PGNUM(addr)]) != PTE_ADDR(uvpt[PGNUM(shared)]))
+		return;		// evicted (and maybe read back in) since
+	dirty = va_is_dirty(addr);
+	if (sys_page_alloc(0, addr, PTE_P|PTE_U|PTE_W) < 0) {
+		flush_block(addr);
+		sys_page_unmap(0, addr);
+		bc_stats.bs_cached--;
+		bc_stats.bs_evictions++;
+		return;
+	}
+	memmove(addr, shared, BLKSIZE);
+	if (!dirty && (r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+		panic("bc_unshare: sys_page_map: %e", r);
+}
+
+// Note that the block containing addr was modified, so the write-back
+// flush will write it.
+void
+bc_dirty(void *addr)
+{
+	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	int i;
+
+	for (i = 0; i < bc_ndirty; i++)
+		if (bc_dirtylist[i] == blockno)
+			return;
+	if (bc_ndirty == BC_MAXDIRTY)
+		bc_flush_dirty();
+	bc_dirtylist[bc_ndirty++] = blockno;
+}
+
+// Write the collected run of blocks, and mark them clean.
+static void
+bc_run_flush(void)
+{
+	uint32_t i;
+	void *va;
+	int r;
+
+	if (bc_run_len == 0)
+		return;
+
+	// A block of the run may have been evicted (and written) meanwhile.
+	for (i = 0; i < bc_run_len; i++)
+		if (!va_is_mapped(diskaddr(bc_run_start + i)))
+			break;
+	if (i < bc_run_len) {
+		for (i = 0; i < bc_run_len; i++)
+			flush_block(diskaddr(bc_run_start + i));
+		bc_run_len = 0;
+		return;
+	}
+
+	ioq_write(bc_run_start, bc_run_len);
+	for (i = 0; i < bc_run_len; i++) {
+		va = diskaddr(bc_run_start + i);
+		if ((r = sys_page_map(0, va, 0, va, uvpt[PGNUM(va)] & PTE_SYSCALL)) < 0)
+			panic("bc_run_flush: sys_page_map: %e", r);
+	}
+	bc_run_len = 0;
+}
+
+// Add blockno to the run being collected if it is dirty, writing the
+// run first if blockno doesn't extend it.
+static void
+bc_run_add(uint32_t blockno)
+{
+	void *va = diskaddr(blockno);
+
+	if (!va_is_mapped(va) || !va_is_dirty(va))
+		return;
+	if (bc_run_len > 0 && blockno == bc_run_start + bc_run_len && bc_run_len < IOQ_MAXBLKS) {
+		bc_run_len++;
+		return;
+	}
+	bc_run_flush();
+	bc_run_start = blockno;
+	bc_run_len = 1;
+}
+
+// Write the blocks noted by bc_dirty.
+void
+bc_flush_dirty(void)
+{
+	uint32_t b;
+	int i, j;
+
+	// Insertion sort, so adjacent blocks end up next to each other.
+	for (i = 1; i < bc_ndirty; i++) {
+		b = bc_dirtylist[i];
+		for (j = i; j > 0 && bc_dirtylist[j - 1] > b; j--)
+			bc_dirtylist[j] = bc_dirtylist[j - 1];
+		bc_dirtylist[j] = b;
+	}
+	for (i = 0; i < bc_ndirty; i++)
+		bc_run_add(bc_dirtylist[i]);
+	bc_run_flush();
+	bc_ndirty = 0;
+}
+
+// Write the dirty data blocks of f (in file order, which is usually
+// disk order), then f itself and its indirect or extent block.
+void
+bc_flush_file(struct File *f)
+{
+	uint32_t bno, diskbno, run, i;
+
+	for (bno = 0; bno < (f->f_size + BLKSIZE - 1) / BLKSIZE; bno += run) {
+		diskbno = file_map_block(f, bno, &run);
+		for (i = 0; diskbno && i < run; i++)
+			bc_run_add(diskbno + i);
+	}
+	bc_run_flush();
+	flush_block(f);
+	if (file_meta_block(f))
+		flush_block(diskaddr(file_meta_block(f)));
+}
+
+// Write every dirty block in the cache, whether or not bc_dirty noted it.
+void
+bc_sync(void)
+{
+	uint32_t i;
+	void *va;
+
+	for (i = 1; i < super->s_nblocks; i++) {
+		va = diskaddr(i);
+		if (!(uvpd[PDX(va)] & PTE_P)) {
+			i = ROUNDUP(i + 1, NPTENTRIES) - 1;
+			continue;
+		}
+		bc_run_add(i);
+	}
+	bc_run_flush();
+	bc_ndirty = 0;
+}
+
 // Test that the block cache works, by smashing the superblock and
 // reading it back.
 static void
@@ -121,6 +357,7 @@ check_bc(void)
 
 	// clear it out
 	sys_page_unmap(0, diskaddr(1));
+	bc_stats.bs_cached--;
 	assert(!va_is_mapped(diskaddr(1)));
 
 	// read it back in
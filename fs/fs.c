@@ -36,6 +36,25 @@ block_is_free(uint32_t blockno)
 	return 0;
 }
 
+// Free-block summary: the number of free blocks that each bitmap block
+// describes, so allocation can skip over full parts of the disk.
+// Built by bitmap_init.
+#define BMWORDS		(BLKBITSIZE / 32)	// bitmap words per bitmap block
+static uint32_t bm_nfree[DISKSIZE / BLKSIZE / BLKBITSIZE];
+
+// Where allocations without a goal start searching: just past the last
+// block allocated.
+static uint32_t bm_cursor;
+
+static int
+popcount(uint32_t x)
+{
+	x = x - ((x >> 1) & 0x55555555);
+	x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+	x = (x + (x >> 4)) & 0x0F0F0F0F;
+	return (x * 0x01010101) >> 24;
+}
+
 // Mark a block free in the bitmap
 void
 free_block(uint32_t blockno)
@@ -43,43 +62,89 @@ free_block(uint32_t blockno)
 	// Blockno zero is the null pointer of block numbers.
 	if (blockno == 0)
 		panic("attempt to free zero block");
+	if (!block_is_free(blockno))
+		bm_nfree[blockno / BLKBITSIZE]++;
 	bitmap[blockno/32] |= 1<<(blockno%32);
+	bc_dirty(&bitmap[blockno/32]);
 }
 
-// Search the bitmap for a free block and allocate it.  When you
-// allocate a block, immediately flush the changed bitmap block
-// to disk.
+// Mark blockno in use, and note the bitmap block for write-back.
+static int
+take_block(uint32_t blockno)
+{
+	bitmap[blockno / 32] &= ~(1 << (blockno % 32));
+	bm_nfree[blockno / BLKBITSIZE]--;
+	bc_dirty(&bitmap[blockno / 32]);
+	bm_cursor = blockno + 1 < super->s_nblocks ? blockno + 1 : 0;
+	return blockno;
+}
+
+// Allocate a free block, preferably 'goal' or the first free block
+// after it, so that a file's blocks end up next to each other on disk.
+// The search goes a bitmap word at a time (finding the first free bit
+// with bsf), skips bitmap blocks that the summary says are full, and
+// wraps around at the end of the disk.
 //
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
-//
-// Hint: use free_block as an example for manipulating the bitmap.
 int
-alloc_block(void)
+alloc_block_near(uint32_t goal)
 {
-	// The bitmap consists of one or more blocks.  A single bitmap block
-	// contains the in-use bits for BLKBITSIZE blocks.  There are
-	// super->s_nblocks blocks in the disk altogether.
+	uint32_t nwords, w, n, bits, blockno;
 
-	// LAB 5: Your code here.
 	if (super == 0)
 		panic("alloc_block: Super block doesn't exist. \n");
-	
-	// Search the bitmpas for a free block, and allocate it. 
-	size_t blockno; 
-	for (blockno = 0; blockno < super->s_nblocks; blockno++) {
-		if (bitmap[blockno / 32] & (1 << (blockno % 32))) {
-			// Allocate the block in the bitmap. 
-			bitmap[blockno / 32] = bitmap[blockno / 32] & ~(1 << (blockno % 32)); 
-			// Flush the bitmap block to disk. 
-			flush_block(bitmap + (blockno / 32));
-			return blockno;
+
+	if (goal == 0 || goal >= super->s_nblocks)
+		goal = bm_cursor;
+	if (block_is_free(goal))
+		return take_block(goal);
+
+	nwords = (super->s_nblocks + 31) / 32;
+	w = goal / 32;
+	// In the first word, only look at the goal and after it (the rest of the word is checked last).
+	bits = bitmap[w] & (~0U << (goal % 32));
+	for (n = 0; n <= nwords; n++) {
+		if (bits) {
+			// The bits past s_nblocks in the last word are set, but aren't blocks.
+			blockno = w * 32 + __builtin_ctz(bits);
+			if (blockno < super->s_nblocks)
+				return take_block(blockno);
 		}
+		if (++w == nwords)
+			w = 0;
+		while (w % BMWORDS == 0 && bm_nfree[w / BMWORDS] == 0 && n < nwords) {
+			n += BMWORDS;
+			if ((w += BMWORDS) >= nwords)
+				w = 0;
+		}
+		bits = bitmap[w];
 	}
-	
+
 	return -E_NO_DISK;
 }
 
+// Allocate a block anywhere (after the last block allocated).
+int
+alloc_block(void)
+{
+	return alloc_block_near(0);
+}
+
+// Build the free-block summary from the bitmap.
+static void
+bitmap_init(void)
+{
+	uint32_t w, nwords = super->s_nblocks / 32;
+
+	for (w = 0; w < nwords; w++)
+		bm_nfree[w / BMWORDS] += popcount(bitmap[w]);
+	// Partial last word: only count real blocks.
+	for (w = nwords * 32; w < super->s_nblocks; w++)
+		if (block_is_free(w))
+			bm_nfree[w / BLKBITSIZE]++;
+}
+
 // Validate the file system bitmap.
 //
 // Check that all reserved blocks -- 0, 1, and the bitmap blocks themselves --
@@ -117,6 +182,7 @@ fs_init(void)
 		ide_set_disk(1);
 	else
 		ide_set_disk(0);
+	ide_dma_init();
 	bc_init();
 
 	// Set "super" to point to the super block.
@@ -126,6 +192,7 @@ fs_init(void)
 	// Set "bitmap" to the beginning of the first bitmap block.
 	bitmap = diskaddr(2);
 	check_bitmap();
+	bitmap_init();
 	
 }
 
@@ -171,15 +238,16 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 				return -E_NOT_FOUND; 
 			}
 			
-			// Allocate the inidrect block. 
-			if ((blockno = alloc_block()) < 0) { 
+			// Allocate the inidrect block (after the last direct block, to keep the file together on disk). 
+			if ((blockno = alloc_block_near(f->f_direct[NDIRECT - 1] + 1)) < 0) { 
 				return -E_NO_DISK; 
 			}
 			
-			// Clears the indirect block (and updates the disk accordingly) 
+			// Clears the indirect block (the disk is updated by write-back) 
 			memset(diskaddr(blockno), 0, BLKSIZE); 
-			flush_block(diskaddr(blockno)); 
+			bc_dirty(diskaddr(blockno)); 
 			f->f_indirect = blockno; 
+			bc_dirty(f); 
 		} 
 		
 		// The f_indirect block exists. 
@@ -194,6 +262,207 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 	       
 }
 
+// --------------------------------------------------------------
+// Extent files
+// --------------------------------------------------------------
+
+// Files with FILE_EXTENTS map their blocks with a list of extents,
+// sorted by file block: NEXTENT in the File itself, then NBLKEXTENT
+// more in the extent block f_extblock.  A file that was written
+// sequentially (see alloc_block_near) needs a single extent however
+// large it is, and the blocks of an extent can be read with one disk
+// command.
+
+#define MAXEXTENTS	(NEXTENT + NBLKEXTENT)
+
+// Extent slot i of f, or NULL if there is no such slot.
+static struct Extent *
+ext_slot(struct File *f, uint32_t i)
+{
+	if (i < NEXTENT)
+		return &f->f_extents[i];
+	if (i >= MAXEXTENTS || f->f_extblock == 0)
+		return NULL;
+	return &((struct Extent *) diskaddr(f->f_extblock))[i - NEXTENT];
+}
+
+// Number of extents of f.
+static uint32_t
+ext_count(struct File *f)
+{
+	struct Extent *e;
+	uint32_t n;
+
+	for (n = 0; (e = ext_slot(f, n)) != NULL && e->e_len != 0; n++)
+		/* do nothing */;
+	return n;
+}
+
+// Disk block of file block filebno of extent file f, or 0 if it is not
+// allocated.  Sets *prun to the number of blocks from filebno to the
+// end of its extent.
+static uint32_t
+ext_lookup(struct File *f, uint32_t filebno, uint32_t *prun)
+{
+	struct Extent *e;
+	uint32_t i;
+
+	for (i = 0; (e = ext_slot(f, i)) != NULL && e->e_len != 0; i++) {
+		if (filebno < e->e_fblock)
+			break;
+		if (filebno - e->e_fblock < e->e_len) {
+			*prun = e->e_len - (filebno - e->e_fblock);
+			return e->e_start + (filebno - e->e_fblock);
+		}
+	}
+	*prun = 1;
+	return 0;
+}
+
+// Record that file block filebno of extent file f is disk block
+// diskbno, growing a neighbouring extent if the block continues it.
+// Returns -E_NO_DISK if f has too many extents (or no room is left
+// for the extent block).
+static int
+ext_insert(struct File *f, uint32_t filebno, uint32_t diskbno)
+{
+	struct Extent *e, *prev = NULL, *next;
+	uint32_t i, n;
+	int r;
+
+	n = ext_count(f);
+	for (i = 0; i < n; i++) {
+		if ((e = ext_slot(f, i))->e_fblock > filebno)
+			break;
+		prev = e;
+	}
+	next = i < n ? ext_slot(f, i) : NULL;
+
+	if (prev && prev->e_fblock + prev->e_len == filebno
+	    && prev->e_start + prev->e_len == diskbno) {
+		prev->e_len++;
+		bc_dirty(prev);
+		return 0;
+	}
+	if (next && next->e_fblock == filebno + 1 && next->e_start == diskbno + 1) {
+		next->e_fblock--;
+		next->e_start--;
+		next->e_len++;
+		bc_dirty(next);
+		return 0;
+	}
+
+	// New extent at slot i.
+	if (n == MAXEXTENTS)
+		return -E_NO_DISK;
+	if (n >= NEXTENT && f->f_extblock == 0) {
+		if ((r = alloc_block_near(diskbno + 1)) < 0)
+			return r;
+		memset(diskaddr(r), 0, BLKSIZE);
+		bc_dirty(diskaddr(r));
+		f->f_extblock = r;
+		bc_dirty(f);
+	}
+	for (; n > i; n--) {
+		*ext_slot(f, n) = *ext_slot(f, n - 1);
+		bc_dirty(ext_slot(f, n));
+	}
+	e = ext_slot(f, i);
+	e->e_fblock = filebno;
+	e->e_start = diskbno;
+	e->e_len = 1;
+	bc_dirty(e);
+	return 0;
+}
+
+// Free the blocks of extent file f past the first nblocks file blocks.
+static void
+ext_truncate(struct File *f, uint32_t nblocks)
+{
+	struct Extent *e;
+	uint32_t i, n, keep, b;
+
+	n = ext_count(f);
+	// Extents are sorted, so the ones to drop are at the end. Go backwards
+	// so the list stays terminated.
+	for (i = n; i > 0; i--) {
+		e = ext_slot(f, i - 1);
+		if (e->e_fblock + e->e_len <= nblocks)
+			break;
+		keep = e->e_fblock < nblocks ? nblocks - e->e_fblock : 0;
+		for (b = keep; b < e->e_len; b++)
+			free_block(e->e_start + b);
+		e->e_len = keep;
+		bc_dirty(e);
+		if (keep > 0)
+			break;
+		n--;
+	}
+
+	if (n <= NEXTENT && f->f_extblock) {
+		free_block(f->f_extblock);
+		f->f_extblock = 0;
+		bc_dirty(f);
+	}
+}
+
+// --------------------------------------------------------------
+// Block maps of both kinds of files
+// --------------------------------------------------------------
+
+// Disk block of file block filebno of f, or 0 if it is not allocated.
+// If prun is not null, sets *prun to the number of blocks from filebno
+// on that are known to be consecutive on disk (the rest of the extent
+// for extent files, 1 otherwise).
+uint32_t
+file_map_block(struct File *f, uint32_t filebno, uint32_t *prun)
+{
+	uint32_t *pdiskbno, run;
+
+	if (f->f_flags & FILE_EXTENTS)
+		return ext_lookup(f, filebno, prun ? prun : &run);
+	if (prun)
+		*prun = 1;
+	if (file_block_walk(f, filebno, &pdiskbno, 0) < 0)
+		return 0;
+	return *pdiskbno;
+}
+
+// The block holding the rest of f's block map (its indirect block or
+// extent block), or 0 if it has none.
+uint32_t
+file_meta_block(struct File *f)
+{
+	return (f->f_flags & FILE_EXTENTS) ? f->f_extblock : f->f_indirect;
+}
+
+// Can file block filebno of f be mapped without reading f's indirect or
+// extent block from disk?
+static bool
+file_meta_cached(struct File *f, uint32_t filebno)
+{
+	uint32_t meta = file_meta_block(f);
+
+	if (meta == 0 || va_is_mapped(diskaddr(meta)))
+		return 1;
+	// Only extents past the ones in f, and blocks past the direct ones, need it.
+	if (f->f_flags & FILE_EXTENTS)
+		return f->f_extents[NEXTENT - 1].e_len == 0;
+	return filebno < NDIRECT;
+}
+
+// Where to allocate file block filebno: right after block filebno-1 on
+// disk. Returns 0 (no preference) if there is no such block.
+static uint32_t
+file_block_goal(struct File *f, uint32_t filebno)
+{
+	uint32_t diskbno;
+
+	if (filebno == 0 || (diskbno = file_map_block(f, filebno - 1, NULL)) == 0)
+		return 0;
+	return diskbno + 1;
+}
+
 // Set *blk to the address in memory where the filebno'th
 // block of file 'f' would be mapped.
 //
@@ -208,21 +477,39 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
 	// LAB 5: Your code here.
 	int r; 
 	int blockno; 
-	uint32_t *pdiskbno; 
+	uint32_t *pdiskbno, run; 
+	
+	// Extent files: look the block up, or allocate it and add it to the extents. 
+	if (f->f_flags & FILE_EXTENTS) {
+		if ((blockno = ext_lookup(f, filebno, &run)) == 0) {
+			if ((blockno = alloc_block_near(file_block_goal(f, filebno))) < 0)
+				return -E_NO_DISK; 
+			if ((r = ext_insert(f, filebno, blockno)) < 0) {
+				free_block(blockno); 
+				return r; 
+			}
+			memset(diskaddr(blockno), 0, BLKSIZE); 
+			bc_dirty(diskaddr(blockno)); 
+		}
+		*blk = diskaddr(blockno); 
+		return 0; 
+	}
+	
 	if ((r = file_block_walk(f, filebno, &pdiskbno, 1)) < 0)
   	return r; 
   
   // Handle the case where the block has not yet been allocated. 
   if (*pdiskbno == 0) { 
-  	// Allocate a block. 
-		if ((blockno = alloc_block()) < 0) { 
+  	// Allocate a block, right after the file's previous block if possible. 
+		if ((blockno = alloc_block_near(file_block_goal(f, filebno))) < 0) { 
 			return -E_NO_DISK; 
 		}
-  	// Clears the new block (and updates the disk accordingly) 
+  	// Clears the new block (the disk is updated by write-back) 
 		memset(diskaddr(blockno), 0, BLKSIZE); 
-		flush_block(diskaddr(blockno)); 
+		bc_dirty(diskaddr(blockno)); 
 		// Set the blocknumber. 
 		*pdiskbno = blockno; 
+		bc_dirty(pdiskbno); 
   }
   
   // At this pint in code, pdiskno has a block. 
@@ -231,6 +518,71 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
   
 }
 
+// Set *file to entry slot s of dir.
+static int
+dir_slot(struct File *dir, uint32_t s, struct File **file)
+{
+	int r;
+	char *blk;
+
+	if ((r = file_get_block(dir, s / BLKFILES, &blk)) < 0)
+		return r;
+	*file = (struct File*) blk + s % BLKFILES;
+	return 0;
+}
+
+// Return the head of the index bucket that name hashes to.
+static uint32_t *
+dir_bucket(struct File *dir, const char *name)
+{
+	uint32_t *buckets = diskaddr(dir->f_dirhash);
+
+	return &buckets[dir_hash(name) % DIRHASH_NBUCKETS];
+}
+
+// Add entry slot s of dir, named f->f_name, to dir's index.
+static void
+dir_index_add(struct File *dir, struct File *f, uint32_t s)
+{
+	uint32_t *head = dir_bucket(dir, f->f_name);
+
+	f->f_hnext = *head;
+	*head = s + 1;
+	bc_dirty(f);
+	bc_dirty(head);
+}
+
+// Give dir an index once it outgrows its first block (directories
+// written by an older fsformat, or grown by file_create).  A directory
+// that fits in one block is searched just as fast without one.
+// Returns 0 if dir has an index afterwards, < 0 otherwise.
+static int
+dir_index(struct File *dir)
+{
+	int r;
+	uint32_t s, nslot;
+	struct File *f;
+
+	if (dir->f_dirhash)
+		return 0;
+	if (dir->f_size <= BLKSIZE)
+		return -E_NOT_FOUND;
+	if ((r = alloc_block_near(file_block_goal(dir, 0))) < 0)
+		return r;
+	memset(diskaddr(r), 0, BLKSIZE);
+	dir->f_dirhash = r;
+	bc_dirty(dir);
+
+	nslot = dir->f_size / BLKSIZE * BLKFILES;
+	for (s = 0; s < nslot; s++) {
+		if ((r = dir_slot(dir, s, &f)) < 0)
+			panic("dir_index: %e", r);
+		if (f->f_name[0] != '\0')
+			dir_index_add(dir, f, s);
+	}
+	return 0;
+}
+
 // Try to find a file named "name" in dir.  If so, set *file to it.
 //
 // Returns 0 and sets *file on success, < 0 on error.  Errors are:
@@ -239,14 +591,28 @@ static int
 dir_lookup(struct File *dir, const char *name, struct File **file)
 {
 	int r;
-	uint32_t i, j, nblock;
+	uint32_t i, j, nblock, s;
 	char *blk;
 	struct File *f;
 
-	// Search dir for name.
 	// We maintain the invariant that the size of a directory-file
 	// is always a multiple of the file system's block size.
 	assert((dir->f_size % BLKSIZE) == 0);
+
+	// Indexed directory: follow name's hash chain.
+	if (dir_index(dir) == 0) {
+		for (s = *dir_bucket(dir, name); s != 0; s = f->f_hnext) {
+			if ((r = dir_slot(dir, s - 1, &f)) < 0)
+				return r;
+			if (strcmp(f->f_name, name) == 0) {
+				*file = f;
+				return 0;
+			}
+		}
+		return -E_NOT_FOUND;
+	}
+
+	// Search dir for name.
 	nblock = dir->f_size / BLKSIZE;
 	for (i = 0; i < nblock; i++) {
 		if ((r = file_get_block(dir, i, &blk)) < 0)
@@ -261,10 +627,11 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	return -E_NOT_FOUND;
 }
 
-// Set *file to point at a free File structure in dir.  The caller is
-// responsible for filling in the File fields.
+// Set *file to point at a free File structure in dir, and *slot to its
+// entry slot.  The caller is responsible for filling in the File fields
+// (and for adding it to dir's index).
 static int
-dir_alloc_file(struct File *dir, struct File **file)
+dir_alloc_file(struct File *dir, struct File **file, uint32_t *slot)
 {
 	int r;
 	uint32_t nblock, i, j;
@@ -273,21 +640,29 @@ dir_alloc_file(struct File *dir, struct File **file)
 
 	assert((dir->f_size % BLKSIZE) == 0);
 	nblock = dir->f_size / BLKSIZE;
-	for (i = 0; i < nblock; i++) {
+
+	// Entries are never removed, so the free entries of a directory
+	// are all in its last block; an indexed (large) directory only
+	// looks there.
+	i = (dir->f_dirhash && nblock > 0) ? nblock - 1 : 0;
+	for (; i < nblock; i++) {
 		if ((r = file_get_block(dir, i, &blk)) < 0)
 			return r;
 		f = (struct File*) blk;
 		for (j = 0; j < BLKFILES; j++)
 			if (f[j].f_name[0] == '\0') {
 				*file = &f[j];
+				*slot = i * BLKFILES + j;
 				return 0;
 			}
 	}
 	dir->f_size += BLKSIZE;
+	bc_dirty(dir);
 	if ((r = file_get_block(dir, i, &blk)) < 0)
 		return r;
 	f = (struct File*) blk;
 	*file = &f[0];
+	*slot = i * BLKFILES;
 	return 0;
 }
 
@@ -300,6 +675,60 @@ skip_slash(const char *p)
 	return p;
 }
 
+// Name cache: recent lookups of a name in a directory, including names
+// that were not there (d_file == 0).  Directory entries never move, so
+// a File pointer stays good for as long as the file exists; file_create
+// replaces the negative entry for the name it creates.  Direct mapped
+// on the directory and the hash of the name.
+#define NDCACHE		256
+
+struct Dentry {
+	struct File *d_dir;		// 0 if the slot is unused
+	struct File *d_file;		// 0 if name is not in d_dir
+	char d_name[MAXNAMELEN];
+};
+
+static struct Dentry dcache[NDCACHE];
+
+static struct Dentry *
+dcache_slot(struct File *dir, const char *name)
+{
+	return &dcache[(dir_hash(name) ^ ((uint32_t) dir / sizeof(struct File))) % NDCACHE];
+}
+
+// Look name up in dir, through the name cache.
+static int
+dcache_lookup(struct File *dir, const char *name, struct File **file)
+{
+	struct Dentry *d = dcache_slot(dir, name);
+	int r;
+
+	if (d->d_dir == dir && strcmp(d->d_name, name) == 0) {
+		bc_stats.bs_dhits++;
+		*file = d->d_file;
+		return d->d_file ? 0 : -E_NOT_FOUND;
+	}
+
+	bc_stats.bs_dmisses++;
+	if ((r = dir_lookup(dir, name, file)) < 0 && r != -E_NOT_FOUND)
+		return r;
+	d->d_dir = dir;
+	d->d_file = r < 0 ? 0 : *file;
+	strcpy(d->d_name, name);
+	return r;
+}
+
+// Record that name in dir is now file.
+static void
+dcache_enter(struct File *dir, const char *name, struct File *file)
+{
+	struct Dentry *d = dcache_slot(dir, name);
+
+	d->d_dir = dir;
+	d->d_file = file;
+	strcpy(d->d_name, name);
+}
+
 // Evaluate a path name, starting at the root.
 // On success, set *pf to the file we found
 // and set *pdir to the directory the file is in.
@@ -338,7 +767,7 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 		if (dir->f_type != FTYPE_DIR)
 			return -E_NOT_FOUND;
 
-		if ((r = dir_lookup(dir, name, &f)) < 0) {
+		if ((r = dcache_lookup(dir, name, &f)) < 0) {
 			if (r == -E_NOT_FOUND && *path == '\0') {
 				if (pdir)
 					*pdir = dir;
@@ -367,18 +796,23 @@ file_create(const char *path, struct File **pf)
 {
 	char name[MAXNAMELEN];
 	int r;
+	uint32_t slot;
 	struct File *dir, *f;
 
 	if ((r = walk_path(path, &dir, &f, name)) == 0)
 		return -E_FILE_EXISTS;
 	if (r != -E_NOT_FOUND || dir == 0)
 		return r;
-	if ((r = dir_alloc_file(dir, &f)) < 0)
+	if ((r = dir_alloc_file(dir, &f, &slot)) < 0)
 		return r;
 
 	strcpy(f->f_name, name);
+	f->f_flags = (super->s_flags & FS_EXTENTS) ? FILE_EXTENTS : 0;
+	if (dir->f_dirhash)
+		dir_index_add(dir, f, slot);
+	dcache_enter(dir, name, f);
 	*pf = f;
-	file_flush(dir);
+	bc_dirty(f);
 	return 0;
 }
 
@@ -417,6 +851,83 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 	return count;
 }
 
+// Check that the blocks a read or write of count bytes at offset in f
+// will touch are in the block cache, without faulting on any of them:
+// queue the ones that are missing with ioq_read_async.
+// Returns -E_PENDING if the caller has to wait for queued blocks,
+// 0 if it can go ahead.
+int
+file_cache_range(struct File *f, off_t offset, size_t count)
+{
+	uint32_t bno, diskbno, end;
+	int pending = 0;
+
+	// f itself lives in a block of its directory.
+	if (!va_is_mapped(f))
+		return ioq_read_async(((uint32_t) f - DISKMAP) / BLKSIZE) ? -E_PENDING : 0;
+
+	// Blocks past the end of the file are allocated, not read.
+	end = MIN((uint32_t) (offset + count), (uint32_t) f->f_size);
+	for (bno = offset / BLKSIZE; bno * BLKSIZE < end; bno++) {
+		if (!file_meta_cached(f, bno)) {
+			pending |= ioq_read_async(file_meta_block(f));
+			break;
+		}
+		if ((diskbno = file_map_block(f, bno, NULL)) == 0)
+			continue;
+		if (va_is_mapped(diskaddr(diskbno)))
+			bc_stats.bs_hits++;
+		else
+			pending |= ioq_read_async(diskbno);
+	}
+	return pending ? -E_PENDING : 0;
+}
+
+// Disk block of file block filebno, or 0 if it isn't allocated or its
+// indirect or extent block isn't cached (so looking it up doesn't touch
+// the disk).
+static uint32_t
+file_peek_block(struct File *f, uint32_t filebno)
+{
+	if (!file_meta_cached(f, filebno))
+		return 0;
+	return file_map_block(f, filebno, NULL);
+}
+
+// Start reading file blocks [filebno, filebno + nblocks) into the
+// block cache, without waiting for them.  Blocks that follow each
+// other on disk are read with a single disk command.
+void
+file_readahead(struct File *f, uint32_t filebno, uint32_t nblocks)
+{
+	uint32_t bno, end, diskbno, run = 0, nrun = 0;
+
+	if (!va_is_mapped(f))
+		return;
+
+	end = MIN(filebno + nblocks, ROUNDUP((uint32_t) f->f_size, BLKSIZE) / BLKSIZE);
+	for (bno = filebno; bno < end; bno++) {
+		diskbno = file_peek_block(f, bno);
+		if (diskbno == 0 || va_is_mapped(diskaddr(diskbno)) || ioq_pending(diskbno)) {
+			if (nrun > 0)
+				ioq_readahead(run, nrun);
+			nrun = 0;
+			continue;
+		}
+		// Extend the current run if this block comes right after it on disk.
+		if (nrun > 0 && diskbno == run + nrun && nrun < IOQ_MAXBLKS) {
+			nrun++;
+			continue;
+		}
+		if (nrun > 0)
+			ioq_readahead(run, nrun);
+		run = diskbno;
+		nrun = 1;
+	}
+	if (nrun > 0)
+		ioq_readahead(run, nrun);
+}
+
 
 // Write count bytes from buf into f, starting at seek position
 // offset.  This is meant to mimic the standard pwrite function.
@@ -429,6 +940,8 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 	off_t pos;
 	char *blk;
 
+	text_invalidate(f);
+
 	// Extend file if necessary
 	if (offset + count > f->f_size)
 		if ((r = file_set_size(f, offset + count)) < 0)
@@ -439,6 +952,7 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 			return r;
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
 		memmove(blk + pos % BLKSIZE, buf, bn);
+		bc_dirty(blk);
 		pos += bn;
 		buf += bn;
 	}
@@ -459,6 +973,7 @@ file_free_block(struct File *f, uint32_t filebno)
 	if (*ptr) {
 		free_block(*ptr);
 		*ptr = 0;
+		bc_dirty(ptr);
 	}
 	return 0;
 }
@@ -480,6 +995,10 @@ file_truncate_blocks(struct File *f, off_t newsize)
 
 	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
 	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
+	if (f->f_flags & FILE_EXTENTS) {
+		ext_truncate(f, new_nblocks);
+		return;
+	}
 	for (bno = new_nblocks; bno < old_nblocks; bno++)
 		if ((r = file_free_block(f, bno)) < 0)
 			cprintf("warning: file_free_block: %e", r);
@@ -491,35 +1010,31 @@ file_truncate_blocks(struct File *f, off_t newsize)
 }
 
 // Set the size of file f, truncating or extending as necessary.
+// Returns -E_INVAL if newsize is negative or more than the file can
+// map: MAXFILESIZE for block-mapped files, MAXEXTFILESIZE for extent
+// files.
 int
 file_set_size(struct File *f, off_t newsize)
 {
+	off_t maxsize = (f->f_flags & FILE_EXTENTS) ? MAXEXTFILESIZE : MAXFILESIZE;
+
+	if (newsize < 0 || newsize > maxsize)
+		return -E_INVAL;
+	text_invalidate(f);
 	if (f->f_size > newsize)
 		file_truncate_blocks(f, newsize);
 	f->f_size = newsize;
-	flush_block(f);
+	bc_dirty(f);
 	return 0;
 }
 
 // Flush the contents and metadata of file f out to disk.
-// Loop over all the blocks in file.
-// Translate the file block number into a disk block number
-// and then check whether that disk block is dirty.  If so, write it out.
+// Dirty data blocks that follow each other on disk are written with
+// a single disk command (see bc_flush_file).
 void
 file_flush(struct File *f)
 {
-	int i;
-	uint32_t *pdiskbno;
-
-	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
-		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
-		    pdiskbno == NULL || *pdiskbno == 0)
-			continue;
-		flush_block(diskaddr(*pdiskbno));
-	}
-	flush_block(f);
-	if (f->f_indirect)
-		flush_block(diskaddr(f->f_indirect));
+	bc_flush_file(f);
 }
 
 
@@ -527,8 +1042,6 @@ file_flush(struct File *f)
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	bc_sync();
 }
 
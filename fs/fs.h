@@ -17,15 +17,48 @@ uint32_t *bitmap;		// bitmap blocks mapped in memory
 /* ide.c */
 bool	ide_probe_disk1(void);
 void	ide_set_disk(int diskno);
+void	ide_dma_init(void);
+bool	ide_dma_enabled(void);
+int	ide_dma_start(uint32_t secno, void *buf, size_t nsecs, bool write);
+int	ide_dma_finish(void);
 void	ide_set_partition(uint32_t first_sect, uint32_t nsect);
 int	ide_read(uint32_t secno, void *dst, size_t nsecs);
 int	ide_write(uint32_t secno, const void *src, size_t nsecs);
 
+/* ioq.c */
+// Number of client requests that can wait for disk reads at once (see serv.c)
+#define IOQ_NWAITERS	32
+// Largest number of blocks read with one disk command (see ioq_readahead)
+#define IOQ_MAXBLKS	16
+// Returned by request handlers that queued disk reads: run the request again once they arrive.
+#define E_PENDING	(MAXERROR + 1)
+extern int ioq_waiter;
+int	ioq_read_async(uint32_t blockno);
+void	ioq_readahead(uint32_t blockno, uint32_t nblocks);
+bool	ioq_pending(uint32_t blockno);
+uint32_t ioq_take_ready(void);
+void	ioq_intr(void);
+void	ioq_read(uint32_t blockno);
+void	ioq_write(uint32_t blockno, uint32_t nblocks);
+
 /* bc.c */
+// Capacity of the block cache in blocks (4MB)
+#define BC_MAXBLOCKS	1024
+// Dirty blocks noted for write-back before the list is flushed
+#define BC_MAXDIRTY	128
+// Interval of the write-back timer
+#define BC_FLUSH_MS	1000
+extern struct BcStats bc_stats;
 void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+void	bc_dirty(void *addr);
+void	bc_unshare(void *addr, const void *shared);
+void	bc_flush_dirty(void);
+void	bc_flush_file(struct File *f);
+void	bc_sync(void);
+int	bc_reserve(void);
 void	bc_init(void);
 
 /* fs.c */
@@ -37,12 +70,23 @@ ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
 int	file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int	file_set_size(struct File *f, off_t newsize);
 void	file_flush(struct File *f);
+int	file_cache_range(struct File *f, off_t offset, size_t count);
+uint32_t file_map_block(struct File *f, uint32_t filebno, uint32_t *prun);
+uint32_t file_meta_block(struct File *f);
+void	file_readahead(struct File *f, uint32_t filebno, uint32_t nblocks);
 int	file_remove(const char *path);
 void	fs_sync(void);
 
+/* text.c */
+// Largest program text (from the start of the file) kept in the text cache
+#define TEXT_MAXPAGES	128
+int	text_map(struct File *f, off_t offset, size_t n, void **pg_store, size_t *npages_store);
+void	text_invalidate(struct File *f);
+
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
 int	alloc_block(void);
+int	alloc_block_near(uint32_t goal);
 
 /* test.c */
 void	fs_test(void);
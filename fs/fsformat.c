@@ -32,7 +32,7 @@ typedef int bool;
 #include <inc/fs.h>
 
 #define ROUNDUP(n, v) ((n) - 1 + (v) - ((n) - 1) % (v))
-#define MAX_DIR_ENTS 128
+#define MAX_DIR_ENTS 4096
 
 struct Dir
 {
@@ -42,6 +42,7 @@ struct Dir
 };
 
 uint32_t nblocks;
+int extents;		// -e: lay files out with extents (FS_EXTENTS)
 char *diskmap, *diskpos;
 struct Super *super;
 uint32_t *bitmap;
@@ -113,6 +114,10 @@ opendisk(const char *name)
 	super->s_nblocks = nblocks;
 	super->s_root.f_type = FTYPE_DIR;
 	strcpy(super->s_root.f_name, "/");
+	if (extents) {
+		super->s_flags = FS_EXTENTS;
+		super->s_root.f_flags = FILE_EXTENTS;
+	}
 
 	nbitblocks = (nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
 	bitmap = alloc(nbitblocks * BLKSIZE);
@@ -137,6 +142,15 @@ finishfile(struct File *f, uint32_t start, uint32_t len)
 	int i;
 	f->f_size = len;
 	len = ROUNDUP(len, BLKSIZE);
+	if (f->f_flags & FILE_EXTENTS) {
+		// The file is contiguous, so one extent covers it.
+		if (len > 0) {
+			f->f_extents[0].e_fblock = 0;
+			f->f_extents[0].e_start = start;
+			f->f_extents[0].e_len = len / BLKSIZE;
+		}
+		return;
+	}
 	for (i = 0; i < len / BLKSIZE && i < NDIRECT; ++i)
 		f->f_direct[i] = start + i;
 	if (i == NDIRECT) {
@@ -161,16 +175,41 @@ diradd(struct Dir *d, uint32_t type, const char *name)
 	struct File *out = &d->ents[d->n++];
 	if (d->n > MAX_DIR_ENTS)
 		panic("too many directory entries");
+	memset(out, 0, sizeof *out);
 	strcpy(out->f_name, name);
 	out->f_type = type;
+	if (extents)
+		out->f_flags = FILE_EXTENTS;
 	return out;
 }
 
+// Chain the entries of a directory that needs more than one block
+// into a hash index (see DIRHASH_NBUCKETS in inc/fs.h).
+void
+indexdir(struct Dir *d)
+{
+	uint32_t *buckets, h;
+	int i;
+
+	if (d->n <= BLKFILES)
+		return;
+	buckets = alloc(BLKSIZE);
+	for (i = 0; i < d->n; i++) {
+		h = dir_hash(d->ents[i].f_name) % DIRHASH_NBUCKETS;
+		d->ents[i].f_hnext = buckets[h];
+		buckets[h] = i + 1;
+	}
+	d->f->f_dirhash = blockof(buckets);
+}
+
 void
 finishdir(struct Dir *d)
 {
 	int size = d->n * sizeof(struct File);
-	struct File *start = alloc(size);
+	struct File *start;
+
+	indexdir(d);
+	start = alloc(size);
 	memmove(start, d->ents, size);
 	finishfile(d->f, blockof(start), ROUNDUP(size, BLKSIZE));
 	free(d->ents);
@@ -192,7 +231,7 @@ writefile(struct Dir *dir, const char *name)
 		panic("stat %s: %s", name, strerror(errno));
 	if (!S_ISREG(st.st_mode))
 		panic("%s is not a regular file", name);
-	if (st.st_size >= MAXFILESIZE)
+	if (st.st_size >= (extents ? MAXEXTFILESIZE : MAXFILESIZE))
 		panic("%s too large", name);
 
 	last = strrchr(name, '/');
@@ -211,7 +250,8 @@ writefile(struct Dir *dir, const char *name)
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: fsformat fs.img NBLOCKS files...\n");
+	fprintf(stderr, "Usage: fsformat [-e] fs.img NBLOCKS files...\n"
+		"  -e  use extents instead of block pointers (allows large files)\n");
 	exit(2);
 }
 
@@ -224,11 +264,19 @@ main(int argc, char **argv)
 
 	assert(BLKSIZE % sizeof(struct File) == 0);
 
+	if (argc > 1 && strcmp(argv[1], "-e") == 0) {
+		extents = 1;
+		argc--;
+		argv++;
+	}
 	if (argc < 3)
 		usage();
 
+	// Extent file systems can be large (up to 1GB); keep the classic
+	// format at its original limit.
 	nblocks = strtol(argv[2], &s, 0);
-	if (*s || s == argv[2] || nblocks < 2 || nblocks > 1024)
+	if (*s || s == argv[2] || nblocks < 2
+	    || nblocks > (extents ? MAXEXTFILESIZE / BLKSIZE : 1024))
 		usage();
 
 	opendisk(argv[1]);
@@ -1,5 +1,7 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * Minimal IDE driver code.
+ * Uses bus-master DMA with interrupt completion when the kernel found a
+ * bus-master controller (see kern/ide.c), and PIO otherwise.
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
  */
@@ -12,8 +14,41 @@
 #define IDE_DF		0x20
 #define IDE_ERR		0x01
 
+#define IDE_CMD_READ_DMA	0xC8
+#define IDE_CMD_WRITE_DMA	0xCA
+
+// Bus master registers of the primary channel (offsets from the bus master base)
+#define BM_CMD		0x0	// Command
+#define BM_STATUS	0x2	// Status
+#define BM_PRDT		0x4	// Physical address of the PRD table
+
+#define BM_CMD_START	0x01	// Start the transfer
+#define BM_CMD_READ	0x08	// Transfer direction: disk to memory
+
+#define BM_STATUS_ACTIVE 0x01
+#define BM_STATUS_ERR	0x02
+#define BM_STATUS_INTR	0x04	// Set when the drive raised its interrupt (write 1 to clear)
+
+// Physical region descriptor: one physically contiguous piece of a DMA buffer.
+struct Prd {
+	uint32_t prd_addr;	// Physical address
+	uint16_t prd_len;	// Byte count (0 means 64KB)
+	uint16_t prd_flags;
+};
+#define PRD_EOT		0x8000	// Last entry of the table
+
+// A transfer is at most 256 sectors (128KB), and each page of the buffer needs its own entry.
+#define NPRD		(256 * SECTSIZE / PGSIZE + 1)
+
 static int diskno = 1;
 
+// Bus master base, or 0 to use PIO.
+static uint16_t bmbase;
+
+// The PRD table must not cross a 64KB boundary, so keep it in its own page.
+static struct Prd prdt[NPRD] __attribute__((aligned(PGSIZE)));
+static physaddr_t prdt_pa;
+
 static int
 ide_wait_ready(bool check_error)
 {
@@ -59,6 +94,111 @@ ide_set_disk(int d)
 	diskno = d;
 }
 
+// Switch to bus-master DMA if the kernel found a controller that supports it.
+// Also routes the disk interrupt to us, so DMA transfers sleep instead of spinning.
+void
+ide_dma_init(void)
+{
+	int r;
+
+	if ((r = sys_ide_dma_init()) < 0) {
+		cprintf("IDE: DMA not available (%e), using PIO\n", r);
+		return;
+	}
+	bmbase = r;
+	if ((r = sys_page_phys(prdt)) < 0)
+		panic("ide_dma_init: sys_page_phys: %e", r);
+	prdt_pa = r;
+
+	// Clear nIEN so the drive raises its interrupt at the end of each command.
+	outb(0x3F6, 0);
+	cprintf("IDE: using DMA\n");
+}
+
+// Is bus-master DMA in use? (If not, the driver only does PIO.)
+bool
+ide_dma_enabled(void)
+{
+	return bmbase != 0;
+}
+
+// Start transferring nsecs sectors between the disk and buf with
+// bus-master DMA, and return without waiting for the transfer.
+// The disk interrupts when it is done; then call ide_dma_finish.
+int
+ide_dma_start(uint32_t secno, void *buf, size_t nsecs, bool write)
+{
+	uintptr_t va = (uintptr_t) buf;
+	size_t n = nsecs * SECTSIZE, len;
+	uint8_t dir = write ? 0 : BM_CMD_READ;
+	int i, r;
+
+	assert(bmbase && nsecs <= 256);
+
+	// Build the PRD table. buf is only virtually contiguous, so use one entry per page.
+	for (i = 0; n > 0; i++, va += len, n -= len) {
+		len = MIN(n, PGSIZE - PGOFF(va));
+		if ((r = sys_page_phys((void *) va)) < 0)
+			return r;
+		prdt[i].prd_addr = r;
+		prdt[i].prd_len = len;
+		prdt[i].prd_flags = 0;
+	}
+	prdt[i - 1].prd_flags = PRD_EOT;
+
+	ide_wait_ready(0);
+
+	outl(bmbase + BM_PRDT, prdt_pa);
+	outb(bmbase + BM_CMD, dir);
+	outb(bmbase + BM_STATUS, BM_STATUS_ERR | BM_STATUS_INTR);
+
+	outb(0x1F2, nsecs);
+	outb(0x1F3, secno & 0xFF);
+	outb(0x1F4, (secno >> 8) & 0xFF);
+	outb(0x1F5, (secno >> 16) & 0xFF);
+	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
+	outb(0x1F7, write ? IDE_CMD_WRITE_DMA : IDE_CMD_READ_DMA);
+
+	outb(bmbase + BM_CMD, dir | BM_CMD_START);
+	return 0;
+}
+
+// Complete the transfer started by ide_dma_start after a disk interrupt.
+// Returns 1 if the transfer is still running (the interrupt was not
+// for it), 0 if it finished, and < 0 on a disk error.
+int
+ide_dma_finish(void)
+{
+	int r, st;
+
+	st = inb(bmbase + BM_STATUS);
+	if (!(st & BM_STATUS_INTR))
+		return 1;
+
+	outb(bmbase + BM_CMD, 0);
+	outb(bmbase + BM_STATUS, BM_STATUS_ERR | BM_STATUS_INTR);
+
+	// Reading the drive status also acknowledges its interrupt.
+	r = inb(0x1F7);
+	if ((st & BM_STATUS_ERR) || (r & (IDE_DF|IDE_ERR)) != 0)
+		return -1;
+	return 0;
+}
+
+// Transfer with DMA and sleep until the disk interrupts.
+static int
+ide_dma(uint32_t secno, void *buf, size_t nsecs, bool write)
+{
+	int r;
+
+	if ((r = ide_dma_start(secno, buf, nsecs, write)) < 0)
+		return r;
+	do {
+		if ((r = sys_ide_wait()) < 0)
+			return r;
+	} while ((r = ide_dma_finish()) == 1);
+	return r;
+}
 
 int
 ide_read(uint32_t secno, void *dst, size_t nsecs)
@@ -67,6 +207,9 @@ ide_read(uint32_t secno, void *dst, size_t nsecs)
 
 	assert(nsecs <= 256);
 
+	if (bmbase)
+		return ide_dma(secno, dst, nsecs, 0);
+
 	ide_wait_ready(0);
 
 	outb(0x1F2, nsecs);
@@ -92,6 +235,9 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 
 	assert(nsecs <= 256);
 
+	if (bmbase)
+		return ide_dma(secno, (void *) src, nsecs, 1);
+
 	ide_wait_ready(0);
 
 	outb(0x1F2, nsecs);
@@ -0,0 +1,357 @@
+/*
+ * Disk request queue.
+ *
+ * Blocks that are not in the block cache are read (and dirty blocks
+ * written) through this queue.  Requests go to the disk one at a time
+ * in elevator (C-SCAN) order: the next request is the one with the
+ * lowest block number at or above the last one sent to the disk,
+ * wrapping around to the lowest block number.
+ *
+ * Client requests that would miss in the block cache don't have to
+ * stall the whole file server: the missing blocks are queued with
+ * ioq_read_async on behalf of a "waiter" (a parked client request, see
+ * serv.c) and are read into staging pages.  When a read finishes the
+ * page is mapped at its place in the block cache and the waiter is
+ * told once all of its blocks arrived.  Meanwhile the server keeps
+ * answering other clients; the disk interrupt reaches it as an IPC
+ * message from the kernel (envid 0), which it passes to ioq_intr.
+ *
+ * Page faults on the block cache (bc_pgfault) and flush_block can't be
+ * parked, so they use ioq_read and ioq_write, which queue the block
+ * like any other request and then sleep until it is done.
+ *
+ * Readahead (ioq_readahead) queues runs of blocks that are contiguous
+ * on disk as a single request, so they take one disk command.
+ *
+ * Without DMA (PIO only) there is nothing to overlap, and reads and
+ * writes go straight to the disk.
+ */
+
+#include "fs.h"
+
+#define NIOQ		32
+
+// Staging pages for asynchronous reads, IOQ_MAXBLKS per queue slot.
+#define IOQ_STAGEVA	0xD0A00000
+
+enum {
+	IOQ_FREE = 0,
+	IOQ_QUEUED,		// Waiting for the disk
+	IOQ_ACTIVE		// Being transferred
+};
+
+struct IoReq {
+	int r_state;
+	uint32_t r_blockno;	// First block
+	uint32_t r_nblocks;	// Number of consecutive blocks
+	bool r_write;
+	void *r_buf;		// Transfer buffer: the staging page, or the block itself
+	uint32_t r_waiters;	// Waiters (bit mask) that need this block
+};
+
+static struct IoReq ioq[NIOQ];
+static struct IoReq *ioq_active;
+static uint32_t ioq_head;		// Block number of the last request sent to the disk
+
+// The waiter that ioq_read_async queues blocks for, or -1 for none.
+int ioq_waiter = -1;
+
+static uint8_t ioq_nwait[IOQ_NWAITERS];	// Blocks each waiter still needs
+static uint32_t ioq_ready;		// Waiters whose blocks all arrived
+
+static void *
+stageaddr(struct IoReq *r)
+{
+	return (void *) (IOQ_STAGEVA + (r - ioq) * IOQ_MAXBLKS * PGSIZE);
+}
+
+// Find the queued or active request that covers blockno.
+static struct IoReq *
+ioq_find(uint32_t blockno)
+{
+	int i;
+
+	for (i = 0; i < NIOQ; i++)
+		if (ioq[i].r_state != IOQ_FREE && ioq[i].r_blockno <= blockno
+		    && blockno - ioq[i].r_blockno < ioq[i].r_nblocks)
+			return &ioq[i];
+	return NULL;
+}
+
+// Is blockno queued for (or being read from) the disk?
+bool
+ioq_pending(uint32_t blockno)
+{
+	return ioq_find(blockno) != NULL;
+}
+
+static struct IoReq *
+ioq_alloc(void)
+{
+	int i;
+
+	for (i = 0; i < NIOQ; i++)
+		if (ioq[i].r_state == IOQ_FREE)
+			return &ioq[i];
+	return NULL;
+}
+
+// Send the next request to the disk, if the disk is idle.
+static void
+ioq_kick(void)
+{
+	struct IoReq *r, *next = NULL, *low = NULL;
+	int e;
+
+	if (ioq_active)
+		return;
+
+	for (r = ioq; r < ioq + NIOQ; r++) {
+		if (r->r_state != IOQ_QUEUED)
+			continue;
+		if (r->r_blockno >= ioq_head
+		    && (!next || r->r_blockno < next->r_blockno))
+			next = r;
+		if (!low || r->r_blockno < low->r_blockno)
+			low = r;
+	}
+	if (!next)
+		next = low;
+	if (!next)
+		return;
+
+	if ((e = ide_dma_start(next->r_blockno * BLKSECTS, next->r_buf, next->r_nblocks * BLKSECTS, next->r_write)) < 0)
+		panic("ioq_kick: ide_dma_start: %e", e);
+	next->r_state = IOQ_ACTIVE;
+	ioq_active = next;
+	ioq_head = next->r_blockno;
+}
+
+// A request finished: put staged blocks in the block cache and tell its waiters.
+static void
+ioq_done(struct IoReq *r)
+{
+	char *stage;
+	int e, i, w;
+
+	if (r->r_buf != diskaddr(r->r_blockno)) {
+		for (i = 0; i < r->r_nblocks; i++) {
+			stage = (char *) r->r_buf + i * PGSIZE;
+			if ((e = sys_page_map(0, stage, 0, diskaddr(r->r_blockno + i), PTE_P|PTE_U|PTE_W)) < 0)
+				panic("ioq_done: sys_page_map: %e", e);
+			sys_page_unmap(0, stage);
+		}
+	}
+
+	for (w = 0; w < IOQ_NWAITERS; w++)
+		if ((r->r_waiters & (1 << w)) && --ioq_nwait[w] == 0)
+			ioq_ready |= 1 << w;
+	r->r_state = IOQ_FREE;
+}
+
+// Handle a disk interrupt: complete the active request and start the next one.
+void
+ioq_intr(void)
+{
+	struct IoReq *r = ioq_active;
+	int e;
+
+	if (!r)
+		return;
+	if ((e = ide_dma_finish()) == 1)
+		return;
+	if (e < 0)
+		panic("ioq: disk error on block %08x", r->r_blockno);
+
+	ioq_active = NULL;
+	ioq_done(r);
+	ioq_kick();
+}
+
+// Sleep until the next disk interrupt and handle it.
+static void
+ioq_wait_intr(void)
+{
+	int e;
+
+	if ((e = sys_ide_wait()) < 0)
+		panic("ioq: sys_ide_wait: %e", e);
+	ioq_intr();
+}
+
+// Get a free queue slot, waiting for the disk if the queue is full.
+static struct IoReq *
+ioq_get(void)
+{
+	struct IoReq *r;
+
+	while ((r = ioq_alloc()) == NULL)
+		ioq_wait_intr();
+	return r;
+}
+
+// Queue a read of blockno for the current waiter (ioq_waiter).
+// Returns 1 if the waiter must wait for the block, 0 if the caller
+// should just touch the block (it is cached, there is no waiter, or
+// the queue is full).
+int
+ioq_read_async(uint32_t blockno)
+{
+	struct IoReq *r;
+	int e;
+
+	if (ioq_waiter < 0 || !ide_dma_enabled() || va_is_mapped(diskaddr(blockno)))
+		return 0;
+
+	if ((r = ioq_find(blockno)) == NULL) {
+		// No queue slot or cache slot: read it synchronously instead.
+		if ((r = ioq_alloc()) == NULL || bc_reserve() < 0)
+			return 0;
+		bc_stats.bs_misses++;
+		if ((e = sys_page_alloc(0, stageaddr(r), PTE_P|PTE_U|PTE_W)) < 0)
+			panic("ioq_read_async: sys_page_alloc: %e", e);
+		r->r_blockno = blockno;
+		r->r_nblocks = 1;
+		r->r_write = 0;
+		r->r_buf = stageaddr(r);
+		r->r_waiters = 0;
+		r->r_state = IOQ_QUEUED;
+		ioq_kick();
+	}
+
+	if (!(r->r_waiters & (1 << ioq_waiter))) {
+		r->r_waiters |= 1 << ioq_waiter;
+		ioq_nwait[ioq_waiter]++;
+	}
+	return 1;
+}
+
+// Start reading the nblocks blocks from blockno (consecutive on disk,
+// none of them cached or queued) into the block cache with a single
+// disk command, without waiting for them.  Nobody waits on the
+// request; a client that needs one of the blocks before it arrives
+// waits on it like on any other queued read.  Does nothing if the
+// queue is full, and reads fewer blocks if the block cache is full.
+void
+ioq_readahead(uint32_t blockno, uint32_t nblocks)
+{
+	struct IoReq *r;
+	int e, i;
+
+	assert(nblocks > 0 && nblocks <= IOQ_MAXBLKS);
+
+	if (!ide_dma_enabled()) {
+		// Synchronous, but still one command for the whole run.
+		for (i = 0; i < nblocks; i++) {
+			if (bc_reserve() < 0)
+				break;
+			if ((e = sys_page_alloc(0, diskaddr(blockno + i), PTE_P|PTE_U|PTE_W)) < 0)
+				panic("ioq_readahead: sys_page_alloc: %e", e);
+		}
+		if ((nblocks = i) == 0)
+			return;
+		bc_stats.bs_readahead += nblocks;
+		if ((e = ide_read(blockno * BLKSECTS, diskaddr(blockno), nblocks * BLKSECTS)) < 0)
+			panic("ioq_readahead: ide_read: %e", e);
+		return;
+	}
+
+	if ((r = ioq_alloc()) == NULL)
+		return;
+	for (i = 0; i < nblocks; i++) {
+		if (bc_reserve() < 0)
+			break;
+		if ((e = sys_page_alloc(0, (char *) stageaddr(r) + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("ioq_readahead: sys_page_alloc: %e", e);
+	}
+	if ((nblocks = i) == 0)
+		return;
+	bc_stats.bs_readahead += nblocks;
+	r->r_blockno = blockno;
+	r->r_nblocks = nblocks;
+	r->r_write = 0;
+	r->r_buf = stageaddr(r);
+	r->r_waiters = 0;
+	r->r_state = IOQ_QUEUED;
+	ioq_kick();
+}
+
+// Return (and clear) the set of waiters whose blocks have all arrived.
+uint32_t
+ioq_take_ready(void)
+{
+	uint32_t ready = ioq_ready;
+
+	ioq_ready = 0;
+	return ready;
+}
+
+// Queue a transfer of nblocks blocks at their block cache address, and sleep until it is done.
+static void
+ioq_sync(uint32_t blockno, uint32_t nblocks, bool write)
+{
+	struct IoReq *r = ioq_get();
+
+	r->r_blockno = blockno;
+	r->r_nblocks = nblocks;
+	r->r_write = write;
+	r->r_buf = diskaddr(blockno);
+	r->r_waiters = 0;
+	r->r_state = IOQ_QUEUED;
+	ioq_kick();
+
+	// Nothing else allocates queue slots while we sleep here,
+	// so r stays ours until it is done.
+	while (r->r_state != IOQ_FREE)
+		ioq_wait_intr();
+}
+
+// Read blockno into the block cache, and return once it is mapped.
+void
+ioq_read(uint32_t blockno)
+{
+	void *blk = diskaddr(blockno);
+	struct IoReq *r;
+	int e;
+
+	// Already on its way for a parked request: wait for that read.
+	if ((r = ioq_find(blockno)) != NULL) {
+		while (r->r_state != IOQ_FREE)
+			ioq_wait_intr();
+		return;
+	}
+
+	// A full cache of blocks still on their way from the disk frees up
+	// as the reads complete.
+	while (bc_reserve() < 0) {
+		if (!ioq_active)
+			panic("ioq_read: block cache full, nothing to evict");
+		ioq_wait_intr();
+	}
+	bc_stats.bs_misses++;
+	if ((e = sys_page_alloc(0, blk, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("ioq_read: sys_page_alloc: %e", e);
+	if (!ide_dma_enabled()) {
+		if ((e = ide_read(blockno * BLKSECTS, blk, BLKSECTS)) < 0)
+			panic("ioq_read: ide_read: %e", e);
+		return;
+	}
+	ioq_sync(blockno, 1, 0);
+}
+
+// Write the cached copies of the nblocks blocks from blockno to disk
+// with a single disk command, and return once they are written.
+void
+ioq_write(uint32_t blockno, uint32_t nblocks)
+{
+	int e;
+
+	assert(nblocks > 0 && nblocks <= IOQ_MAXBLKS);
+
+	if (!ide_dma_enabled()) {
+		if ((e = ide_write(blockno * BLKSECTS, diskaddr(blockno), nblocks * BLKSECTS)) < 0)
+			panic("ioq_write: ide_write: %e", e);
+		return;
+	}
+	ioq_sync(blockno, nblocks, 1);
+}
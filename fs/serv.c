@@ -34,8 +34,16 @@ struct OpenFile {
 	struct File *o_file;	// mapped descriptor for open file
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+	off_t o_ra_next;	// readahead: offset where a sequential reader reads next
+	uint32_t o_ra_win;	// readahead: window size in blocks (0 if not sequential)
+	uint32_t o_ra_end;	// readahead: first file block not read ahead yet
 };
 
+// Readahead window of a sequential reader: starts at RA_MIN blocks and
+// doubles with every window up to RA_MAX (one disk command).
+#define RA_MIN		2
+#define RA_MAX		IOQ_MAXBLKS
+
 // Max number of open files in the file system at once
 #define MAXOPEN		1024
 #define FILEVA		0xD0000000
@@ -46,7 +54,27 @@ struct OpenFile opentab[MAXOPEN] = {
 };
 
 // Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+// A bulk write brings up to FSBULK_MAXPAGES data pages right after the request page.
+// This and the other fixed mappings of the file server (PARKVA, BULKVA, the
+// staging pages in ioq.c) sit above the fd table, clear of the malloc heap.
+#define FSREQVA		0xD0800000
+#define FSREQ_MAXPAGES	(1 + FSBULK_MAXPAGES)
+union Fsipc *fsreq = (union Fsipc *) FSREQVA;
+
+// Requests that are waiting for disk reads (see ioq.c).
+// A parked request keeps its argument page at PARKVA + i*PGSIZE, where i is its waiter number.
+#define PARKVA		0xD0900000
+
+struct Parked {
+	bool p_used;
+	envid_t p_whom;		// client
+	uint32_t p_req;		// request code
+};
+
+struct Parked parked[IOQ_NWAITERS];
+
+// Reply pages of a bulk read, unmapped again once they are sent.
+#define BULKVA		(PARKVA + IOQ_NWAITERS * PGSIZE)
 
 void
 serve_init(void)
@@ -75,6 +103,9 @@ openfile_alloc(struct OpenFile **o)
 			/* fall through */
 		case 1:
 			opentab[i].o_fileid += MAXOPEN;
+			opentab[i].o_ra_next = 0;
+			opentab[i].o_ra_win = 0;
+			opentab[i].o_ra_end = 0;
 			*o = &opentab[i];
 			memset(opentab[i].o_fd, 0, PGSIZE);
 			return (*o)->o_fileid;
@@ -200,6 +231,29 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *req)
 	return file_set_size(o->o_file, req->req_size);
 }
 
+// Read ahead of a sequential reader of o, which is about to read at offset.
+// A new window is started when the reader is halfway through the last
+// one, so the disk stays ahead of it. A seek turns readahead off until
+// the reader is sequential again.
+static void
+serve_readahead(struct OpenFile *o, off_t offset)
+{
+	uint32_t bno = offset / BLKSIZE, start;
+
+	if (offset != o->o_ra_next) {
+		o->o_ra_win = 0;
+		return;
+	}
+	if (o->o_ra_win > 0 && bno + o->o_ra_win / 2 < o->o_ra_end)
+		return;
+
+	// The first window includes the block being read, so the miss and the readahead take one disk command.
+	start = o->o_ra_win > 0 ? MAX(bno, o->o_ra_end) : bno;
+	o->o_ra_win = MIN(MAX(2 * o->o_ra_win, RA_MIN), RA_MAX);
+	o->o_ra_end = start + o->o_ra_win;
+	file_readahead(o->o_file, start, o->o_ra_win);
+}
+
 // Read at most ipc->read.req_n bytes from the current seek position
 // in ipc->read.req_fileid.  Return the bytes read from the file to
 // the caller in ipc->readRet, then update the seek position.  Returns
@@ -231,15 +285,70 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	if (req->req_n > PGSIZE) {
 		n_to_read = PGSIZE; 
 	}
+	serve_readahead(o, o->o_fd->fd_offset); 
+	
+	// If the blocks aren't cached, let the disk fetch them while we serve other clients. 
+	if ((r = file_cache_range(o->o_file, o->o_fd->fd_offset, n_to_read)) < 0)
+		return r; 
+	
 	// Read req_n bytes into ret_buf. 
 	if ((n_read = file_read(o->o_file, ret->ret_buf, n_to_read, o->o_fd->fd_offset)) < 0 ) 
 		return n_read;
 	
 	// The file descriptor keeps track of the offset for this file. Update it. 
 	o->o_fd->fd_offset = o->o_fd->fd_offset + n_read; 
+	o->o_ra_next = o->o_fd->fd_offset; 
 	return n_read; 
 }
 
+// Read at most ipc->bulk.req_n bytes (up to FSBULK_MAXPAGES pages)
+// from the current seek position in ipc->bulk.req_fileid into fresh
+// pages at BULKVA, and set *pg_store and *npages_store to the pages
+// to send back.  Returns the number of bytes read, or < 0 on error.
+int
+serve_read_bulk(envid_t envid, union Fsipc *ipc, void **pg_store, size_t *npages_store)
+{
+	struct Fsreq_bulk *req = &ipc->bulk;
+	struct OpenFile *o;
+	off_t offset;
+	size_t n, npages, i;
+	ssize_t n_read;
+	int r;
+
+	if (debug)
+		cprintf("serve_read_bulk %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+
+	offset = o->o_fd->fd_offset;
+	if (offset >= o->o_file->f_size)
+		return 0;
+	n = MIN(req->req_n, (size_t) (o->o_file->f_size - offset));
+	n = MIN(n, FSBULK_MAXPAGES * PGSIZE);
+
+	serve_readahead(o, offset);
+	if ((r = file_cache_range(o->o_file, offset, n)) < 0)
+		return r;
+
+	npages = ROUNDUP(n, PGSIZE) / PGSIZE;
+	for (i = 0; i < npages; i++)
+		if ((r = sys_page_alloc(0, (char *) BULKVA + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			goto fail;
+	if ((r = n_read = file_read(o->o_file, (void *) BULKVA, n, offset)) < 0)
+		goto fail;
+
+	o->o_fd->fd_offset = offset + n_read;
+	o->o_ra_next = o->o_fd->fd_offset;
+	*pg_store = (void *) BULKVA;
+	*npages_store = npages;
+	return n_read;
+
+fail:
+	for (i = 0; i < npages; i++)
+		sys_page_unmap(0, (char *) BULKVA + i * PGSIZE);
+	return r;
+}
 
 // Write req->req_n bytes from req->req_buf to req_fileid, starting at
 // the current seek position, and update the seek position
@@ -268,6 +377,9 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 	// Ensure that not requesting to write more data than sent. 
 	assert(req->req_n <= PGSIZE - (sizeof(int) + sizeof(size_t))); 
 
+	// Blocks that are partly overwritten must be read in first; don't wait for them here. 
+	if ((r = file_cache_range(o->o_file, o->o_fd->fd_offset, req->req_n)) < 0)
+		return r; 
 	
 	// Read req_n bytes into ret_buf. 
 	if ((n_write = file_write(o->o_file, req->req_buf, req->req_n, o->o_fd->fd_offset)) < 0 ) {
@@ -282,6 +394,101 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 	
 }
 
+// Map the file block at page-aligned offset ipc->map.req_offset of
+// ipc->map.req_fileid into the client (mmap).  The client gets the
+// block cache page itself, read-only, so it sees later writes to the
+// block for as long as the block stays cached.  The last block of
+// the file is copied to a fresh page instead, to hide what lies past
+// the end of the file.
+int
+serve_map(envid_t envid, union Fsipc *ipc, void **pg_store, int *perm_store)
+{
+	struct Fsreq_map *req = &ipc->map;
+	struct OpenFile *o;
+	off_t offset = req->req_offset;
+	char *blk;
+	int r, n;
+
+	if (debug)
+		cprintf("serve_map %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((o->o_mode & O_ACCMODE) == O_WRONLY)
+		return -E_INVAL;
+	if (offset < 0 || offset % BLKSIZE != 0 || offset >= o->o_file->f_size)
+		return -E_INVAL;
+
+	// Faults of a sequential reader get readahead like reads do.
+	serve_readahead(o, offset);
+	o->o_ra_next = offset + BLKSIZE;
+	if ((r = file_cache_range(o->o_file, offset, BLKSIZE)) < 0)
+		return r;
+	if ((r = file_get_block(o->o_file, offset / BLKSIZE, &blk)) < 0)
+		return r;
+
+	if ((n = o->o_file->f_size - offset) < BLKSIZE) {
+		if ((r = sys_page_alloc(0, (void *) BULKVA, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+		memmove((void *) BULKVA, blk, n);
+		blk = (char *) BULKVA;
+	}
+	*pg_store = blk;
+	*perm_store = PTE_P|PTE_U;
+	return 0;
+}
+
+// Return read-only pages of program ipc->mapText.req_fileid, from
+// page-aligned offset ipc->mapText.req_offset and covering at most
+// ipc->mapText.req_n bytes, out of the text cache (see text.c).
+// Returns the number of bytes covered, or < 0 on error.
+int
+serve_map_text(envid_t envid, union Fsipc *ipc, void **pg_store, size_t *npages_store, int *perm_store)
+{
+	struct Fsreq_map_text *req = &ipc->mapText;
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_map_text %08x %08x %08x %08x\n", envid, req->req_fileid, req->req_offset, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((o->o_mode & O_ACCMODE) == O_WRONLY)
+		return -E_INVAL;
+	*perm_store = PTE_P|PTE_U;
+	return text_map(o->o_file, req->req_offset, req->req_n, pg_store, npages_store);
+}
+
+// Write ipc->bulk.req_n bytes from the data pages that follow the
+// request page to ipc->bulk.req_fileid, like serve_write.  Bulk
+// writes are never parked, so this waits for any blocks it needs.
+int
+serve_write_bulk(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_bulk *req = &ipc->bulk;
+	char *data = (char *) ipc + PGSIZE;
+	struct OpenFile *o;
+	size_t i;
+	int r;
+
+	if (debug)
+		cprintf("serve_write_bulk %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_n > FSBULK_MAXPAGES * PGSIZE)
+		return -E_INVAL;
+	for (i = 0; i < req->req_n; i += PGSIZE)
+		if (!va_is_mapped(data + i))
+			return -E_INVAL;
+
+	if ((r = file_write(o->o_file, data, req->req_n, o->o_fd->fd_offset)) < 0)
+		return r;
+	o->o_fd->fd_offset += r;
+	return r;
+}
+
 // Stat ipc->stat.req_fileid.  Return the file's struct Stat to the
 // caller in ipc->statRet.
 int
@@ -328,6 +535,14 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+// Return the block cache counters in ipc->statsRet.
+int
+serve_stats(envid_t envid, union Fsipc *ipc)
+{
+	ipc->statsRet = bc_stats;
+	return 0;
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
@@ -338,23 +553,143 @@ fshandler handlers[] = {
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_STATS] =		serve_stats,
+	[FSREQ_WRITE_BULK] =	serve_write_bulk
 };
 
+// Run request 'req' from 'whom' with its argument page at 'ipc'. 
+// On return *pg, *npages and *perm describe the pages to send back. 
+// Returns -E_PENDING if it has to wait for the disk. 
+static int
+serve_request(envid_t whom, uint32_t req, union Fsipc *ipc, void **pg, size_t *npages, int *perm)
+{
+	*pg = NULL;
+	*npages = 1;
+	if (req == FSREQ_OPEN)
+		return serve_open(whom, (struct Fsreq_open*)ipc, pg, perm);
+	if (req == FSREQ_MAP)
+		return serve_map(whom, ipc, pg, perm);
+	if (req == FSREQ_MAP_TEXT)
+		return serve_map_text(whom, ipc, pg, npages, perm);
+	if (req == FSREQ_READ_BULK) {
+		*perm = PTE_P|PTE_U|PTE_W;
+		return serve_read_bulk(whom, ipc, pg, npages);
+	}
+	if (req < ARRAY_SIZE(handlers) && handlers[req])
+		return handlers[req](whom, ipc);
+	cprintf("Invalid request code %d from %08x\n", req, whom);
+	return -E_INVAL;
+}
+
+static union Fsipc *
+parkaddr(int i)
+{
+	return (union Fsipc *) (PARKVA + i * PGSIZE);
+}
+
+// Free waiter number for the next request, or -1 if all are parked
+// (the request then waits for the disk synchronously).
+static int
+park_alloc(void)
+{
+	int i;
+
+	for (i = 0; i < IOQ_NWAITERS; i++)
+		if (!parked[i].p_used)
+			return i;
+	return -1;
+}
+
+// Park the request in fsreq as waiter i, until its blocks arrive.
+static void
+park(int i, envid_t whom, uint32_t req)
+{
+	int r;
+
+	if ((r = sys_page_map(0, fsreq, 0, parkaddr(i), PTE_P|PTE_U|PTE_W)) < 0)
+		panic("park: sys_page_map: %e", r);
+	sys_page_unmap(0, fsreq);
+	parked[i].p_used = 1;
+	parked[i].p_whom = whom;
+	parked[i].p_req = req;
+}
+
+// Send the reply to a request, and drop the reply pages of a bulk read.
+static void
+serve_reply(envid_t whom, int r, void *pg, size_t npages, int perm)
+{
+	size_t i;
+
+	ipc_send_pages(whom, r, pg, npages, perm);
+	if (pg == (void *) BULKVA)
+		for (i = 0; i < npages; i++)
+			sys_page_unmap(0, (char *) BULKVA + i * PGSIZE);
+}
+
+// Run the parked requests whose blocks have arrived, and reply to them.
+// A request can park again (e.g. after its indirect block arrived it
+// needs the data blocks).
+static void
+serve_parked(void)
+{
+	uint32_t ready;
+	void *pg;
+	size_t npages;
+	int i, r, perm;
+
+	while ((ready = ioq_take_ready()) != 0) {
+		for (i = 0; i < IOQ_NWAITERS; i++) {
+			if (!(ready & (1 << i)))
+				continue;
+			perm = 0;
+			ioq_waiter = i;
+			r = serve_request(parked[i].p_whom, parked[i].p_req, parkaddr(i), &pg, &npages, &perm);
+			ioq_waiter = -1;
+			if (r == -E_PENDING)
+				continue;
+			serve_reply(parked[i].p_whom, r, pg, npages, perm);
+			sys_page_unmap(0, parkaddr(i));
+			parked[i].p_used = 0;
+		}
+	}
+}
+
 void
 serve(void)
 {
 	uint32_t req, whom;
 	int perm, r;
+	size_t nreq, npages, i;
 	void *pg;
 
 	while (1) {
+		serve_parked();
+
 		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		nreq = FSREQ_MAXPAGES;
+		if ((r = ipc_recv_pages((int32_t *) &whom, fsreq, &nreq, &perm)) < 0) {
+			// Nothing was received (whom is 0 then, too).
+			cprintf("fs: ipc_recv_pages: %e\n", r);
+			continue;
+		}
+		req = r;
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
 
+		// The kernel sends disk interrupts and the flush timer as messages from envid 0
+		if (whom == 0) {
+			if (req == FSNOTE_TIMER) {
+				bc_flush_dirty();
+				sys_fs_timer(BC_FLUSH_MS);
+			} else if (req == FSNOTE_DISK)
+				ioq_intr();
+			else
+				cprintf("fs: unknown kernel note %d\n", req);
+			continue;
+		}
+
 		// All requests must contain an argument page
 		if (!(perm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n",
@@ -362,17 +697,19 @@ serve(void)
 			continue; // just leave it hanging...
 		}
 
-		pg = NULL;
-		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
-		} else if (req < ARRAY_SIZE(handlers) && handlers[req]) {
-			r = handlers[req](whom, fsreq);
-		} else {
-			cprintf("Invalid request code %d from %08x\n", req, whom);
-			r = -E_INVAL;
+		// Only single-page requests can be parked.
+		ioq_waiter = nreq == 1 ? park_alloc() : -1;
+		r = serve_request(whom, req, fsreq, &pg, &npages, &perm);
+		if (r == -E_PENDING) {
+			// Reply once the disk has the blocks; serve others meanwhile.
+			park(ioq_waiter, whom, req);
+			ioq_waiter = -1;
+			continue;
 		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		ioq_waiter = -1;
+		serve_reply(whom, r, pg, npages, perm);
+		for (i = 0; i < nreq; i++)
+			sys_page_unmap(0, (char *) fsreq + i * PGSIZE);
 	}
 }
 
@@ -389,6 +726,7 @@ umain(int argc, char **argv)
 
 	serve_init();
 	fs_init();
+	sys_fs_timer(BC_FLUSH_MS);
 	serve();
 }
 
@@ -51,12 +51,17 @@ fs_test(void)
 	if ((r = file_set_size(f, 0)) < 0)
 		panic("file_set_size: %e", r);
 	assert(f->f_direct[0] == 0);
-	assert(!(uvpt[PGNUM(f)] & PTE_D));
+	// metadata is written back later, not by file_set_size
+	assert((uvpt[PGNUM(f)] & PTE_D));
 	cprintf("file_truncate is good\n");
 
+	// Too big for the file's block map (or extents)
+	r = file_set_size(f, ((f->f_flags & FILE_EXTENTS) ? MAXEXTFILESIZE : MAXFILESIZE) + 1);
+	assert(r == -E_INVAL && f->f_size == 0);
+
 	if ((r = file_set_size(f, strlen(msg))) < 0)
 		panic("file_set_size 2: %e", r);
-	assert(!(uvpt[PGNUM(f)] & PTE_D));
+	assert((uvpt[PGNUM(f)] & PTE_D));
 	if ((r = file_get_block(f, 0, &blk)) < 0)
 		panic("file_get_block 2: %e", r);
 	strcpy(blk, msg);
@@ -0,0 +1,142 @@
+/*
+ * Executable text cache.
+ *
+ * spawn maps the read-only segments of a program (text, rodata) from
+ * pages that the file server hands out with FSREQ_MAP_TEXT.  The file
+ * server keeps those pages mapped in a slot of its own address space
+ * for each of the last NTEXT programs, so every instance of a program
+ * shares one set of physical pages, even after the blocks are evicted
+ * from the block cache.  A slot is keyed by the program's File and is
+ * dropped whenever the file is written or resized (text_invalidate), so
+ * spawns after a rebuild get the new text.
+ *
+ * Most pages are the block cache's own pages, mapped read-only.  When a
+ * slot is dropped, the block cache gets copies of the blocks it still
+ * shares with the slot (bc_unshare), so writes to the file never change
+ * the text of instances that are already running.
+ */
+
+#include "fs.h"
+
+#define NTEXT		16
+#define TEXTSLOT	(TEXT_MAXPAGES * PGSIZE)
+#define TEXTVA		0xE0000000
+
+struct Text {
+	struct File *t_file;	// Program whose pages are in the slot, or 0
+	uint32_t t_used;	// When the slot was last used, for LRU
+	uint32_t t_blockno[TEXT_MAXPAGES];	// Block each page shares with the block cache, or 0
+};
+
+static struct Text texts[NTEXT];
+static uint32_t text_clock;
+
+static char *
+textaddr(struct Text *t)
+{
+	return (char *) (TEXTVA + (t - texts) * TEXTSLOT);
+}
+
+// Unmap the pages of slot t and free it.
+static void
+text_drop(struct Text *t)
+{
+	char *va;
+	int i;
+
+	for (i = 0, va = textaddr(t); i < TEXT_MAXPAGES; i++, va += PGSIZE) {
+		if (!va_is_mapped(va))
+			continue;
+		if (t->t_blockno[i])
+			bc_unshare(diskaddr(t->t_blockno[i]), va);
+		sys_page_unmap(0, va);
+		t->t_blockno[i] = 0;
+	}
+	t->t_file = 0;
+	t->t_used = 0;
+}
+
+// Find the slot of f, or recycle the least recently used one for it.
+static struct Text *
+text_lookup(struct File *f)
+{
+	struct Text *t, *lru = &texts[0];
+
+	for (t = texts; t < texts + NTEXT; t++) {
+		if (t->t_file == f)
+			return t;
+		if (t->t_used < lru->t_used)
+			lru = t;
+	}
+	if (lru->t_file)
+		text_drop(lru);
+	lru->t_file = f;
+	return lru;
+}
+
+// Set *pg_store to the cached pages of f from the page-aligned offset,
+// covering at most n bytes and FSBULK_MAXPAGES pages, and
+// *npages_store to their number.  Missing pages are filled in from the
+// block cache; the last block of the file is copied, so nothing past
+// the end of the file is visible.
+// Returns the number of bytes covered, -E_PENDING if blocks have to be
+// read from disk first, or another < 0 error.
+int
+text_map(struct File *f, off_t offset, size_t n, void **pg_store, size_t *npages_store)
+{
+	struct Text *t;
+	char *va, *blk;
+	size_t npages, i;
+	off_t pos;
+	int r;
+
+	if (offset < 0 || offset % PGSIZE != 0 || offset >= f->f_size)
+		return -E_INVAL;
+	n = MIN(n, (size_t) (f->f_size - offset));
+	n = MIN(n, FSBULK_MAXPAGES * PGSIZE);
+	if (offset + n > TEXTSLOT)
+		return -E_INVAL;
+	npages = ROUNDUP(n, PGSIZE) / PGSIZE;
+
+	t = text_lookup(f);
+	t->t_used = ++text_clock;
+	va = textaddr(t) + offset;
+
+	for (i = 0; i < npages; i++)
+		if (!va_is_mapped(va + i * PGSIZE))
+			break;
+	if (i < npages && (r = file_cache_range(f, offset, n)) < 0)
+		return r;
+
+	for (; i < npages; i++) {
+		if (va_is_mapped(va + i * PGSIZE))
+			continue;
+		pos = offset + i * PGSIZE;
+		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+			return r;
+		if (f->f_size - pos < BLKSIZE) {
+			if ((r = sys_page_alloc(0, va + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+				return r;
+			memmove(va + i * PGSIZE, blk, f->f_size - pos);
+		} else {
+			if ((r = sys_page_map(0, blk, 0, va + i * PGSIZE, PTE_P|PTE_U)) < 0)
+				return r;
+			t->t_blockno[pos / PGSIZE] = ((uint32_t) blk - DISKMAP) / BLKSIZE;
+		}
+	}
+
+	*pg_store = va;
+	*npages_store = npages;
+	return n;
+}
+
+// f is being changed: forget its pages.
+void
+text_invalidate(struct File *f)
+{
+	struct Text *t;
+
+	for (t = texts; t < texts + NTEXT; t++)
+		if (t->t_file == f)
+			text_drop(t);
+}
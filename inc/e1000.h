@@ -0,0 +1,50 @@
+// See COPYRIGHT for copyright information.
+
+#ifndef JOS_INC_E1000_H
+#define JOS_INC_E1000_H
+
+#include <inc/types.h>
+
+// Receive modes of the E1000 driver.
+// In interrupt mode the input environment sleeps until the NIC raises a (moderated) receive interrupt.
+// In polling mode the input environment keeps polling the receive ring while packets keep arriving.
+enum {
+	E1000_RX_MODE_INTR = 0,
+	E1000_RX_MODE_POLL
+};
+
+// Receive counters exported by the driver (see sys_net_stats), used to tune the moderation registers.
+struct NicStats {
+	uint32_t ns_rx_mode;		// Current receive mode (E1000_RX_MODE_*)
+	uint32_t ns_rx_packets;		// Packets handed to the input environment
+	uint32_t ns_rx_intrs;		// Receive interrupts taken
+	uint32_t ns_rx_polls;		// Empty polls of the receive ring while in polling mode
+	uint32_t ns_rx_sleeps;		// Times the input environment blocked waiting for an interrupt
+	uint32_t ns_rx_to_poll;		// Switches from interrupt mode to polling mode
+	uint32_t ns_rx_to_intr;		// Switches from polling mode to interrupt mode
+	uint32_t ns_tx_packets;		// Packets queued for transmission
+	uint32_t ns_tx_tso;		// Large TCP segments handed to the E1000 for segmentation (sys_transmit_tso)
+	uint32_t ns_tx_zcopy;		// Fragments the E1000 read straight from the sender's page (TXSEG_NOCOPY)
+};
+
+// One fragment of a packet handed to sys_transmit_sg.
+// The driver places each fragment in its own transmit descriptor and sets EOP on the last one.
+struct TxSeg {
+	const void *ts_addr;		// Start of the fragment (user virtual address)
+	size_t ts_len;			// Length of the fragment in bytes
+	uint32_t ts_flags;		// TXSEG_*
+};
+
+// The sender leaves the fragment's bytes alone until the frame is on the wire (e.g. TCP data, which is kept
+// until the peer acknowledges it). The E1000 may then read the fragment straight from the sender's page
+// instead of from a copy in the descriptor's buffer.
+#define TXSEG_NOCOPY		0x1
+
+// Maximum number of fragments (descriptors) per scatter-gather packet
+#define E1000_TX_MAX_SEGS	8
+
+// Limits of sys_transmit_tso: fragments per large segment, and bytes per large segment (headers included). 
+#define E1000_TSO_MAX_SEGS	16
+#define E1000_TSO_MAX_LEN	(16 * 4096)
+
+#endif	// !JOS_INC_E1000_H
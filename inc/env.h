@@ -76,6 +76,18 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	size_t env_ipc_maxpages;	// Pages willing to receive at env_ipc_dstva
+	size_t env_ipc_npages;		// Pages received (sys_ipc_recv_pages)
+	uint32_t env_ipc_nrecv;		// Bumped when env starts receiving or dies; senders futex_wait on it
+
+	// Futex wait (kern/futex.c)
+	physaddr_t env_futex_pa;	// Physical address of the word env is blocked on, or 0
+	uint32_t env_futex_deadline;	// time_msec() at which the wait times out, or 0
+	struct Env *env_futex_link;	// Next waiter in the same hash bucket
+
+	// FPU state (kern/fpu.c)
+	struct Fpregs *env_fpregs;	// Saved x87/SSE registers, or null until env first uses them
+	int env_fpu_cpu;		// CPU that last loaded env's registers, or -1
 };
 
 #endif // !JOS_INC_ENV_H
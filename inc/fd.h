@@ -21,14 +21,43 @@ struct Dev {
 	int (*dev_close)(struct Fd *fd);
 	int (*dev_stat)(struct Fd *fd, struct Stat *stat);
 	int (*dev_trunc)(struct Fd *fd, off_t length);
+	// Non-blocking readiness check for poll(): returns the subset of POLL* 'events' that would not block now (plus POLLHUP/POLLERR). 
+	// If NULL, the device is always ready (e.g. files). 
+	int (*dev_poll)(struct Fd *fd, int events);
+};
+
+// Events for poll()
+#define POLLIN		0x0001		// Data can be read without blocking
+#define POLLOUT		0x0004		// Data can be written without blocking
+#define POLLERR		0x0008		// Error (revents only)
+#define POLLHUP		0x0010		// Other end closed (revents only)
+#define POLLNVAL	0x0020		// Not an open file descriptor (revents only)
+
+struct pollfd {
+	int fd;			// File descriptor to watch (ignored if negative)
+	short events;		// Events of interest
+	short revents;		// Events that occurred (set by poll)
 };
 
 struct FdFile {
 	int id;
 };
 
+// Most network server shards a socket can have copies in (see lib/sockets.c)
+#define FDSOCK_MAXSHARDS	4
+
 struct FdSock {
-	int sockid;
+	int sockid;		// Socket id in its network server shard
+	int shard;		// Shard the socket lives in
+	int domain, type, protocol;	// As given to socket()
+	// Address given to bind(), for the copies of a listening socket
+	char name[16];
+	int namelen;
+	// A listening TCP socket has a copy in every shard: lsockids[i] is
+	// its id in shard i.  nlisten is the number of shards (0 if the
+	// socket was not copied).
+	int nlisten;
+	int lsockids[FDSOCK_MAXSHARDS];
 };
 
 struct Fd {
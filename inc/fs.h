@@ -26,24 +26,75 @@
 
 #define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
 
+// Extent: e_len blocks of a file, starting at file block e_fblock,
+// stored on disk at blocks e_start .. e_start + e_len - 1.
+struct Extent {
+	uint32_t e_fblock;		// first file block
+	uint32_t e_start;		// first disk block
+	uint32_t e_len;			// length in blocks; 0 ends the extent list
+} __attribute__((packed));
+
+// Number of extents in a File descriptor
+#define NEXTENT		8
+// Number of extents in an extent block
+#define NBLKEXTENT	(BLKSIZE / sizeof(struct Extent))
+// Extent files are limited by the number of extents, not by a block map.
+// (Their size is an off_t, and a contiguous file needs a single extent.)
+#define MAXEXTFILESIZE	0x40000000
+
 struct File {
 	char f_name[MAXNAMELEN];	// filename
 	off_t f_size;			// file size in bytes
 	uint32_t f_type;		// file type
 
-	// Block pointers.
-	// A block is allocated iff its value is != 0.
-	uint32_t f_direct[NDIRECT];	// direct blocks
-	uint32_t f_indirect;		// indirect block
+	union {
+		// Block pointers (unless FILE_EXTENTS).
+		// A block is allocated iff its value is != 0.
+		struct {
+			uint32_t f_direct[NDIRECT];	// direct blocks
+			uint32_t f_indirect;		// indirect block
+		};
+		// Extents (if FILE_EXTENTS), sorted by file block.
+		struct {
+			struct Extent f_extents[NEXTENT];
+			uint32_t f_extblock;		// block with more extents
+		};
+	};
+	uint32_t f_flags;		// FILE_* flags
+
+	// Directory index (see dir_hash).
+	uint32_t f_dirhash;		// Directories: hash bucket block, or 0 if not indexed
+	uint32_t f_hnext;		// Entries of an indexed directory: next slot + 1 in the same bucket, or 0
 
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+	uint8_t f_pad[256 - MAXNAMELEN - 8 - sizeof(struct Extent)*NEXTENT - 4 - 4 - 8];
 } __attribute__((packed));	// required only on some 64-bit machines
 
+// File flags
+#define FILE_EXTENTS	0x1	// Blocks are mapped by extents instead of block pointers
+
 // An inode block contains exactly BLKFILES 'struct File's
 #define BLKFILES	(BLKSIZE / sizeof(struct File))
 
+// Directory index: a directory with more than one block of entries has
+// a bucket block (f_dirhash) of DIRHASH_NBUCKETS chain heads. Entry
+// slot s of the directory (entry s % BLKFILES of directory block
+// s / BLKFILES) is on the chain of bucket dir_hash(name) % DIRHASH_NBUCKETS;
+// heads and f_hnext links hold s + 1, and 0 ends a chain.
+#define DIRHASH_NBUCKETS	(BLKSIZE / 4)
+
+// FNV-1a hash of a file name, shared by the file server and fsformat.
+static inline uint32_t
+dir_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619U;
+	return h;
+}
+
 // File types
 #define FTYPE_REG	0	// Regular file
 #define FTYPE_DIR	1	// Directory
@@ -57,8 +108,12 @@ struct Super {
 	uint32_t s_magic;		// Magic number: FS_MAGIC
 	uint32_t s_nblocks;		// Total number of blocks on disk
 	struct File s_root;		// Root directory node
+	uint32_t s_flags;		// FS_* flags
 };
 
+// Superblock flags
+#define FS_EXTENTS	0x1	// New files are extent files (see fsformat -e)
+
 // Definitions for requests from clients to file system
 enum {
 	FSREQ_OPEN = 1,
@@ -70,7 +125,42 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Stats returns a BcStats on the request page
+	FSREQ_STATS,
+	// Bulk read and write take a Fsreq_bulk. Bulk read returns the
+	// data on up to FSBULK_MAXPAGES reply pages; bulk write sends the
+	// data on the pages that follow the request page.
+	FSREQ_READ_BULK,
+	FSREQ_WRITE_BULK,
+	// Map returns the block at a Fsreq_map's page-aligned offset as a
+	// read-only page (see mmap)
+	FSREQ_MAP,
+	// Map text returns up to FSBULK_MAXPAGES read-only pages of a
+	// program from the text cache (see spawn)
+	FSREQ_MAP_TEXT
+};
+
+// Most data pages moved by one bulk request
+#define FSBULK_MAXPAGES	32
+
+// Block cache counters of the file server (see FSREQ_STATS), used to size the cache.
+struct BcStats {
+	uint32_t bs_hits;		// Blocks that client reads and writes found in the cache
+	uint32_t bs_misses;		// Blocks read from disk on demand
+	uint32_t bs_readahead;		// Blocks read from disk ahead of a sequential reader
+	uint32_t bs_evictions;		// Blocks dropped from the cache to make room
+	uint32_t bs_writebacks;		// Dirty blocks written back by the eviction clock
+	uint32_t bs_cached;		// Blocks in the cache now (including reads in flight)
+	uint32_t bs_max;		// Capacity of the cache in blocks
+	uint32_t bs_dhits;		// Path components found in the name cache
+	uint32_t bs_dmisses;		// Path components looked up in their directory
+};
+
+// Notifications the kernel sends to the file server, as IPC messages from envid 0
+enum {
+	FSNOTE_DISK = 0,	// Disk interrupt
+	FSNOTE_TIMER		// Flush timer (see sys_fs_timer) expired
 };
 
 union Fsipc {
@@ -94,6 +184,19 @@ union Fsipc {
 		size_t req_n;
 		char req_buf[PGSIZE - (sizeof(int) + sizeof(size_t))];
 	} write;
+	struct Fsreq_bulk {
+		int req_fileid;
+		size_t req_n;
+	} bulk;
+	struct Fsreq_map {
+		int req_fileid;
+		off_t req_offset;
+	} map;
+	struct Fsreq_map_text {
+		int req_fileid;
+		off_t req_offset;
+		size_t req_n;
+	} mapText;
 	struct Fsreq_stat {
 		int req_fileid;
 	} stat;
@@ -108,6 +211,7 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct BcStats statsRet;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
@@ -22,15 +22,26 @@
 #include <inc/args.h>
 #include <inc/malloc.h>
 #include <inc/ns.h>
+#include <inc/e1000.h>
+#include <inc/task.h>
 
 #define USED(x)		(void)(x)
 
 // main user program
 void	umain(int argc, char **argv);
 
+// Per-environment data, mapped at UTLS by libmain.  Environments made
+// with sfork share all memory except this page (and their stacks).
+struct Tls {
+	const volatile struct Env *tls_env;	// thisenv
+	void *tls_mcache;			// malloc's free-chunk cache
+	int tls_worker;				// task runtime worker number
+};
+#define tls		((struct Tls *) UTLS)
+#define thisenv		(tls->tls_env)
+
 // libmain.c or entry.S
 extern const char *binaryname;
-extern const volatile struct Env *thisenv;
 extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
 
@@ -39,6 +50,7 @@ void	exit(void);
 
 // pgfault.c
 void	set_pgfault_handler(void (*handler)(struct UTrapframe *utf));
+int	add_pgfault_range(void *start, void *end, void (*handler)(struct UTrapframe *utf));
 
 // readline.c
 char*	readline(const char *buf);
@@ -64,6 +76,19 @@ int sys_change_priority(int priority);
 int sys_transmit_packet(void * packet, size_t size); 
 int sys_receive_packet(void *packet, size_t *size); 
 int sys_get_mac_addr(uint16_t * mac_addr); 
+int sys_net_rx_wait(void); 
+int sys_net_stats(struct NicStats *stats); 
+int sys_transmit_sg(struct TxSeg *segs, int nsegs); 
+int sys_transmit_tso(struct TxSeg *segs, int nsegs, size_t hdrlen, size_t mss); 
+int sys_page_phys(void *va); 
+int sys_ide_dma_init(void); 
+int sys_ide_wait(void); 
+int sys_fs_timer(unsigned msec); 
+int sys_ipc_try_send_pages(envid_t to_env, uint32_t value, void *pg, size_t npages, int perm); 
+int sys_ipc_recv_pages(void *rcv_pg, size_t maxpages); 
+int sys_futex_wait(volatile uint32_t *addr, uint32_t val, unsigned msec); 
+int sys_futex_wake(volatile uint32_t *addr, int n); 
+int sys_ncpu(void); 
 
 // This must be inlined.  Exercise for reader: why?
 static inline envid_t __attribute__((always_inline))
@@ -79,10 +104,15 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+void	ipc_send_pages(envid_t to_env, uint32_t value, void *pg, size_t npages, int perm);
+int32_t ipc_recv_pages(envid_t *from_env_store, void *pg, size_t *npages, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
 #define	PTE_SHARE	0x400
+// PTE_COW marks copy-on-write page table entries.
+// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
+#define	PTE_COW		0x800
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
 
@@ -96,12 +126,17 @@ ssize_t	readn(int fd, void *buf, size_t nbytes);
 int	dup(int oldfd, int newfd);
 int	fstat(int fd, struct Stat *statbuf);
 int	stat(const char *path, struct Stat *statbuf);
+int	poll(struct pollfd *fds, int nfds, int timeout);
 
 // file.c
 int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	fs_stats(struct BcStats *st);
+int	mmap(int fd, off_t offset, size_t len, int flags, void **addr_store);
+int	munmap(void *addr);
+int	map_text(int fd, off_t offset, size_t len, void *dstva);
 
 // pageref.c
 int	pageref(void *addr);
@@ -113,17 +148,20 @@ int     shutdown(int s, int how);
 int     connect(int s, const struct sockaddr *name, socklen_t namelen);
 int     listen(int s, int backlog);
 int     socket(int domain, int type, int protocol);
+int     sockpoll(struct pollfd *fds, int nfds, int timeout);
 
 // nsipc.c
-int     nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen);
-int     nsipc_bind(int s, struct sockaddr *name, socklen_t namelen);
-int     nsipc_shutdown(int s, int how);
-int     nsipc_close(int s);
-int     nsipc_connect(int s, const struct sockaddr *name, socklen_t namelen);
-int     nsipc_listen(int s, int backlog);
-int     nsipc_recv(int s, void *mem, int len, unsigned int flags);
-int     nsipc_send(int s, const void *buf, int size, unsigned int flags);
-int     nsipc_socket(int domain, int type, int protocol);
+int     nsipc_nshards(void);
+int     nsipc_accept(int shard, int s, struct sockaddr *addr, socklen_t *addrlen);
+int     nsipc_bind(int shard, int s, struct sockaddr *name, socklen_t namelen);
+int     nsipc_shutdown(int shard, int s, int how);
+int     nsipc_close(int shard, int s);
+int     nsipc_connect(int shard, int s, const struct sockaddr *name, socklen_t namelen);
+int     nsipc_listen(int shard, int s, int backlog);
+int     nsipc_recv(int shard, int s, void *mem, int len, unsigned int flags);
+int     nsipc_send(int shard, int s, const void *buf, int size, unsigned int flags);
+int     nsipc_socket(int shard, int domain, int type, int protocol);
+int     nsipc_poll(int shard, struct pollfd *fds, int nfds, int timeout);
 
 // spawn.c
 envid_t	spawn(const char *program, const char **argv);
@@ -159,4 +197,8 @@ void	wait(envid_t env);
 #define	O_EXCL		0x0400		/* error if already exists */
 #define O_MKDIR		0x0800		/* create directory, not regular file */
 
+/* mmap flags */
+#define	MAP_SHARED	0x1		/* read-only view of the file server's cached blocks */
+#define	MAP_PRIVATE	0x2		/* writable, copy-on-write copy of the file */
+
 #endif	// !JOS_INC_LIB_H
@@ -3,5 +3,8 @@
 
 void *malloc(size_t size);
 void free(void *addr);
+void *calloc(size_t nmemb, size_t size);
+void *realloc(void *addr, size_t size);
+int malloc_share(void);
 
 #endif
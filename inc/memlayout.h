@@ -128,6 +128,9 @@
 // Next page left invalid to guard against exception stack overflow; then:
 // Top of normal user stack
 #define USTACKTOP	(UTOP - 2*PGSIZE)
+// Per-environment data (struct Tls in inc/lib.h), at the bottom of the
+// stack's page table: it stays private when sfork shares everything else
+#define UTLS		(USTACKTOP - PTSIZE)
 
 // Where user programs generally begin
 #define UTEXT		(2*PTSIZE)
@@ -5,6 +5,8 @@
 
 #include <inc/types.h>
 #include <inc/mmu.h>
+#include <inc/env.h>
+#include <inc/fd.h>
 #include <lwip/sockets.h>
 
 struct jif_pkt {
@@ -12,6 +14,47 @@ struct jif_pkt {
 	char jp_data[0];
 };
 
+// One socket of an NSREQ_POLL: a struct pollfd packed into 4 bytes, so a
+// single request page holds over a thousand of them.
+struct Nspollfd {
+	int16_t fd;		// Socket id (ignored if negative)
+	uint8_t events;		// POLLIN and/or POLLOUT
+	uint8_t revents;	// Set by the network server
+};
+
+// The network server runs one lwIP stack per shard, each in an
+// environment of its own, so sockets in different shards are served on
+// different CPUs (see net/serv.c).  Shard 0 is the ENV_TYPE_NS
+// environment; NSREQ_SHARDS to it lists all of them.
+#define NS_MAXSHARDS	FDSOCK_MAXSHARDS
+
+// Is port in the range lwIP picks local ports from?
+static inline bool
+ns_port_ephemeral(uint16_t port)
+{
+	return port >= TCP_LOCAL_PORT_RANGE_START && port <= TCP_LOCAL_PORT_RANGE_END;
+}
+
+// Shard that handles the TCP connection between local port lport and
+// the remote address raddr (as in the IP header) and port rport.  Shard
+// s only picks local ports p with p % nshards == s (see lwipopts.h), so
+// that is where a connection from an ephemeral port goes.  Connections
+// to any other port (accepted on a listening socket, which has a copy
+// in every shard) are spread by remote address.
+static inline int
+ns_tcp_shard(uint32_t raddr, uint16_t rport, uint16_t lport, int nshards)
+{
+	uint32_t h;
+
+	if (ns_port_ephemeral(lport))
+		return lport % nshards;
+	h = raddr ^ rport;
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+	return h % nshards;
+}
+
 // Definitions for requests from clients to network server
 enum {
 	// The following messages pass a page containing an Nsipc.
@@ -26,6 +69,10 @@ enum {
 	NSREQ_RECV,
 	NSREQ_SEND,
 	NSREQ_SOCKET,
+	// Poll returns the revents in the Nsreq_poll on the request page.
+	NSREQ_POLL,
+	// Shards returns a Nsret_shards on the request page.
+	NSREQ_SHARDS,
 
 	// The following two messages pass a page containing a struct jif_pkt
 	NSREQ_INPUT,
@@ -97,10 +144,24 @@ union Nsipc {
 		int req_protocol;
 	} socket;
 
+	// req_timeout in msec (-1: forever). 
+	struct Nsreq_poll {
+		int req_nfds;
+		int req_timeout;
+		struct Nspollfd req_fds[0];
+	} poll;
+
+	struct Nsret_shards {
+		envid_t ret_shards[NS_MAXSHARDS];
+	} shardsRet;
+
 	struct jif_pkt pkt;
 
 	// Ensure Nsipc is one page
 	char _pad[PGSIZE];
 };
 
+// Maximum number of sockets in one NSREQ_POLL
+#define NSPOLL_MAX	((PGSIZE - 2 * sizeof(int)) / sizeof(struct Nspollfd))
+
 #endif // !JOS_INC_NS_H
@@ -22,6 +22,7 @@ void *	memcpy(void *dst, const void *src, size_t len);
 void *	memmove(void *dst, const void *src, size_t len);
 int	memcmp(const void *s1, const void *s2, size_t len);
 void *	memfind(const void *s, int c, size_t len);
+int	memsimd(int on);
 
 long	strtol(const char *s, char **endptr, int base);
 
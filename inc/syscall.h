@@ -22,6 +22,19 @@ enum {
 	SYS_transmit_packet, //16
 	SYS_receive_packet,  //17
 	SYS_get_mac_addr, //18
+	SYS_net_rx_wait, 
+	SYS_net_stats, 
+	SYS_transmit_sg, 
+	SYS_transmit_tso, 
+	SYS_page_phys, 
+	SYS_ide_dma_init, 
+	SYS_ide_wait, 
+	SYS_fs_timer, 
+	SYS_ipc_try_send_pages, 
+	SYS_ipc_recv_pages, 
+	SYS_futex_wait, 
+	SYS_futex_wake, 
+	SYS_ncpu, 
 	NSYSCALLS
 };
 
@@ -0,0 +1,26 @@
+#ifndef JOS_INC_TASK_H
+#define JOS_INC_TASK_H 1
+
+#include <inc/types.h>
+
+// Task runtime (lib/task.c): fine-grained tasks run by sfork'd worker
+// environments, one per CPU.
+
+#define TASK_MAXWORKERS	8
+
+// Tasks spawned into a group; task_wait waits for all of them.
+// Like everything tasks share, a group must be in the heap or in a
+// global variable, not on the stack: each worker has its own stack.
+struct TaskGroup {
+	volatile uint32_t tg_pending;	// spawned and not finished yet
+};
+
+int	task_init(int nworkers);
+void	task_shutdown(void);
+void	task_spawn(struct TaskGroup *g, void (*fn)(void *), void *arg);
+void	task_wait(struct TaskGroup *g);
+void	task_parallel_for(int lo, int hi, int grain,
+			  void (*body)(int lo, int hi, void *arg), void *arg);
+int	task_nworkers(void);
+
+#endif
@@ -74,6 +74,12 @@ struct Trapframe {
 	uint16_t tf_padding4;
 } __attribute__((packed));
 
+// x87/MMX/SSE registers, as saved by fxsave (or by fnsave, on CPUs
+// without fxsave, in the first 108 bytes).
+struct Fpregs {
+	uint8_t fp_image[512];
+} __attribute__((aligned(16)));
+
 struct UTrapframe {
 	/* information about the fault */
 	uint32_t utf_fault_va;	/* va for T_PGFLT, 0 otherwise */
@@ -223,6 +223,12 @@ read_esp(void)
 	return esp;
 }
 
+// Feature flags in %edx of cpuid(1)
+#define CPUID_FPU	(1 << 0)	// x87 FPU
+#define CPUID_FXSR	(1 << 24)	// fxsave/fxrstor
+#define CPUID_SSE	(1 << 25)
+#define CPUID_SSE2	(1 << 26)
+
 static inline void
 cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp)
 {
@@ -257,8 +263,33 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	asm volatile("lock; xchgl %0, %1"
 		     : "+m" (*addr), "=a" (result)
 		     : "1" (newval)
-		     : "cc");
+		     : "cc", "memory");
 	return result;
 }
 
+// Atomically: if *addr == oldval, set it to newval.
+// Returns the previous value of *addr (oldval if the swap happened).
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %1"
+		     : "=a" (result), "+m" (*addr)
+		     : "r" (newval), "0" (oldval)
+		     : "cc", "memory");
+	return result;
+}
+
+// Atomically add inc to *addr.  Returns the previous value of *addr.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t inc)
+{
+	asm volatile("lock; xaddl %0, %1"
+		     : "+r" (inc), "+m" (*addr)
+		     :
+		     : "cc", "memory");
+	return inc;
+}
+
 #endif /* !JOS_INC_X86_H */
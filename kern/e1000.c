@@ -5,12 +5,17 @@
 #include <kern/pmap.h>
 #include <inc/error.h>
 #include <inc/string.h>
+#include <kern/env.h>
+#include <kern/picirq.h>
 
 // LAB 6: Your driver code here
 
 // Static functions
 static int init_transmit(void); 
 static int init_receive(void); 
+static void tx_desc_legacy(struct TX_Desc *desc, int n); 
+static void tx_unpin(int n); 
+static bool tx_slots_free(int first, int ndesc); 
 
 // Base address for the memory mapped io for E1000. 
 // We use volatile here since this region in memory can be updated by hardware. 
@@ -18,6 +23,24 @@ static int init_receive(void);
 // Essentially, we disable the cache. 
 volatile uint32_t *e1000_io;
 
+// IRQ line of the E1000. Zero until the device is attached. 
+uint8_t e1000_irq; 
+
+// Receive mode and counters (mode is kept in e1000_stats.ns_rx_mode). 
+static struct NicStats e1000_stats; 
+// Number of consecutive empty polls since the last received packet. 
+static uint32_t rx_idle_polls; 
+// Environment blocked waiting for a receive interrupt (0 if none). 
+static envid_t rx_waiter; 
+
+// Physical address of the buffer page owned by each transmit descriptor. 
+// A TSO context descriptor overwrites the whole slot (including addr_lower), so the buffer address is restored from here when the slot is reused. 
+static physaddr_t tx_buf_pa[n_tx_desc]; 
+
+// User page a transmit descriptor reads its data from (TXSEG_NOCOPY), or NULL if it uses its own buffer page. 
+// We hold a reference on the page until the slot is reused, so the page cannot be freed and handed out again while the E1000 may still read it. 
+static struct PageInfo *tx_pinned[n_tx_desc]; 
+
 int pci_attach_E1000(struct pci_func *pcif) {
 
 	int r; 
@@ -35,6 +58,10 @@ int pci_attach_E1000(struct pci_func *pcif) {
 	cprintf("Status Register Check: %x \n", e1000_io[reg_STATUS]); 
 	assert(e1000_io[reg_STATUS] == 0x80080783);
 	
+	// Mask all E1000 interrupts until the input environment asks for one. 
+	int reg_IMC = E1000_IMC/sizeof(*e1000_io); 
+	e1000_io[reg_IMC] = 0xFFFFFFFF; 
+	
 	// Init the transmit functionality in E1000.
 	if ((r = init_transmit()) < 0) {
 		return r; 
@@ -45,6 +72,11 @@ int pci_attach_E1000(struct pci_func *pcif) {
 		return r; 
 	}
 	
+	// Route the E1000 interrupt line through the PIC. 
+	// The device itself only raises receive interrupts while they are unmasked in IMS (see e1000_rx_idle). 
+	e1000_irq = pcif->irq_line; 
+	irq_setmask_8259A(irq_mask_8259A & ~(1<<e1000_irq));
+	
 	return 0; 
 }
 
@@ -67,7 +99,17 @@ static int init_receive(void) {
 	int reg_MTA = E1000_MTA/sizeof(*e1000_io); 
 	memset((void *) &e1000_io[reg_MTA], 0, E1000_MTA_SIZE*sizeof(*e1000_io)); 
 	
-	// Note: No interrupts enabled. So, IMS, RDTR not modified. 
+	// Program receive interrupt moderation. 
+	// RDTR delays the interrupt until the link has been quiet for a little while (so a burst produces one interrupt). 
+	// RADV bounds that delay so a steady stream still gets serviced. ITR caps the interrupt rate overall. 
+	// Note: Receive interrupts stay masked (IMS) until the input environment runs out of packets. 
+	int reg_RDTR = E1000_RDTR/sizeof(*e1000_io); 
+	int reg_RADV = E1000_RADV/sizeof(*e1000_io); 
+	int reg_ITR = E1000_ITR/sizeof(*e1000_io); 
+	e1000_io[reg_RDTR] = E1000_RDTR_DELAY; 
+	e1000_io[reg_RADV] = E1000_RADV_DELAY; 
+	e1000_io[reg_ITR] = E1000_ITR_INTERVAL; 
+	e1000_stats.ns_rx_mode = E1000_RX_MODE_INTR; 
 	
 	// Allocate receive descriptor list (must be aligned on a 16-byte boundary). 
 	// Ensure list is 16-byte aligned in physical memory. 
@@ -202,6 +244,9 @@ int e1000_receive_packet(void * packet, size_t * size) {
 	// Update the descriptor (in transmit descriptor que). 
 	rx_desc_list[desc_tail_next] = current_desc;
 	
+	// Packets keep arriving: restart the idle count used by polling mode. 
+	e1000_stats.ns_rx_packets++; 
+	rx_idle_polls = 0; 
 	
 	return 0; 
 	
@@ -224,7 +269,7 @@ static int init_transmit(void) {
 	
 	// Set the Transmit Descriptor Length (TDLEN) register to the size (in bytes) of the descriptor ring. 
 	// Each transmit descriptor is 16 bytes, and needs to be 128 byte aligned. 
-	// So, we will use 32 descriptors = 32*16 = 512 bytes. 
+	// So, we will use 64 descriptors = 64*16 = 1024 bytes (a zero-copy fragment that crosses a page boundary takes two). 
 	int reg_TDLEN = E1000_TDLEN/sizeof(*e1000_io);
 	e1000_io[reg_TDLEN] =  n_tx_desc * tx_desc_size; 
 	
@@ -269,7 +314,8 @@ static int init_transmit(void) {
 		
 		// Include the physical address of the buffer in the descriptor. 
 		// E1000 can use this pa for DMA. And, kernel can find va from this pa (mapped above). 
-		tx_desc_new.addr_lower = page2pa(buffer_page); 
+		tx_buf_pa[n] = page2pa(buffer_page); 
+		tx_desc_new.addr_lower = tx_buf_pa[n]; 
 		tx_desc_new.addr_upper = 0x0; 
 		// Length: Measred in bytes
 		// Max Length: 16288 bytes per descriptor and 16288 bytes total. 
@@ -316,9 +362,9 @@ int e1000_transmit_packet(void * packet, size_t size) {
 
 	
 	
-	// If Descrptor Done bit  NOT set, then descriptor not ready to be used. 
+	// If Descrptor Done bit  NOT set, then descriptor not ready to be used (see tx_slots_free). 
 	// User must resend data. 
-	if ((current_desc.status & E1000_TXD_STAT_DD) == 0x0) {
+	if (!tx_slots_free(desc_offset, 1)) {
 		warn("DD NOT set. Descriptor still needs to be processed by E1000. \n");
 		return -E_TX_BUFF_FULL; 
 	}
@@ -327,6 +373,9 @@ int e1000_transmit_packet(void * packet, size_t size) {
 	// Reset DD bit in status. Update the descriptor length. 
 	current_desc.status = (current_desc.status & ~E1000_TXD_STAT_DD); 
 	current_desc.length = size; 
+	// Single descriptor packet: report status and mark as end of packet (e1000_transmit_sg may have cleared EOP). 
+	tx_desc_legacy(&current_desc, desc_offset); 
+	current_desc.cmd = E1000_TDESC_CMD_RS | E1000_TXD_CMD_EOP; 
 	
 	// Update transmit buffer page with packet data (copy data over). 
 	// current_desc.addr_lower provides physical address, so need to convert to *va. 
@@ -344,10 +393,233 @@ int e1000_transmit_packet(void * packet, size_t size) {
 	int desc_offset_next = (desc_offset == n_tx_desc-1) ? 0 : desc_offset + 1;
 	e1000_io[reg_TDT] = desc_offset_next; 
 	
+	e1000_stats.ns_tx_packets++; 
 	return 0; 
 	
 }
 
+// Whether the E1000 should read fragment 'seg' straight from the current environment's page(s) instead of from a copy. 
+// Only for TXSEG_NOCOPY fragments, and only long enough ones (pinning a page costs about as much as copying a header). 
+static bool tx_seg_inplace(const struct TxSeg *seg) {
+	return (seg->ts_flags & TXSEG_NOCOPY) && seg->ts_len >= E1000_TX_COPYBREAK; 
+}
+
+// Number of descriptors fragment 'seg' takes: a fragment read in place needs one per page it touches (at most two, as it is at most PGSIZE long). 
+// A copied fragment always fits in its slot's buffer page. 
+static int tx_seg_ndesc(const struct TxSeg *seg, bool inplace) {
+	if (inplace && PGOFF(seg->ts_addr) + seg->ts_len > PGSIZE)
+		return 2; 
+	return 1; 
+}
+
+// Check that the 'ndesc' descriptors starting at slot 'first' are done (DD set) and can be reused. 
+// The slot after them must be done too: filling the whole ring would make TDT equal TDH, which the E1000 reads as an empty ring. 
+static bool tx_slots_free(int first, int ndesc) {
+	int i; 
+	for (i = 0; i <= ndesc; i++) {
+		if (!(tx_desc_list[(first + i) % n_tx_desc].status & E1000_TXD_STAT_DD))
+			return false; 
+	}
+	return true; 
+}
+
+// Fill the data descriptors of fragment 'seg', starting at slot 'n'. Returns the slot after the last one used. 
+// 'cmd', 'cso' and 'css' are set on every descriptor, 'eop' (E1000_TXD_CMD_EOP or 0) only on the last one. 
+// A fragment read in place points the descriptors at the user pages (found in the current environment's page table, which sys_transmit_sg/tso checked), and pins them. 
+// Otherwise the fragment is copied into the slot's buffer page. 
+static int tx_seg_fill(const struct TxSeg *seg, bool inplace, int n, uint8_t cmd, uint8_t eop, uint8_t cso, uint8_t css) {
+	const uint8_t *va = seg->ts_addr; 
+	size_t left = seg->ts_len; 
+	
+	do {
+		struct TX_Desc *desc = &tx_desc_list[n]; 
+		size_t len = left; 
+		
+		tx_desc_legacy(desc, n); 
+		if (inplace) {
+			struct PageInfo *pp = page_lookup(curenv->env_pgdir, (void *) va, NULL); 
+			assert(pp); 
+			len = MIN(left, PGSIZE - PGOFF(va)); 
+			pp->pp_ref++; 
+			tx_pinned[n] = pp; 
+			desc->addr_lower = page2pa(pp) + PGOFF(va); 
+		} else
+			memcpy(KADDR(desc->addr_lower), va, len); 
+		desc->length = len; 
+		desc->cso = cso; 
+		desc->css = css; 
+		desc->cmd = cmd | ((len == left) ? eop : 0); 
+		desc->status = desc->status & ~E1000_TXD_STAT_DD; 
+		
+		va += len; 
+		left -= len; 
+		n = (n + 1) % n_tx_desc; 
+	} while (left > 0); 
+	
+	if (inplace)
+		e1000_stats.ns_tx_zcopy++; 
+	return n; 
+}
+
+// Transmit a single packet made of 'nsegs' fragments, using one descriptor per fragment (two for a TXSEG_NOCOPY fragment that crosses a page boundary). 
+// Only the last descriptor has EOP set, so the E1000 gathers the fragments into one frame (no coalescing copy into a packet buffer). 
+// TXSEG_NOCOPY fragments are read by the E1000 straight from the sender's pages (see tx_seg_inplace). Other fragments are copied into the descriptors' buffers. 
+// Either all fragments are queued or none are. 
+int e1000_transmit_sg(struct TxSeg *segs, int nsegs) {
+	bool inplace[E1000_TX_MAX_SEGS]; 
+	size_t total = 0; 
+	int ndesc = 0; 
+	int i; 
+	
+	if (nsegs <= 0 || nsegs > E1000_TX_MAX_SEGS)
+		return -E_INVAL; 
+	
+	// Each fragment must fit in its descriptor buffer page, and the packet in an ethernet frame. 
+	for (i = 0; i < nsegs; i++) {
+		if (segs[i].ts_len > PGSIZE)
+			return -E_INVAL; 
+		total += segs[i].ts_len; 
+	}
+	if (total == 0 || total > max_packet_size)
+		return -E_INVAL; 
+	for (i = 0; i < nsegs; i++) {
+		inplace[i] = tx_seg_inplace(&segs[i]); 
+		ndesc += tx_seg_ndesc(&segs[i], inplace[i]); 
+	}
+	
+	// All 'ndesc' descriptors starting at the tail must be done (DD set) before we can use any of them. 
+	int reg_TDT = E1000_TDT/sizeof(*e1000_io);
+	int desc_offset = e1000_io[reg_TDT];
+	if (!tx_slots_free(desc_offset, ndesc))
+		return -E_TX_BUFF_FULL; 
+	
+	// Fill the descriptors. RS on every descriptor (we use DD to know when each buffer is free again), EOP only on the last. 
+	int n = desc_offset; 
+	for (i = 0; i < nsegs; i++)
+		n = tx_seg_fill(&segs[i], inplace[i], n, E1000_TDESC_CMD_RS, (i == nsegs - 1) ? E1000_TXD_CMD_EOP : 0, 0, 0); 
+	
+	// Hand the whole packet to the E1000 at once by moving the tail past the last fragment. 
+	e1000_io[reg_TDT] = n; 
+	
+	e1000_stats.ns_tx_packets++; 
+	return 0; 
+}
+
+// Drop the reference on the user page slot 'n' read its data from, if any. Only called once the slot is done (DD set). 
+static void tx_unpin(int n) {
+	if (tx_pinned[n]) {
+		page_decref(tx_pinned[n]); 
+		tx_pinned[n] = NULL; 
+	}
+}
+
+// Turn transmit descriptor 'desc' (slot 'n' of the ring) back into a legacy descriptor pointing at its own buffer page. 
+// Needed since a slot may have held a TSO context or data descriptor, or pointed at a user page, before. 
+static void tx_desc_legacy(struct TX_Desc *desc, int n) {
+	tx_unpin(n); 
+	desc->addr_lower = tx_buf_pa[n]; 
+	desc->addr_upper = 0x0; 
+	desc->cso = 0x0; 
+	desc->css = 0x0; 
+	desc->special = 0x0; 
+}
+
+// One's complement sum of 'len' bytes (16-bit words in network byte order), not folded. 
+static uint32_t
+tso_csum_add(uint32_t sum, const uint8_t *buf, size_t len)
+{
+	size_t i; 
+	for (i = 0; i + 1 < len; i += 2)
+		sum += (buf[i] << 8) | buf[i + 1]; 
+	if (len & 1)
+		sum += buf[len - 1] << 8; 
+	return sum; 
+}
+
+// Transmit one large TCP segment and let the E1000 cut it into frames carrying at most 'mss' bytes of payload (TCP segmentation offload). 
+// The packet is given as fragments (like e1000_transmit_sg). The first fragment must hold the Ethernet, IPv4 and TCP headers ('hdrlen' bytes). 
+// It is always copied, since the headers are fixed up below. TXSEG_NOCOPY payload fragments are read in place. 
+// The E1000 replicates the headers for every frame, fixing up IP length/ID, TCP sequence number/flags and both checksums. 
+// Uses one context descriptor followed by the data descriptors of the fragments. Either the whole segment is queued or nothing is. 
+int e1000_transmit_tso(struct TxSeg *segs, int nsegs, size_t hdrlen, size_t mss) {
+	bool inplace[E1000_TSO_MAX_SEGS]; 
+	size_t total = 0; 
+	int ndesc = 1; 
+	int i; 
+	
+	if (nsegs <= 0 || nsegs > E1000_TSO_MAX_SEGS)
+		return -E_INVAL; 
+	for (i = 0; i < nsegs; i++) {
+		if (segs[i].ts_len > PGSIZE)
+			return -E_INVAL; 
+		total += segs[i].ts_len; 
+	}
+	
+	// Every frame (headers + mss bytes of payload) must still be a valid ethernet frame. 
+	if (hdrlen > 255 || segs[0].ts_len < hdrlen || mss == 0 || hdrlen + mss > max_packet_size - 4)
+		return -E_INVAL; 
+	if (total <= hdrlen || total > E1000_TSO_MAX_LEN)
+		return -E_INVAL; 
+	
+	// Locate the IPv4 and TCP headers. 
+	const uint8_t *hdr = segs[0].ts_addr; 
+	size_t ip_off = 14; 
+	if (hdr[12] != 0x08 || hdr[13] != 0x00 || (hdr[ip_off] >> 4) != 4 || hdr[ip_off + 9] != 6)
+		return -E_INVAL; 
+	size_t ip_hlen = (hdr[ip_off] & 0xF) * 4; 
+	size_t tcp_off = ip_off + ip_hlen; 
+	if (tcp_off + 20 > hdrlen || tcp_off + (hdr[tcp_off + 12] >> 4) * 4 != hdrlen)
+		return -E_INVAL; 
+	
+	// Need one context descriptor plus the data descriptors, all done (DD set). 
+	for (i = 0; i < nsegs; i++) {
+		inplace[i] = i > 0 && tx_seg_inplace(&segs[i]); 
+		ndesc += tx_seg_ndesc(&segs[i], inplace[i]); 
+	}
+	int reg_TDT = E1000_TDT/sizeof(*e1000_io);
+	int desc_offset = e1000_io[reg_TDT];
+	if (!tx_slots_free(desc_offset, ndesc))
+		return -E_TX_BUFF_FULL; 
+	
+	// Context descriptor: where the checksums go, how long the headers are and the MSS. 
+	tx_unpin(desc_offset); 
+	struct TX_Ctx_Desc *ctx = (struct TX_Ctx_Desc *) &tx_desc_list[desc_offset]; 
+	ctx->ipcss = ip_off; 
+	ctx->ipcso = ip_off + 10; 
+	ctx->ipcse = tcp_off - 1; 
+	ctx->tucss = tcp_off; 
+	ctx->tucso = tcp_off + 16; 
+	ctx->tucse = 0; 
+	ctx->paylen_cmd = ((total - hdrlen) & E1000_TXD_PAYLEN_MASK) | (E1000_TXD_DTYP_C << E1000_TXD_DTYP_SHIFT) | 
+		((E1000_TXD_CMD_DEXT | E1000_TDESC_CMD_RS | E1000_TXD_CMD_TSE | E1000_TXD_CMD_IP | E1000_TXD_CMD_TCP) << E1000_TXD_CMD_SHIFT); 
+	ctx->hdrlen = hdrlen; 
+	ctx->mss = mss; 
+	ctx->status = 0; 
+	
+	// Data descriptors, EOP on the last. 
+	// DTYP sits in the upper nibble of the cso byte for data descriptors, and css holds POPTS. 
+	int n = (desc_offset + 1) % n_tx_desc; 
+	for (i = 0; i < nsegs; i++)
+		n = tx_seg_fill(&segs[i], inplace[i], n, E1000_TXD_CMD_DEXT | E1000_TDESC_CMD_RS | E1000_TXD_CMD_TSE, 
+			(i == nsegs - 1) ? E1000_TXD_CMD_EOP : 0, E1000_TXD_DTYP_D << 4, E1000_TXD_POPTS_IXSM | E1000_TXD_POPTS_TXSM); 
+	
+	// Fix up the headers in our copy (first data buffer) as the E1000 expects them for TSO: 
+	// The IP checksum is computed by the E1000, and the TCP checksum field must hold the pseudo header sum without the length. 
+	uint8_t *h = KADDR(tx_desc_list[(desc_offset + 1) % n_tx_desc].addr_lower); 
+	h[ip_off + 10] = h[ip_off + 11] = 0; 
+	uint32_t sum = tso_csum_add(0, &h[ip_off + 12], 8); 	// Source and destination address
+	sum += 6; 						// Protocol (TCP)
+	while (sum >> 16)
+		sum = (sum & 0xFFFF) + (sum >> 16); 
+	h[tcp_off + 16] = sum >> 8; 
+	h[tcp_off + 17] = sum & 0xFF; 
+	
+	e1000_io[reg_TDT] = n; 
+	
+	e1000_stats.ns_tx_tso++; 
+	e1000_stats.ns_tx_packets += (total - hdrlen + mss - 1) / mss; 
+	return 0; 
+}
 
 int e1000_get_mac_addr(uint16_t *mac_addr) 
 {
@@ -373,3 +645,93 @@ int e1000_get_mac_addr(uint16_t *mac_addr)
 
 
 
+
+// Check if the next receive descriptor holds a complete packet (without consuming it). 
+static bool
+rx_ready(void)
+{
+	int reg_RDT = E1000_RDT/sizeof(*e1000_io);
+	int desc_tail_n = e1000_io[reg_RDT];
+	int desc_tail_next = (desc_tail_n == n_rx_desc-1) ? 0 : desc_tail_n + 1;
+	uint8_t status = rx_desc_list[desc_tail_next].status; 
+	
+	return (status & E1000_RXD_STAT_DD) && (status & E1000_RXD_STAT_EOP); 
+}
+
+// Called when environment 'e' found the receive ring empty. 
+// Implements NAPI-style adaptive receive: 
+// 1) In polling mode, the caller should just yield and poll again, until E1000_POLL_IDLE_LIMIT empty polls in a row. 
+// 2) Then the driver falls back to interrupt mode: receive interrupts are unmasked and the caller should block. 
+// Returns 0 if the caller should poll again, 1 if the caller should block until e1000_intr wakes it up. 
+int
+e1000_rx_idle(struct Env *e)
+{
+	int reg_IMC = E1000_IMC/sizeof(*e1000_io); 
+	
+	if (e1000_stats.ns_rx_mode == E1000_RX_MODE_POLL) {
+		if (++rx_idle_polls <= E1000_POLL_IDLE_LIMIT) {
+			e1000_stats.ns_rx_polls++; 
+			return 0; 
+		}
+		// Ring drained: fall back to interrupts. 
+		e1000_stats.ns_rx_mode = E1000_RX_MODE_INTR; 
+		e1000_stats.ns_rx_to_intr++; 
+	}
+	
+	// Unmask first, then re-check the ring. 
+	// Otherwise a packet landing between the caller's last poll and the unmask would not raise an interrupt until the next packet. 
+	e1000_rx_intr_enable(); 
+	if (rx_ready()) {
+		e1000_io[reg_IMC] = E1000_IMS_RX; 
+		return 0; 
+	}
+	
+	rx_waiter = e->env_id; 
+	e1000_stats.ns_rx_sleeps++; 
+	return 1; 
+}
+
+// Unmask receive interrupts in the E1000. 
+void
+e1000_rx_intr_enable(void)
+{
+	int reg_IMS = E1000_IMS/sizeof(*e1000_io); 
+	e1000_io[reg_IMS] = E1000_IMS_RX; 
+}
+
+// E1000 interrupt handler (called from trap_dispatch). 
+// Masks receive interrupts again, switches to polling mode and wakes the blocked input environment. 
+void
+e1000_intr(void)
+{
+	struct Env *e; 
+	int reg_ICR = E1000_ICR/sizeof(*e1000_io); 
+	int reg_IMC = E1000_IMC/sizeof(*e1000_io); 
+	
+	// Reading ICR acknowledges (clears) the interrupt causes. 
+	uint32_t icr = e1000_io[reg_ICR]; 
+	if (!(icr & E1000_IMS_RX))
+		return; 
+	
+	e1000_io[reg_IMC] = E1000_IMS_RX; 
+	e1000_stats.ns_rx_intrs++; 
+	
+	if (e1000_stats.ns_rx_mode == E1000_RX_MODE_INTR) {
+		e1000_stats.ns_rx_mode = E1000_RX_MODE_POLL; 
+		e1000_stats.ns_rx_to_poll++; 
+		rx_idle_polls = 0; 
+	}
+	
+	// Wake up the waiter (if it still exists and is still blocked). 
+	if (rx_waiter && envid2env(rx_waiter, &e, 0) == 0 && e->env_status == ENV_NOT_RUNNABLE) {
+		e->env_status = ENV_RUNNABLE; 
+	}
+	rx_waiter = 0; 
+}
+
+// Copy out the driver counters. 
+void
+e1000_get_stats(struct NicStats *stats)
+{
+	*stats = e1000_stats; 
+}
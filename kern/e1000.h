@@ -2,6 +2,7 @@
 #define JOS_KERN_E1000_H
 
 #include <kern/pci.h>
+#include <inc/e1000.h>
 
 // E1000 parameters
 #define E1000_VENDOR_ID 0x8086 
@@ -11,7 +12,7 @@
 //#define MAC_HIGHER			0x00005634
 
 
-#define n_tx_desc 32
+#define n_tx_desc 64
 #define tx_desc_size 16
 #define n_rx_desc 256
 #define rx_desc_size 16
@@ -19,11 +20,33 @@
 
 #define max_packet_size 1518
 
+// TXSEG_NOCOPY fragments shorter than this are still copied: pinning the page costs more than the copy. 
+#define E1000_TX_COPYBREAK	256
+
+// Receive interrupt moderation (see 82540EM manual, 13.4.x)
+// RDTR/RADV are in units of 1.024 usec. ITR is in units of 256 nsec. 
+#define E1000_RDTR_DELAY	32		// Packet timer: ~32 usec after the last packet
+#define E1000_RADV_DELAY	128		// Absolute timer: ~131 usec after the first packet
+#define E1000_ITR_INTERVAL	651		// Throttle to ~6000 interrupts/sec
+
+// Number of consecutive empty polls of the receive ring before the driver falls back to interrupt mode. 
+#define E1000_POLL_IDLE_LIMIT	16
+
 // Functions
 int pci_attach_E1000(struct pci_func *pcif); 
 int e1000_transmit_packet(void * packet, size_t size); 
+int e1000_transmit_sg(struct TxSeg *segs, int nsegs); 
+int e1000_transmit_tso(struct TxSeg *segs, int nsegs, size_t hdrlen, size_t mss); 
 int e1000_receive_packet(void * packet, size_t * size); 
 int e1000_get_mac_addr(uint16_t *mac_addr); 
+struct Env; 
+int e1000_rx_idle(struct Env *e); 
+void e1000_rx_intr_enable(void); 
+void e1000_intr(void); 
+void e1000_get_stats(struct NicStats *stats); 
+
+// IRQ line used by the E1000 (read from PCI config space at attach)
+extern uint8_t e1000_irq; 
 
 
 struct TX_Desc
@@ -39,6 +62,21 @@ struct TX_Desc
 }; 
 
 
+// TCP/IP context descriptor (82540EM manual, 3.3.6). 
+// Occupies a slot in the transmit ring, and tells the E1000 how to segment/checksum the data descriptors that follow. 
+struct TX_Ctx_Desc
+{
+	uint8_t ipcss; 			// IP checksum start (offset of the IP header)
+	uint8_t ipcso; 			// IP checksum offset (where to store it)
+	uint16_t ipcse; 		// IP checksum end (last byte of the IP header)
+	uint8_t tucss; 			// TCP checksum start (offset of the TCP header)
+	uint8_t tucso; 			// TCP checksum offset (where to store it)
+	uint16_t tucse; 		// TCP checksum end (0: end of packet)
+	uint32_t paylen_cmd; 		// TCP payload length (bits 0-19), DTYP (bits 20-23), TUCMD (bits 24-31)
+	uint8_t status; 
+	uint8_t hdrlen; 		// Length of all headers (Ethernet + IP + TCP)
+	uint16_t mss; 			// Maximum TCP payload per segment
+}; 
 
 struct RX_Desc
 {
@@ -78,6 +116,18 @@ struct RX_Desc rx_desc_list[n_rx_desc];
 #define E1000_TDT      0x03818  /* TX Descripotr Tail - RW */
 #define E1000_TCTL     0x00400  /* TX Control - RW */
 #define E1000_TIPG     0x00410  /* TX Inter-packet gap -RW */
+#define E1000_ICR      0x000C0  /* Interrupt Cause Read - R/clr */
+#define E1000_ITR      0x000C4  /* Interrupt Throttling Rate - RW */
+#define E1000_IMS      0x000D0  /* Interrupt Mask Set - RW */
+#define E1000_IMC      0x000D8  /* Interrupt Mask Clear - WO */
+#define E1000_RDTR     0x02820  /* RX Delay Timer - RW */
+#define E1000_RADV     0x0282C  /* RX Interrupt Absolute Delay Timer - RW */
+
+/* Interrupt Cause/Mask bits (shared by ICR, IMS and IMC) */
+#define E1000_ICR_RXDMT0  0x00000010    /* rx desc min. threshold (0) */
+#define E1000_ICR_RXO     0x00000040    /* rx overrun */
+#define E1000_ICR_RXT0    0x00000080    /* rx timer intr (ring 0) */
+#define E1000_IMS_RX      (E1000_ICR_RXT0 | E1000_ICR_RXO | E1000_ICR_RXDMT0)
 
 
 /* Transmit Control */
@@ -109,6 +159,19 @@ struct RX_Desc rx_desc_list[n_rx_desc];
 #define E1000_TXD_CMD_EOP    	(0x1<<0) /* End of Packet */
 #define E1000_TXD_STAT_DD    	0x00000001 /* Descriptor Done */
 
+/* Extended (TCP/IP context and data) Transmit Descriptor Fields */
+#define E1000_TXD_CMD_TCP    	(0x1<<0) /* TUCMD: Packet is TCP */
+#define E1000_TXD_CMD_IP     	(0x1<<1) /* TUCMD: Packet is IPv4 */
+#define E1000_TXD_CMD_TSE    	(0x1<<2) /* TCP Segmentation Enable */
+#define E1000_TXD_CMD_DEXT   	(0x1<<5) /* Descriptor Extension (not legacy) */
+#define E1000_TXD_DTYP_C     	0x0 /* Context Descriptor */
+#define E1000_TXD_DTYP_D     	0x1 /* Data Descriptor */
+#define E1000_TXD_PAYLEN_MASK	0x000FFFFF
+#define E1000_TXD_DTYP_SHIFT	20
+#define E1000_TXD_CMD_SHIFT		24
+#define E1000_TXD_POPTS_IXSM 	(0x1<<0) /* Insert IP checksum */
+#define E1000_TXD_POPTS_TXSM 	(0x1<<1) /* Insert TCP/UDP checksum */
+
 /* Receive Registers */
 #define E1000_RAL       0x05400  		/* Receive Address (LOW) - RW Array */
 #define E1000_RAH       0x05404 	 	/* Receive Address (HIGH) - RW Array */
@@ -14,6 +14,8 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/futex.h>
+#include <kern/fpu.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
@@ -288,6 +290,14 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
 
+	// Not waiting on a futex.
+	e->env_futex_pa = 0;
+	e->env_futex_deadline = 0;
+	e->env_futex_link = NULL;
+	// FPU registers as after reset (loaded on first use, see kern/fpu.c). 
+	fpu_env_init(e);
+	// env_ipc_nrecv is left alone: it only ever counts up, so a sender still waiting on this slot sees it move.
+
 	// commit the allocation
 	env_free_list = e->env_link;
 	*newenv_store = e;
@@ -495,6 +505,14 @@ env_free(struct Env *e)
 	if (e == curenv)
 		lcr3(PADDR(kern_pgdir));
 
+	// Stop waiting on a futex, if it was.
+	futex_cancel(e);
+	// Its FPU registers don't need saving.
+	fpu_env_free(e);
+	// Wake senders waiting for e to receive: their next try fails with -E_BAD_ENV.
+	e->env_ipc_nrecv++;
+	futex_wake_kaddr(&e->env_ipc_nrecv, NENV);
+
 	// Note the environment's demise.
 	// ToDo: Debug
 	//cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -609,6 +627,11 @@ env_run(struct Env *e)
 
 	// LAB 3: Your code here.
 	
+	// Switching environments: the new one gets the FPU when it first uses it (see kern/fpu.c). 
+	if (curenv != e) {
+		fpu_leave(); 
+	}
+	
 	//1) If the current environment exists and is running, set it back to runnable. 
 	if((curenv != NULL) &&  curenv->env_status == ENV_RUNNING) {
 		curenv->env_status = ENV_RUNNABLE;
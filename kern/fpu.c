@@ -0,0 +1,183 @@
+// x87/MMX/SSE registers of environments, switched lazily.
+// The kernel itself never uses these registers (it is built without SSE, and lib/string.c only takes its SSE
+// paths in user environments), so they are only switched between environments, and only when needed:
+// - When env_run() switches this CPU to another environment, fpu_leave() sets CR0.TS, so that the next FPU or SSE
+//   instruction traps (#NM). If the environment switched out used the FPU since it was switched in (TS is clear),
+//   fpu_leave() first saves its registers in its save area, so that any CPU can run it next.
+// - fpu_trap() handles the #NM: it loads the registers of the current environment and clears TS. If this CPU's
+//   registers still hold that environment's state, because no other environment has loaded its own here since,
+//   even the load is skipped.
+// Environments that never touch the FPU never pay for it, and get no save area. Save areas are 512 bytes, handed
+// out from whole pages, and stay with their Env slot once allocated.
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/fpu.h>
+
+// Whether the CPU has fxsave/fxrstor and SSE. If not, only the x87 registers are saved, with fnsave/frstor.
+static bool fpu_fxsr;
+
+// Save areas not given to an Env yet, linked through their first word.
+static struct Fpregs *fpu_free_areas;
+
+// Set up this CPU's FPU: x87 errors are reported as exceptions, SSE is enabled if the CPU has it, and the first
+// FPU instruction of an environment traps.
+void
+fpu_init_percpu(void)
+{
+	uint32_t edx;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	fpu_fxsr = (edx & (CPUID_FXSR | CPUID_SSE)) == (CPUID_FXSR | CPUID_SSE);
+
+	lcr0((rcr0() | CR0_MP | CR0_NE) & ~(CR0_EM | CR0_TS));
+	if (fpu_fxsr)
+		lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+	asm volatile("fninit");
+	thiscpu->cpu_fpu_env = NULL;
+	lcr0(rcr0() | CR0_TS);
+}
+
+// Set e's registers to the state fninit leaves behind: all exceptions masked, all registers empty.
+static void
+fpu_reset(struct Env *e)
+{
+	uint16_t *image = (uint16_t *) e->env_fpregs->fp_image;
+
+	memset(e->env_fpregs, 0, sizeof(struct Fpregs));
+	image[0] = 0x037F;		// control word
+	if (fpu_fxsr)
+		*(uint32_t *) &image[12] = 0x1F80;	// MXCSR
+	else
+		image[4] = 0xFFFF;	// tag word (fnsave format)
+}
+
+// Give e a save area, if it has none yet, holding the registers as they are after reset.
+// Returns 0 on success, -E_NO_MEM if there is no memory for the save area.
+static int
+fpu_area_alloc(struct Env *e)
+{
+	struct PageInfo *pp;
+	struct Fpregs *area;
+	int i;
+
+	if (e->env_fpregs)
+		return 0;
+	if (!fpu_free_areas) {
+		if (!(pp = page_alloc(0)))
+			return -E_NO_MEM;
+		// Never freed.
+		pp->pp_ref++;
+		area = page2kva(pp);
+		for (i = 0; i < PGSIZE / sizeof(struct Fpregs); i++) {
+			*(struct Fpregs **) &area[i] = fpu_free_areas;
+			fpu_free_areas = &area[i];
+		}
+	}
+	e->env_fpregs = fpu_free_areas;
+	fpu_free_areas = *(struct Fpregs **) fpu_free_areas;
+	fpu_reset(e);
+	return 0;
+}
+
+static void
+fpu_save(struct Env *e)
+{
+	if (fpu_fxsr)
+		asm volatile("fxsave %0" : "=m" (*e->env_fpregs));
+	else
+		asm volatile("fnsave %0; fwait" : "=m" (*e->env_fpregs));
+}
+
+static void
+fpu_restore(struct Env *e)
+{
+	if (fpu_fxsr)
+		asm volatile("fxrstor %0" : : "m" (*e->env_fpregs));
+	else
+		asm volatile("frstor %0" : : "m" (*e->env_fpregs));
+}
+
+// If this CPU's registers hold changes of curenv's that aren't in its save area yet (curenv used the FPU since
+// it was switched in, so TS is clear), save them.
+static void
+fpu_flush(void)
+{
+	if (rcr0() & CR0_TS)
+		return;
+	assert(curenv && thiscpu->cpu_fpu_env == curenv);
+	fpu_save(curenv);
+}
+
+// e (a new environment) starts with the registers as they are after reset.
+void
+fpu_env_init(struct Env *e)
+{
+	if (e->env_fpregs)
+		fpu_reset(e);
+	e->env_fpu_cpu = -1;
+}
+
+// A forked environment starts with the registers of its parent, the current environment.
+// Returns 0 on success, -E_NO_MEM if there is no memory for dst's save area.
+int
+fpu_env_copy(struct Env *dst, struct Env *src)
+{
+	int r;
+
+	assert(src == curenv);
+	if (!src->env_fpregs)
+		return 0;
+	if ((r = fpu_area_alloc(dst)) < 0)
+		return r;
+	fpu_flush();
+	memmove(dst->env_fpregs, src->env_fpregs, sizeof(struct Fpregs));
+	return 0;
+}
+
+// e is being freed. If it is this CPU's current environment, forget its registers rather than save them.
+void
+fpu_env_free(struct Env *e)
+{
+	if (thiscpu->cpu_fpu_env == e) {
+		thiscpu->cpu_fpu_env = NULL;
+		lcr0(rcr0() | CR0_TS);
+	}
+	e->env_fpu_cpu = -1;
+}
+
+// This CPU stops running curenv (env_run is about to run another environment, or the CPU halts).
+void
+fpu_leave(void)
+{
+	fpu_flush();
+	lcr0(rcr0() | CR0_TS);
+}
+
+// #NM from user mode: curenv used the FPU for the first time since it was switched in.
+// Returns 0 once the registers are curenv's, or -E_NO_MEM if there is no memory for its save area.
+int
+fpu_trap(void)
+{
+	struct Env *e = curenv;
+	int r;
+
+	if (thiscpu->cpu_fpu_env != e || e->env_fpu_cpu != cpunum()) {
+		// Whoever the registers belong to saved them when it was switched out (fpu_leave).
+		if ((r = fpu_area_alloc(e)) < 0)
+			return r;
+		asm volatile("clts");
+		fpu_restore(e);
+		thiscpu->cpu_fpu_env = e;
+		e->env_fpu_cpu = cpunum();
+	} else
+		asm volatile("clts");
+	return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef JOS_KERN_FPU_H
+#define JOS_KERN_FPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+struct Env;
+
+void fpu_init_percpu(void);
+void fpu_env_init(struct Env *e);
+int fpu_env_copy(struct Env *dst, struct Env *src);
+void fpu_env_free(struct Env *e);
+void fpu_leave(void);
+int fpu_trap(void);
+
+#endif /* JOS_KERN_FPU_H */
@@ -0,0 +1,192 @@
+// Wait/notify on a 32-bit word of user memory (a futex).
+// An environment that finds the word still holding the value it last saw sleeps in futex_wait until another
+// environment calls futex_wake on the same word. Waiters are keyed by the physical address of the word, so
+// environments that share the page (e.g. the two ends of a pipe) find each other at whatever address they map it.
+// A wakeup is only a hint: the waiter always re-checks its condition. So waiters are also woken whenever a
+// mapping of their page is removed (futex_page_removed): an environment waiting on a peer then notices that the
+// peer unmapped the shared page, or exited. A wait can also time out (futex_tick), which covers the peer going
+// away between the waiter's last look at it and the wait itself.
+//
+// Waiters are kept in a hash table of wait queues, hashed by page frame so that all waiters on words of one page
+// share a queue: futex_wake and futex_page_removed only look at that queue, not at every environment.
+
+#include <inc/error.h>
+#include <inc/mmu.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/time.h>
+#include <kern/futex.h>
+
+// Wait queues, linked through env_futex_link. FUTEX_NHASH is a power of 2.
+#define FUTEX_NHASH	64
+static struct Env *futex_queues[FUTEX_NHASH];
+
+// Number of environments blocked in futex_wait, so that unmapping a page is free when nobody waits.
+static int futex_nwaiters;
+// Number of those with a timeout, so that clock ticks are free when nobody has one.
+static int futex_ntimed;
+
+static struct Env **
+futex_queue(physaddr_t pa)
+{
+	return &futex_queues[(pa >> PGSHIFT) & (FUTEX_NHASH - 1)];
+}
+
+// e no longer waits (but isn't made runnable): take it off its wait queue.
+static void
+futex_forget(struct Env *e)
+{
+	struct Env **pp;
+
+	for (pp = futex_queue(e->env_futex_pa); *pp != e; pp = &(*pp)->env_futex_link)
+		assert(*pp != NULL);
+	*pp = e->env_futex_link;
+	e->env_futex_link = NULL;
+
+	if (e->env_futex_deadline) {
+		e->env_futex_deadline = 0;
+		futex_ntimed--;
+	}
+	e->env_futex_pa = 0;
+	futex_nwaiters--;
+}
+
+static void
+futex_unblock(struct Env *e)
+{
+	futex_forget(e);
+	e->env_status = ENV_RUNNABLE;
+}
+
+// Look up the physical address of the word at 'addr' in e's address space.
+// Returns 0 if addr isn't word-aligned or isn't mapped user memory (which includes the read-only
+// UENVS and UPAGES, so that users can wait on kernel words such as env_ipc_nrecv).
+static physaddr_t
+futex_key(struct Env *e, uint32_t *addr)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+
+	if ((uintptr_t) addr % sizeof(uint32_t) != 0 || (uintptr_t) addr >= ULIM)
+		return 0;
+	pp = page_lookup(e->env_pgdir, addr, &pte);
+	if (pp == NULL || !(*pte & PTE_U))
+		return 0;
+	return page2pa(pp) + PGOFF(addr);
+}
+
+// Block e on the word at 'addr' if it still holds 'val', for at most 'msec' milliseconds (0 means no limit).
+// The word is read through the kernel mapping of its page, so e need not be the current environment.
+// Returns 1 if e is now blocked (the caller gives up the CPU, and e sees 0 once it is woken or times out),
+// 0 if the word already changed, or -E_INVAL if addr is not a mapped, aligned user address.
+int
+futex_wait(struct Env *e, uint32_t *addr, uint32_t val, uint32_t msec)
+{
+	physaddr_t pa;
+
+	if ((pa = futex_key(e, addr)) == 0)
+		return -E_INVAL;
+	if (*(volatile uint32_t *) KADDR(pa) != val)
+		return 0;
+
+	e->env_futex_pa = pa;
+	e->env_futex_link = *futex_queue(pa);
+	*futex_queue(pa) = e;
+	e->env_status = ENV_NOT_RUNNABLE;
+	e->env_tf.tf_regs.reg_eax = 0;
+	futex_nwaiters++;
+	if (msec) {
+		// Never 0, which means no timeout.
+		e->env_futex_deadline = MAX(time_msec() + msec, 1);
+		futex_ntimed++;
+	}
+	return 1;
+}
+
+// Wake up to 'n' environments blocked on the word at physical address 'pa'.
+static int
+futex_wake_pa(physaddr_t pa, int n)
+{
+	struct Env *e, *next;
+	int woken = 0;
+
+	for (e = *futex_queue(pa); e != NULL && woken < n; e = next) {
+		next = e->env_futex_link;
+		if (e->env_futex_pa == pa && e->env_status == ENV_NOT_RUNNABLE) {
+			futex_unblock(e);
+			woken++;
+		}
+	}
+	return woken;
+}
+
+// Wake up to 'n' environments blocked on the word at 'addr' (in e's address space).
+// Returns the number of environments woken, or -E_INVAL if addr is not a mapped, aligned user address.
+int
+futex_wake(struct Env *e, uint32_t *addr, int n)
+{
+	physaddr_t pa;
+
+	if ((pa = futex_key(e, addr)) == 0)
+		return -E_INVAL;
+	return futex_wake_pa(pa, n);
+}
+
+// Wake up to 'n' environments blocked on a kernel word that users see read-only, such as a field of struct Env
+// through UENVS. 'kva' is the kernel's address of the word.
+int
+futex_wake_kaddr(uint32_t *kva, int n)
+{
+	if (futex_nwaiters == 0)
+		return 0;
+	return futex_wake_pa(PADDR(kva), n);
+}
+
+// e stops waiting without a wakeup (it is being freed, or its status is set from outside).
+void
+futex_cancel(struct Env *e)
+{
+	if (e->env_futex_pa)
+		futex_forget(e);
+}
+
+// A mapping of pp is being removed: wake everybody blocked on a word in it.
+void
+futex_page_removed(struct PageInfo *pp)
+{
+	struct Env *e, *next;
+	physaddr_t pa;
+
+	if (futex_nwaiters == 0)
+		return;
+
+	pa = page2pa(pp);
+	for (e = *futex_queue(pa); e != NULL; e = next) {
+		next = e->env_futex_link;
+		if (e->env_futex_pa - pa < PGSIZE && e->env_status == ENV_NOT_RUNNABLE)
+			futex_unblock(e);
+	}
+}
+
+// Clock tick (boot CPU only): wake the waiters whose timeout expired.
+void
+futex_tick(void)
+{
+	struct Env *e, *next;
+	uint32_t now;
+	int i;
+
+	if (futex_ntimed == 0)
+		return;
+
+	now = time_msec();
+	for (i = 0; i < FUTEX_NHASH; i++) {
+		for (e = futex_queues[i]; e != NULL; e = next) {
+			next = e->env_futex_link;
+			if (e->env_futex_deadline && e->env_futex_deadline <= now
+			    && e->env_status == ENV_NOT_RUNNABLE)
+				futex_unblock(e);
+		}
+	}
+}
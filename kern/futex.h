@@ -0,0 +1,19 @@
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+struct PageInfo;
+
+int futex_wait(struct Env *e, uint32_t *addr, uint32_t val, uint32_t msec);
+int futex_wake(struct Env *e, uint32_t *addr, int n);
+int futex_wake_kaddr(uint32_t *kva, int n);
+void futex_cancel(struct Env *e);
+void futex_page_removed(struct PageInfo *pp);
+void futex_tick(void);
+
+#endif /* JOS_KERN_FUTEX_H */
@@ -0,0 +1,150 @@
+#include <kern/ide.h>
+#include <kern/pcireg.h>
+#include <kern/env.h>
+#include <kern/picirq.h>
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/trap.h>
+#include <inc/fs.h>
+#include <kern/time.h>
+
+// Bus master base of the IDE controller. Zero if there is none (the file server then sticks to PIO). 
+uint16_t ide_bmbase; 
+
+// IRQ line forwarded to the file server. Zero until ide_dma_init. 
+uint8_t ide_irq; 
+
+// Environment that receives the disk interrupt (the file server). 
+static envid_t ide_env; 
+// Disk interrupts that arrived while the file server was not waiting for one. 
+static uint32_t ide_pending; 
+// True if ide_env is blocked in ide_intr_wait. 
+static bool ide_waiting; 
+// Time (in msec) at which the file server's flush timer expires. Zero if it isn't set. 
+static uint32_t ide_timer_deadline; 
+// True if the flush timer expired while the file server was not receiving. 
+static bool ide_timer_pending; 
+
+int pci_attach_ide(struct pci_func *pcif) {
+	
+	// Enables IO space and bus mastering, and reads the BARs. 
+	pci_func_enable(pcif); 
+	
+	// Only controllers that advertise bus mastering have the BAR4 register block (command, status, PRD table address). 
+	if (!(PCI_INTERFACE(pcif->dev_class) & IDE_PCI_IF_BUSMASTER) || pcif->reg_base[4] == 0) {
+		cprintf("IDE: no bus master support, using PIO only \n"); 
+		return 0; 
+	}
+	
+	ide_bmbase = pcif->reg_base[4]; 
+	cprintf("IDE: bus master registers at 0x%x \n", ide_bmbase); 
+	return 0; 
+}
+
+// Called by the file server (env 'e') before it starts DMA. 
+// Routes the primary channel IRQ to 'e'. Returns the bus master base. 
+int ide_dma_init(struct Env *e) {
+	if (ide_bmbase == 0)
+		return -E_NOT_SUPP; 
+	
+	ide_env = e->env_id; 
+	ide_pending = 0; 
+	ide_waiting = 0; 
+	
+	// The disks run in compatibility mode, so the primary channel always uses IRQ 14 (not pcif->irq_line). 
+	if (!ide_irq) {
+		ide_irq = IRQ_IDE; 
+		irq_setmask_8259A(irq_mask_8259A & ~(1<<ide_irq));
+	}
+	return ide_bmbase; 
+}
+
+// Called by the file server to wait for the next disk interrupt. 
+// Returns 0 if one is already pending (and consumes it), 1 if the caller should block until ide_intr wakes it up. 
+int ide_intr_wait(struct Env *e) {
+	if (e->env_id != ide_env)
+		return -E_BAD_ENV; 
+	
+	if (ide_pending) {
+		ide_pending--; 
+		return 0; 
+	}
+	ide_waiting = 1; 
+	return 1; 
+}
+
+// Hand a notification (FSNOTE_*) to 'e' as an IPC message from the kernel (envid 0, no page). 
+static void ide_intr_deliver(struct Env *e, uint32_t note) {
+	e->env_ipc_recving = 0; 
+	e->env_ipc_from = 0; 
+	e->env_ipc_value = note; 
+	e->env_ipc_perm = 0; 
+	e->env_ipc_npages = 0; 
+	e->env_tf.tf_regs.reg_eax = 0; 
+}
+
+// Disk interrupt: wake up the file server (or remember the interrupt for its next ide_intr_wait or sys_ipc_recv). 
+// If the file server is blocked in sys_ide_wait it waits for one specific transfer, so wake it up. 
+// If it is blocked in sys_ipc_recv (serving clients while transfers are queued), deliver the interrupt as a message. 
+// Acknowledging the interrupt on the drive and controller is left to the file server. 
+void ide_intr(void) {
+	struct Env *e; 
+	
+	if (envid2env(ide_env, &e, 0) == 0 && e->env_status == ENV_NOT_RUNNABLE) {
+		if (ide_waiting) {
+			ide_waiting = 0; 
+			e->env_status = ENV_RUNNABLE; 
+			return; 
+		}
+		if (e->env_ipc_recving) {
+			ide_intr_deliver(e, FSNOTE_DISK); 
+			e->env_status = ENV_RUNNABLE; 
+			return; 
+		}
+	}
+	ide_pending++; 
+}
+
+// Called by sys_ipc_recv. If a disk interrupt or flush timer is pending for 'e', delivers it right away and returns 1 (the receive completes without blocking). 
+int ide_intr_recv(struct Env *e) {
+	if (e->env_id != ide_env)
+		return 0; 
+	
+	if (ide_pending) {
+		ide_pending--; 
+		ide_intr_deliver(e, FSNOTE_DISK); 
+		return 1; 
+	}
+	if (ide_timer_pending) {
+		ide_timer_pending = 0; 
+		ide_intr_deliver(e, FSNOTE_TIMER); 
+		return 1; 
+	}
+	return 0; 
+}
+
+// Arm the file server's (one-shot) flush timer: send 'e' an FSNOTE_TIMER message in 'msec' milliseconds. 
+void ide_timer_set(struct Env *e, uint32_t msec) {
+	ide_env = e->env_id; 
+	ide_timer_pending = 0; 
+	ide_timer_deadline = time_msec() + msec; 
+	if (ide_timer_deadline == 0)
+		ide_timer_deadline = 1; 
+}
+
+// Clock tick (boot CPU only): fire the flush timer once it expires. 
+void ide_tick(void) {
+	struct Env *e; 
+	
+	if (ide_timer_deadline == 0 || time_msec() < ide_timer_deadline)
+		return; 
+	ide_timer_deadline = 0; 
+	
+	// Deliver it now if the file server is waiting for requests, otherwise at its next sys_ipc_recv. 
+	if (!ide_waiting && envid2env(ide_env, &e, 0) == 0 && e->env_status == ENV_NOT_RUNNABLE && e->env_ipc_recving) {
+		ide_intr_deliver(e, FSNOTE_TIMER); 
+		e->env_status = ENV_RUNNABLE; 
+		return; 
+	}
+	ide_timer_pending = 1; 
+}
@@ -0,0 +1,27 @@
+#ifndef JOS_KERN_IDE_H
+#define JOS_KERN_IDE_H
+
+#include <kern/pci.h>
+
+// PCI IDE controller (QEMU emulates a PIIX3, 8086:7010). 
+// The disks stay on the legacy (compatibility mode) ports and IRQ. The kernel only records the bus master base (BAR4), 
+// and forwards the disk interrupt to the file server, which drives the controller itself (it has IOPL 3). 
+#define IDE_PCI_IF_BUSMASTER	0x80		// Programming interface bit: controller supports bus mastering
+
+struct Env; 
+
+// Functions
+int pci_attach_ide(struct pci_func *pcif); 
+int ide_dma_init(struct Env *e); 
+int ide_intr_wait(struct Env *e); 
+void ide_intr(void); 
+int ide_intr_recv(struct Env *e); 
+void ide_timer_set(struct Env *e, uint32_t msec); 
+void ide_tick(void); 
+
+// Bus master I/O base (0 if the controller can't do DMA)
+extern uint16_t ide_bmbase; 
+// IRQ forwarded to the file server (0 until the file server asks for it)
+extern uint8_t ide_irq; 
+
+#endif	// JOS_KERN_IDE_H
@@ -16,6 +16,7 @@
 #include <kern/spinlock.h>
 #include <kern/time.h>
 #include <kern/pci.h>
+#include <kern/fpu.h>
 
 static void boot_aps(void);
 
@@ -40,6 +41,7 @@ i386_init(void)
 	// Lab 3 user environment initialization functions
 	env_init();
 	trap_init();
+	fpu_init_percpu();
 
 	// Lab 4 multiprocessor initialization functions
 	mp_init();
@@ -128,6 +130,7 @@ mp_main(void)
 	lapic_init();
 	env_init_percpu();
 	trap_init_percpu();
+	fpu_init_percpu();
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 	
 
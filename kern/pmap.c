@@ -10,6 +10,7 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/futex.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -845,6 +846,9 @@ page_remove(pde_t *pgdir, void *va)
 		return; 
 	}
 	
+	// Environments blocked on a futex in this page re-check their condition (see kern/futex.c). 
+	futex_page_removed(page_p); 
+	
 	// UNMAP THE PHYSICAL PAGE at the virtual address. 
 	// 3) Decrement the ref count on the page. When the refcount reaches 0, free the physical page. This also frees the page!
 	page_decref(page_p);
@@ -4,6 +4,7 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/fpu.h>
 
 //#define CHALLENGE4
 
@@ -169,6 +170,9 @@ sched_halt(void)
 			monitor(NULL);
 	}
 
+	// Save the FPU registers of the environment that ran here last (see kern/fpu.c)
+	fpu_leave();
+
 	// Mark that no environment is running on this CPU
 	curenv = NULL;
 	lcr3(PADDR(kern_pgdir));
@@ -13,6 +13,10 @@
 #include <kern/sched.h>
 #include <kern/time.h>
 #include <kern/e1000.h>
+#include <kern/ide.h>
+#include <kern/futex.h>
+#include <kern/fpu.h>
+#include <kern/cpu.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -103,6 +107,10 @@ sys_exofork(void)
 	// Copy over the registers, tweak the return value, and set to not_runnable. 
 	newenv->env_status = ENV_NOT_RUNNABLE; 
 	newenv->env_tf = curenv->env_tf; 
+	if ((error = fpu_env_copy(newenv, curenv)) < 0) {
+		env_free(newenv); 
+		return error; 
+	}
 	
 	// Make sure that the environments are manipulated to return the correct value. 
 	// Trick child environment to return 0. 
@@ -141,6 +149,8 @@ sys_env_set_status(envid_t envid, int status)
 		return error; 
 	}
 	
+	// An environment blocked on a futex no longer waits for the wakeup. 
+	futex_cancel(env_store); 
 	env_store->env_status = status; 
 	
 	return 0; 
@@ -402,50 +412,20 @@ sys_page_unmap(envid_t envid, void *va)
 	return 0; 
 }
 
-// Try to send 'value' to the target env 'envid'.
-// If srcva < UTOP, then also send page currently mapped at 'srcva',
-// so that receiver gets a duplicate mapping of the same page.
-//
-// The send fails with a return value of -E_IPC_NOT_RECV if the
-// target is not blocked, waiting for an IPC.
-//
-// The send also can fail for the other reasons listed below.
-//
-// Otherwise, the send succeeds, and the target's ipc fields are
-// updated as follows:
-//    env_ipc_recving is set to 0 to block future sends;
-//    env_ipc_from is set to the sending envid;
-//    env_ipc_value is set to the 'value' parameter;
-//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
-// The target environment is marked runnable again, returning 0
-// from the paused sys_ipc_recv system call.  (Hint: does the
-// sys_ipc_recv function ever actually return?)
-//
-// If the sender wants to send a page but the receiver isn't asking for one,
-// then no page mapping is transferred, but no error occurs.
-// The ipc only happens when no errors occur.
-//
-// Returns 0 on success, < 0 on error.
-// Errors are:
-//	-E_BAD_ENV if environment envid doesn't currently exist.
-//		(No need to check permissions.)
-//	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
-//		or another environment managed to send first.
-//	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
-//	-E_INVAL if srcva < UTOP and perm is inappropriate
-//		(see sys_page_alloc).
-//	-E_INVAL if srcva < UTOP but srcva is not mapped in the caller's
-//		address space.
-//	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
-//		current environment's address space.
-//	-E_NO_MEM if there's not enough memory to map srcva in envid's
-//		address space.
+// Like sys_ipc_try_send, but sends the 'npages' pages mapped at 'srcva'
+// (consecutive virtual pages), mapping them at the receiver's dstva in
+// the same order.  The receiver states how many pages it takes in
+// sys_ipc_recv_pages; sending more is -E_INVAL.  The number of pages
+// transferred ends up in the receiver's env_ipc_npages.
+// Lets the file server move bulk reads and writes in a single IPC.
 static int
-sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+sys_ipc_try_send_pages(envid_t envid, uint32_t value, void *srcva, size_t npages, unsigned perm)
 {
-	// LAB 4: Your code here.
-	//Get the env structure for envid. 
 	struct Env *env_target;
+	struct PageInfo *page_src; 
+	pte_t *pte_src; 
+	uintptr_t srcva_int = (uintptr_t) srcva; 
+	size_t i; 
 	int error; 
 	
 	// Get the struct for the target environment. Do not check any permissinos. 
@@ -458,15 +438,16 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 		return -E_IPC_NOT_RECV; 
 	}
 	
-	// Initialize perm to 0. Assume that page isn't sent. Update below as necessary. 
+	// Initialize perm to 0. Assume that no page is sent. Update below as necessary. 
 	env_target->env_ipc_perm = 0; 
+	env_target->env_ipc_npages = 0; 
 	
-	// Determine if we are sending a page. If we are, make appropriate checks, and then remap page at srcva to dstva.  
-	uintptr_t srcva_int = (uintptr_t) srcva; 
-	if ((srcva_int < UTOP) && ((uintptr_t) env_target->env_ipc_dstva < UTOP)) {
+	// Determine if we are sending pages. If we are, check all of them first, and then remap them at dstva.  
+	if ((srcva_int < UTOP) && ((uintptr_t) env_target->env_ipc_dstva < UTOP) && npages > 0) {
 	
-		// Return error if not page-aligned
-		if (srcva_int%PGSIZE != 0 ) {
+		// Return error if not page-aligned, or if the pages don't fit below UTOP on either side. 
+		if (srcva_int%PGSIZE != 0 || npages > env_target->env_ipc_maxpages
+		    || npages > (UTOP - srcva_int) / PGSIZE) {
 			return -E_INVAL; 
 		}
 	
@@ -475,29 +456,33 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 			return -E_INVAL;
 		} 
 	
-		pte_t *pte_src; 
-		struct PageInfo * page_src = page_lookup(curenv->env_pgdir, srcva, &pte_src); 
-		if (page_src == NULL) {
-		 return -E_INVAL; 
-		}
-	
-		// Checking write permissions on srce if user designates write permissions on send.  
-		if (!(*pte_src & PTE_W)) {
-			if (perm & PTE_W) {
+		for (i = 0; i < npages; i++) {
+			page_src = page_lookup(curenv->env_pgdir, (void *) (srcva_int + i * PGSIZE), &pte_src); 
+			if (page_src == NULL) {
+				return -E_INVAL; 
+			}
+			// Checking write permissions on source if user designates write permissions on send.  
+			if (!(*pte_src & PTE_W) && (perm & PTE_W)) {
 				return -E_INVAL; 
 			}
 		}
 
-		error = page_insert(env_target->env_pgdir, page_src, env_target->env_ipc_dstva, perm); 
-		if (error < 0) {
-			return error; 
+		for (i = 0; i < npages; i++) {
+			page_src = page_lookup(curenv->env_pgdir, (void *) (srcva_int + i * PGSIZE), NULL); 
+			error = page_insert(env_target->env_pgdir, page_src, (char *) env_target->env_ipc_dstva + i * PGSIZE, perm); 
+			if (error < 0) {
+				// Out of memory for a page table: take back the pages already mapped, so the receiver gets all of them or none. 
+				while (i-- > 0)
+					page_remove(env_target->env_pgdir, (char *) env_target->env_ipc_dstva + i * PGSIZE); 
+				return error; 
+			}
 		}
 		
-		//If sending the page was successful, make sure the pass the page permissions through the env structure. .  
+		//If sending the pages was successful, make sure the pass the page permissions through the env structure.  
 		env_target->env_ipc_perm = perm;
+		env_target->env_ipc_npages = npages; 
 	}
 	
-	
 	// Send succeeds, and update target's ipc fields
 	env_target->env_ipc_recving = 0; 
 	env_target->env_ipc_from = curenv->env_id; 
@@ -506,9 +491,52 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 	// Since sys_ipc_recv function never returns, we tell environment that the function was a success (through kernel control). 
 	env_target->env_tf.tf_regs.reg_eax = 0; 
 	
-	// Success of sys_ipc_try_send. 
+	// Success of sys_ipc_try_send_pages. 
 	return 0; 
-	
+}
+
+// Try to send 'value' to the target env 'envid'.
+// If srcva < UTOP, then also send page currently mapped at 'srcva',
+// so that receiver gets a duplicate mapping of the same page.
+//
+// The send fails with a return value of -E_IPC_NOT_RECV if the
+// target is not blocked, waiting for an IPC.
+//
+// The send also can fail for the other reasons listed below.
+//
+// Otherwise, the send succeeds, and the target's ipc fields are
+// updated as follows:
+//    env_ipc_recving is set to 0 to block future sends;
+//    env_ipc_from is set to the sending envid;
+//    env_ipc_value is set to the 'value' parameter;
+//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
+// The target environment is marked runnable again, returning 0
+// from the paused sys_ipc_recv system call.  (Hint: does the
+// sys_ipc_recv function ever actually return?)
+//
+// If the sender wants to send a page but the receiver isn't asking for one,
+// then no page mapping is transferred, but no error occurs.
+// The ipc only happens when no errors occur.
+//
+// Returns 0 on success, < 0 on error.
+// Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+//		(No need to check permissions.)
+//	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
+//		or another environment managed to send first.
+//	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
+//	-E_INVAL if srcva < UTOP and perm is inappropriate
+//		(see sys_page_alloc).
+//	-E_INVAL if srcva < UTOP but srcva is not mapped in the caller's
+//		address space.
+//	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
+//		current environment's address space.
+//	-E_NO_MEM if there's not enough memory to map srcva in envid's
+//		address space.
+static int
+sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	return sys_ipc_try_send_pages(envid, value, srcva, 1, perm); 
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -518,12 +546,17 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
 //
+// sys_ipc_recv_pages is willing to receive up to 'maxpages' pages,
+// mapped at consecutive addresses from 'dstva' (see
+// sys_ipc_try_send_pages); sys_ipc_recv receives at most one.
+//
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
-//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned, or the
+//		pages don't fit below UTOP.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv_pages(void *dstva, size_t maxpages)
 {
 	// LAB 4: Your code here.
 	
@@ -537,14 +570,22 @@ sys_ipc_recv(void *dstva)
 	
 	// Check for dstva page-align error. 
 	uintptr_t dstva_int = (uintptr_t) dstva; 
-	if ((dstva_int < UTOP) && (dstva_int%PGSIZE != 0)) {
+	if ((dstva_int < UTOP) && (dstva_int%PGSIZE != 0 || maxpages > (UTOP - dstva_int) / PGSIZE)) {
 		warn("sys_ipc_recv: Va used to send page is below UTOP, but not page aligned");
 		return -E_INVAL;
 	}
 	
+	// A disk interrupt that the file server hasn't seen yet counts as a message. 
+	if (ide_intr_recv(curenv))
+		return 0; 
+	
 	curenv->env_ipc_recving = 1; 
 	// Indicate to sender where to map page to e sent. 
 	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_maxpages = maxpages; 
+	// Wake the senders that found us not receiving (see ipc_send). 
+	curenv->env_ipc_nrecv++; 
+	futex_wake_kaddr(&curenv->env_ipc_nrecv, NENV); 
 	// Mark as not runnable (block until receive the message). 
 	curenv->env_status = ENV_NOT_RUNNABLE; 
 	// Give up the CPU (to allw message to be sent to this CPU). 
@@ -554,6 +595,12 @@ sys_ipc_recv(void *dstva)
 	return -100; 
 }
 
+static int
+sys_ipc_recv(void *dstva)
+{
+	return sys_ipc_recv_pages(dstva, 1); 
+}
+
 static int
 sys_change_priority(int priority)
 {
@@ -594,6 +641,46 @@ sys_transmit_packet(void *packet, size_t size)
 
 }
 
+// Transmit one packet given as an array of 'nsegs' fragments (scatter-gather). 
+static int
+sys_transmit_sg(struct TxSeg *segs, int nsegs)
+{
+	struct TxSeg ksegs[E1000_TX_MAX_SEGS]; 
+	int i; 
+	
+	if (nsegs <= 0 || nsegs > E1000_TX_MAX_SEGS)
+		return -E_INVAL; 
+	
+	// Copy the fragment list into the kernel first, so the user cannot change it after we checked it. 
+	user_mem_assert(curenv, segs, nsegs * sizeof(struct TxSeg), PTE_U | PTE_P); 
+	memcpy(ksegs, segs, nsegs * sizeof(struct TxSeg)); 
+	
+	// Make sure we have permission to read every fragment. 
+	for (i = 0; i < nsegs; i++)
+		user_mem_assert(curenv, ksegs[i].ts_addr, ksegs[i].ts_len, PTE_U | PTE_P); 
+	
+	return e1000_transmit_sg(ksegs, nsegs); 
+}
+
+// Transmit one large TCP segment (given as 'nsegs' fragments, headers in the first one) and let the E1000 segment it into frames of at most 'mss' payload bytes. 
+static int
+sys_transmit_tso(struct TxSeg *segs, int nsegs, size_t hdrlen, size_t mss)
+{
+	struct TxSeg ksegs[E1000_TSO_MAX_SEGS]; 
+	int i; 
+	
+	if (nsegs <= 0 || nsegs > E1000_TSO_MAX_SEGS)
+		return -E_INVAL; 
+	
+	// Same checks as sys_transmit_sg. 
+	user_mem_assert(curenv, segs, nsegs * sizeof(struct TxSeg), PTE_U | PTE_P); 
+	memcpy(ksegs, segs, nsegs * sizeof(struct TxSeg)); 
+	for (i = 0; i < nsegs; i++)
+		user_mem_assert(curenv, ksegs[i].ts_addr, ksegs[i].ts_len, PTE_U | PTE_P); 
+	
+	return e1000_transmit_tso(ksegs, nsegs, hdrlen, mss); 
+}
+
 static int
 sys_receive_packet(void *packet, size_t *size) 
 {
@@ -623,6 +710,126 @@ sys_get_mac_addr(uint16_t * mac_addr) {
 
 }
 
+// Called by the input environment when the receive ring is empty. 
+// In polling mode, just give up the CPU so the caller can poll again. 
+// In interrupt mode, block the caller until the E1000 raises a receive interrupt (see e1000_intr). 
+// Returns 0 (through the caller's trapframe) once the caller should poll the ring again. 
+static int
+sys_net_rx_wait(void)
+{
+	if (e1000_irq == 0) {
+		return -E_NETWORK_GEN; 
+	}
+	
+	// The caller will see 0 when it is scheduled again. 
+	curenv->env_tf.tf_regs.reg_eax = 0; 
+	
+	if (e1000_rx_idle(curenv)) {
+		curenv->env_status = ENV_NOT_RUNNABLE; 
+	}
+	sched_yield(); 
+	
+	panic("sys_net_rx_wait: sched_yield returned. \n");
+	return -E_NETWORK_GEN; 
+}
+
+// Copy the E1000 receive mode and counters to user space. 
+static int
+sys_net_stats(struct NicStats *stats)
+{
+	user_mem_assert(curenv, stats, sizeof(struct NicStats), PTE_W | PTE_U | PTE_P);
+	e1000_get_stats(stats); 
+	return 0; 
+}
+
+// Return the physical address that 'va' maps to in the current environment. 
+// Used by the file server to build DMA descriptors, so only environments with I/O privileges (the file server) may ask. 
+static int
+sys_page_phys(void *va)
+{
+	pte_t *pte; 
+	struct PageInfo *pp; 
+	
+	if (curenv->env_type != ENV_TYPE_FS)
+		return -E_BAD_ENV; 
+	if ((uintptr_t) va >= UTOP)
+		return -E_INVAL; 
+	if ((pp = page_lookup(curenv->env_pgdir, va, &pte)) == NULL)
+		return -E_INVAL; 
+	
+	return page2pa(pp) | PGOFF(va); 
+}
+
+// Route the disk interrupt to the file server and return the IDE bus master base (for DMA). 
+static int
+sys_ide_dma_init(void)
+{
+	if (curenv->env_type != ENV_TYPE_FS)
+		return -E_BAD_ENV; 
+	return ide_dma_init(curenv); 
+}
+
+// Block the file server until the next disk interrupt (returns at once if one arrived since the last call). 
+static int
+sys_ide_wait(void)
+{
+	int r; 
+	
+	if ((r = ide_intr_wait(curenv)) <= 0)
+		return r; 
+	
+	// The caller will see 0 when ide_intr makes it runnable again. 
+	curenv->env_tf.tf_regs.reg_eax = 0; 
+	curenv->env_status = ENV_NOT_RUNNABLE; 
+	sched_yield(); 
+	
+	panic("sys_ide_wait: sched_yield returned. \n");
+	return -E_INVAL; 
+}
+
+// Send the file server an FSNOTE_TIMER message in 'msec' milliseconds (one-shot), so it can write back dirty blocks. 
+static int
+sys_fs_timer(uint32_t msec)
+{
+	if (curenv->env_type != ENV_TYPE_FS)
+		return -E_BAD_ENV; 
+	ide_timer_set(curenv, msec); 
+	return 0; 
+}
+
+// Block the caller until another environment calls sys_futex_wake on the word at 'addr', or for at most 
+// 'msec' milliseconds if msec is not 0. If the word no longer holds 'val', return 0 right away. 
+// Environments sharing the page may map it at different addresses; the word is found by its physical address. 
+// Wakeups may be spurious (see kern/futex.c), so the caller re-checks its condition after returning. 
+// Returns 0, or -E_INVAL if addr is not a mapped, word-aligned user address. 
+static int
+sys_futex_wait(uint32_t *addr, uint32_t val, uint32_t msec)
+{
+	int r; 
+	
+	if ((r = futex_wait(curenv, addr, val, msec)) <= 0)
+		return r; 
+	sched_yield(); 
+	
+	panic("sys_futex_wait: sched_yield returned. \n");
+	return -E_INVAL; 
+}
+
+// Wake up to 'n' environments blocked in sys_futex_wait on the word at 'addr'. 
+// Returns the number woken, or -E_INVAL if addr is not a mapped, word-aligned user address. 
+static int
+sys_futex_wake(uint32_t *addr, int n)
+{
+	return futex_wake(curenv, addr, n); 
+}
+
+// Return the number of CPUs, so user programs can run one worker per CPU. 
+static int
+sys_ncpu(void)
+{
+	return ncpu; 
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -663,16 +870,42 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 			return sys_ipc_try_send((envid_t) a1, (uint32_t) a2, (void *) a3, (unsigned) a4);
 		case SYS_ipc_recv : 			
 			return sys_ipc_recv((void *) a1);
+		case SYS_ipc_try_send_pages : 
+			return sys_ipc_try_send_pages((envid_t) a1, (uint32_t) a2, (void *) a3, (size_t) a4, (unsigned) a5);
+		case SYS_ipc_recv_pages : 
+			return sys_ipc_recv_pages((void *) a1, (size_t) a2);
 		case SYS_change_priority : 
 			return sys_change_priority((int) a1);
 		case SYS_time_msec : 
 			return sys_time_msec(); 
 		case SYS_transmit_packet : 
 			return sys_transmit_packet((void *) a1, (size_t) a2);
+		case SYS_transmit_sg : 
+			return sys_transmit_sg((struct TxSeg *) a1, (int) a2);
+		case SYS_transmit_tso : 
+			return sys_transmit_tso((struct TxSeg *) a1, (int) a2, (size_t) a3, (size_t) a4);
 		case SYS_receive_packet : 
 			return sys_receive_packet((void *) a1, (size_t *) a2); 
 		case SYS_get_mac_addr : 
 			return sys_get_mac_addr((uint16_t *) a1); 
+		case SYS_net_rx_wait : 
+			return sys_net_rx_wait(); 
+		case SYS_net_stats : 
+			return sys_net_stats((struct NicStats *) a1); 
+		case SYS_page_phys : 
+			return sys_page_phys((void *) a1); 
+		case SYS_ide_dma_init : 
+			return sys_ide_dma_init(); 
+		case SYS_ide_wait : 
+			return sys_ide_wait(); 
+		case SYS_fs_timer : 
+			return sys_fs_timer(a1); 
+		case SYS_futex_wait : 
+			return sys_futex_wait((uint32_t *) a1, a2, a3); 
+		case SYS_futex_wake : 
+			return sys_futex_wake((uint32_t *) a1, (int) a2); 
+		case SYS_ncpu : 
+			return sys_ncpu(); 
 
 		default:
 			warn("syscall.c: Received an undefined system call. \n"); 
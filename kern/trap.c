@@ -15,6 +15,10 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/time.h>
+#include <kern/e1000.h>
+#include <kern/ide.h>
+#include <kern/futex.h>
+#include <kern/fpu.h>
 //#include <kern/cpu.h>
 
 static struct Taskstate ts;
@@ -287,6 +291,16 @@ trap_dispatch(struct Trapframe *tf)
 	
 	}
 	
+	// Device not available: the environment used the FPU for the first time since it was switched in, so 
+	// give it its registers (lazy FPU switching, see kern/fpu.c). 
+	if (tf->tf_trapno == T_DEVICE && (tf->tf_cs & 3) == 3) {
+		if (fpu_trap() < 0) {
+			cprintf("[%08x] no memory for FPU registers\n", curenv->env_id);
+			env_destroy(curenv);
+		}
+		return; 
+	}
+	
 	if ((tf->tf_trapno == T_DEBUG) || (tf->tf_trapno == T_BRKPT)) {
 		cprintf("Breakpoint or Debug Exception \n");
 		monitor(tf);
@@ -342,6 +356,8 @@ trap_dispatch(struct Trapframe *tf)
 		// Only bootcpu manages the time. 
 		if (thiscpu->cpu_id == bootcpu->cpu_id) {
 			time_tick(); 
+			ide_tick(); 
+			futex_tick(); 
 		}
 		
 		lapic_eoi(); 
@@ -366,6 +382,23 @@ trap_dispatch(struct Trapframe *tf)
 	}
 	
 	
+	// Handle E1000 (receive) interrupts. 
+	if (e1000_irq && tf->tf_trapno == IRQ_OFFSET + e1000_irq) {
+		e1000_intr(); 
+		// The E1000's IRQ (11) is on the slave 8259, which has no automatic EOI: without this, it never interrupts again. 
+		irq_eoi(); 
+		return; 
+	}
+	
+	
+	// Handle disk interrupts (forwarded to the file server). 
+	if (ide_irq && tf->tf_trapno == IRQ_OFFSET + ide_irq) {
+		ide_intr(); 
+		// IRQ 14 is on the slave 8259 too; the file server's status read (ide_dma_finish) only acknowledges the drive. 
+		irq_eoi(); 
+		return; 
+	}
+	
 	// Handle interrupts that we don't excplicitly handle yet. 
 	if (tf->tf_trapno > IRQ_OFFSET && tf->tf_trapno <= (IRQ_OFFSET + 15)) {
 		cprintf("Interrupt caught without explicit routing. \n");
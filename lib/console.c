@@ -38,6 +38,7 @@ static ssize_t devcons_read(struct Fd*, void*, size_t);
 static ssize_t devcons_write(struct Fd*, const void*, size_t);
 static int devcons_close(struct Fd*);
 static int devcons_stat(struct Fd*, struct Stat*);
+static int devcons_poll(struct Fd*, int);
 
 struct Dev devcons =
 {
@@ -46,9 +47,14 @@ struct Dev devcons =
 	.dev_read =	devcons_read,
 	.dev_write =	devcons_write,
 	.dev_close =	devcons_close,
-	.dev_stat =	devcons_stat
+	.dev_stat =	devcons_stat,
+	.dev_poll =	devcons_poll
 };
 
+// sys_cgetc consumes the character, so devcons_poll keeps
+// the one it found here for the next devcons_read.
+static int cons_lookahead;
+
 int
 iscons(int fdnum)
 {
@@ -83,8 +89,12 @@ devcons_read(struct Fd *fd, void *vbuf, size_t n)
 	if (n == 0)
 		return 0;
 
-	while ((c = sys_cgetc()) == 0)
-		sys_yield();
+	if (cons_lookahead) {
+		c = cons_lookahead;
+		cons_lookahead = 0;
+	} else
+		while ((c = sys_cgetc()) == 0)
+			sys_yield();
 	if (c < 0)
 		return c;
 	if (c == 0x04)	// ctl-d is eof
@@ -111,6 +121,20 @@ devcons_write(struct Fd *fd, const void *vbuf, size_t n)
 	return tot;
 }
 
+static int
+devcons_poll(struct Fd *fd, int events)
+{
+	int revents = events & POLLOUT;
+
+	if (events & POLLIN) {
+		if (!cons_lookahead)
+			cons_lookahead = sys_cgetc();
+		if (cons_lookahead)
+			revents |= POLLIN;
+	}
+	return revents;
+}
+
 static int
 devcons_close(struct Fd *fd)
 {
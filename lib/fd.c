@@ -3,7 +3,8 @@
 #define debug		0
 
 // Maximum number of file descriptors a program may hold open concurrently
-#define MAXFD		32
+// (enough for a server with a thousand open connections)
+#define MAXFD		1024
 // Bottom of file descriptor area
 #define FDTABLE		0xD0000000
 // Bottom of file data area.  We reserve one data page for each FD,
@@ -319,3 +320,103 @@ stat(const char *path, struct Stat *stat)
 	return r;
 }
 
+
+// Wait until one of the file descriptors in 'fds' is ready, like POSIX poll().
+// 'timeout' is in milliseconds (-1: wait forever, 0: just check).
+// Returns the number of entries with nonzero revents, or < 0 on error.
+//
+// Sockets are all checked (and waited for) with sockpoll, one request
+// per network server shard.  Other devices are checked with dev_poll.
+// If only sockets are polled, sockpoll blocks until one is ready;
+// otherwise we wait in slices of POLL_SLICE msec and check again,
+// sleeping in the kernel (a futex wait that only times out) when there
+// is no socket to wait in the network server for.
+#define POLL_SLICE	10
+
+// Never changes, so a futex wait on it sleeps for the whole timeout.
+static volatile uint32_t poll_sleep;
+
+int
+poll(struct pollfd *fds, int nfds, int timeout)
+{
+	struct pollfd *sfds = NULL;
+	int *sidx = NULL;
+	int i, r, nready, nsock, waitable, remaining, wait, nmax;
+	uint32_t start = sys_time_msec();
+	struct Dev *dev;
+	struct Fd *fd;
+
+	// The sockets, in the form sockpoll takes, and where each came
+	// from in fds.  Too big for the one-page stack, and private to this
+	// call, since sforked environments may poll at the same time.
+	nmax = MIN(nfds, NSPOLL_MAX);
+	if (nmax > 0) {
+		if (!(sfds = malloc(nmax * (sizeof(*sfds) + sizeof(*sidx)))))
+			return -E_NO_MEM;
+		sidx = (int *) (sfds + nmax);
+	}
+
+	while (1) {
+		nready = nsock = waitable = 0;
+		for (i = 0; i < nfds; i++) {
+			fds[i].revents = 0;
+			if (fds[i].fd < 0)
+				continue;
+			if (fd_lookup(fds[i].fd, &fd) < 0
+			    || dev_lookup(fd->fd_dev_id, &dev) < 0) {
+				fds[i].revents = POLLNVAL;
+				nready++;
+				continue;
+			}
+			if (dev == &devsock) {
+				if (nsock == nmax) {
+					r = -E_INVAL;
+					goto out;
+				}
+				sfds[nsock].fd = fds[i].fd;
+				sfds[nsock].events = fds[i].events;
+				sfds[nsock].revents = 0;
+				sidx[nsock++] = i;
+				continue;
+			}
+			if (dev->dev_poll) {
+				fds[i].revents = (*dev->dev_poll)(fd, fds[i].events);
+				waitable = 1;
+			} else
+				fds[i].revents = fds[i].events & (POLLIN | POLLOUT);
+			if (fds[i].revents)
+				nready++;
+		}
+
+		remaining = timeout;
+		if (timeout > 0 && (remaining = timeout - (sys_time_msec() - start)) < 0)
+			remaining = 0;
+
+		if (nsock > 0) {
+			if (nready > 0)
+				wait = 0;
+			else if (!waitable)
+				wait = remaining;
+			else
+				wait = (remaining < 0 || remaining > POLL_SLICE) ? POLL_SLICE : remaining;
+			if ((r = sockpoll(sfds, nsock, wait)) < 0)
+				goto out;
+			for (i = 0; i < nsock; i++)
+				fds[sidx[i]].revents = sfds[i].revents;
+			nready += r;
+		}
+
+		if (nready > 0 || remaining == 0) {
+			r = nready;
+			goto out;
+		}
+		if (nsock == 0) {
+			wait = (remaining < 0 || remaining > POLL_SLICE) ? POLL_SLICE : remaining;
+			sys_futex_wait(&poll_sleep, 0, wait);
+		}
+	}
+
+out:
+	free(sfds);
+	return r;
+}
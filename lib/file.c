@@ -6,6 +6,13 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+// Window for bulk requests: the request page, followed by up to
+// FSBULK_MAXPAGES data pages (sent for a bulk write, received for a
+// bulk read).  Nothing stays mapped here between requests.
+#define BULKVA		0xCF000000
+
+static envid_t fsenv;
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
@@ -15,7 +22,6 @@ union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 fsipc(unsigned type, void *dstva)
 {
-	static envid_t fsenv;
 	if (fsenv == 0)
 		fsenv = ipc_find_env(ENV_TYPE_FS);
 
@@ -28,6 +34,36 @@ fsipc(unsigned type, void *dstva)
 	return ipc_recv(NULL, dstva, NULL);
 }
 
+// Send a bulk request: fsipcbuf followed by the ndata data pages
+// already mapped at BULKVA + PGSIZE.  Up to FSBULK_MAXPAGES reply
+// pages are received at BULKVA; *nreply is set to their number.
+// The caller unmaps the window when it is done with it.
+static int
+fsipc_bulk(unsigned type, size_t ndata, size_t *nreply)
+{
+	int r;
+
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	if ((r = sys_page_map(0, &fsipcbuf, 0, (void *) BULKVA, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	// Lent pages of a bulk write are read-only; a bulk read can be parked, which remaps the request page writable.
+	ipc_send_pages(fsenv, type, (void *) BULKVA, 1 + ndata, ndata ? PTE_P|PTE_U : PTE_P|PTE_U|PTE_W);
+	*nreply = FSBULK_MAXPAGES;
+	return ipc_recv_pages(NULL, (void *) BULKVA, nreply, NULL);
+}
+
+// Unmap the first npages pages of the bulk window.
+static void
+bulk_unmap(size_t npages)
+{
+	size_t i;
+
+	for (i = 0; i < npages; i++)
+		sys_page_unmap(0, (char *) BULKVA + i * PGSIZE);
+}
+
 static int devfile_flush(struct Fd *fd);
 static ssize_t devfile_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devfile_write(struct Fd *fd, const void *buf, size_t n);
@@ -103,6 +139,26 @@ devfile_flush(struct Fd *fd)
 	return fsipc(FSREQ_FLUSH, NULL);
 }
 
+// Read at most 'n' bytes, more than a page, from 'fd' with a single
+// FSREQ_READ_BULK request.  The file server sends the data back on up to
+// FSBULK_MAXPAGES pages of its own, which are copied into 'buf'.
+static ssize_t
+devfile_read_bulk(struct Fd *fd, void *buf, size_t n)
+{
+	size_t nreply;
+	int r;
+
+	fsipcbuf.bulk.req_fileid = fd->fd_file.id;
+	fsipcbuf.bulk.req_n = MIN(n, FSBULK_MAXPAGES * PGSIZE);
+	r = fsipc_bulk(FSREQ_READ_BULK, 0, &nreply);
+	if (r > 0) {
+		assert(r <= n && r <= nreply * PGSIZE);
+		memmove(buf, (void *) BULKVA, r);
+	}
+	bulk_unmap(MAX(nreply, 1));
+	return r;
+}
+
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
 //
 // Returns:
@@ -117,6 +173,9 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// system server.
 	int r;
 
+	if (n > PGSIZE)
+		return devfile_read_bulk(fd, buf, n);
+
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
 	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
@@ -128,6 +187,40 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 }
 
 
+// Write at most 'n' bytes, more than fit in fsipcbuf, to 'fd' with a
+// single FSREQ_WRITE_BULK request.  Whole pages of a page-aligned 'buf'
+// are lent to the file server read-only instead of being copied.
+static ssize_t
+devfile_write_bulk(struct Fd *fd, const void *buf, size_t n)
+{
+	size_t ndata, nreply, i, len;
+	const char *src;
+	char *dst;
+	int r;
+
+	n = MIN(n, FSBULK_MAXPAGES * PGSIZE);
+	ndata = ROUNDUP(n, PGSIZE) / PGSIZE;
+	for (i = 0; i < ndata; i++) {
+		src = (const char *) buf + i * PGSIZE;
+		dst = (char *) BULKVA + (i + 1) * PGSIZE;
+		len = MIN(PGSIZE, n - i * PGSIZE);
+		if (len == PGSIZE && PGOFF(src) == 0
+		    && (r = sys_page_map(0, (void *) src, 0, dst, PTE_P|PTE_U)) == 0)
+			continue;
+		if ((r = sys_page_alloc(0, dst, PTE_P|PTE_U|PTE_W)) < 0) {
+			bulk_unmap(i + 1);
+			return r;
+		}
+		memmove(dst, src, len);
+	}
+
+	fsipcbuf.bulk.req_fileid = fd->fd_file.id;
+	fsipcbuf.bulk.req_n = n;
+	r = fsipc_bulk(FSREQ_WRITE_BULK, ndata, &nreply);
+	bulk_unmap(1 + ndata);
+	return r;
+}
+
 // Write at most 'n' bytes from 'buf' to 'fd' at the current seek position.
 //
 // Returns:
@@ -144,6 +237,9 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	int r;
 	size_t n_to_write = n; 
 	
+	if (n > sizeof(fsipcbuf.write.req_buf))
+		return devfile_write_bulk(fd, buf, n);
+	
 	if (n_to_write > PGSIZE - (sizeof(int) + sizeof(size_t))) {
 		n_to_write = PGSIZE - (sizeof(int) + sizeof(size_t)); 
 	}
@@ -196,3 +292,172 @@ sync(void)
 	return fsipc(FSREQ_SYNC, NULL);
 }
 
+// Get the file server's block cache counters
+int
+fs_stats(struct BcStats *st)
+{
+	int r;
+
+	if ((r = fsipc(FSREQ_STATS, NULL)) < 0)
+		return r;
+	*st = fsipcbuf.statsRet;
+	return 0;
+}
+
+
+// Map up to FSBULK_MAXPAGES read-only pages of the program open as
+// 'fdnum', from the page-aligned 'offset' and covering at most 'len'
+// bytes, at 'dstva'.  The pages come from the file server's text cache
+// and are shared by everyone who maps the same program (see spawn).
+// Returns the number of pages mapped, or < 0 on error.
+int
+map_text(int fdnum, off_t offset, size_t len, void *dstva)
+{
+	struct Fd *fd;
+	size_t npages = FSBULK_MAXPAGES;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	fsipcbuf.mapText.req_fileid = fd->fd_file.id;
+	fsipcbuf.mapText.req_offset = offset;
+	fsipcbuf.mapText.req_n = len;
+	ipc_send(fsenv, FSREQ_MAP_TEXT, &fsipcbuf, PTE_P | PTE_W | PTE_U);
+	if ((r = ipc_recv_pages(NULL, dstva, &npages, NULL)) < 0)
+		return r;
+	return npages;
+}
+
+// Memory-mapped files.
+//
+// Each mapping gets a slot of MMAPSLOT bytes of address space from
+// MMAPBASE.  Pages are filled in by mmap_pgfault when they are first
+// touched, with FSREQ_MAP requests that return the file server's cached
+// copy of the block.  MAP_PRIVATE pages are then marked copy-on-write.
+// A mapping holds a duplicate of the file's Fd page (at MMAPFDVA), so
+// the file stays open until munmap even if the descriptor is closed.
+#define MMAPBASE	0x80000000
+#define MMAPSLOT	0x04000000
+#define NMMAP		16
+#define MMAPFDVA	(BULKVA - NMMAP * PGSIZE)
+
+struct Mmap {
+	size_t m_len;		// Length in bytes, 0 if the slot is free
+	off_t m_offset;		// File offset of the first page
+	int m_flags;		// MAP_SHARED or MAP_PRIVATE
+};
+
+static struct Mmap mmaps[NMMAP];
+
+// Request page for mmap_pgfault, which can run in the middle of a
+// request that is being built in fsipcbuf.
+static union Fsipc mmapipc __attribute__((aligned(PGSIZE)));
+
+static void
+mmap_pgfault(struct UTrapframe *utf)
+{
+	uintptr_t va = ROUNDDOWN(utf->utf_fault_va, PGSIZE);
+	int i = (va - MMAPBASE) / MMAPSLOT, r;
+	struct Mmap *m = &mmaps[i];
+	uintptr_t base = MMAPBASE + i * MMAPSLOT;
+	struct Fd *fd = (struct Fd *) (MMAPFDVA + i * PGSIZE);
+
+	if (m->m_len == 0 || va - base >= m->m_len)
+		panic("mmap: fault at %08x outside any mapping (ip %08x)", utf->utf_fault_va, utf->utf_eip);
+
+	// Write to a page that is already there: copy a private page.
+	if (uvpt[PGNUM(va)] & PTE_P) {
+		if (!(utf->utf_err & FEC_WR) || !(uvpt[PGNUM(va)] & PTE_COW))
+			panic("mmap: write to read-only mapping at %08x (ip %08x)", utf->utf_fault_va, utf->utf_eip);
+		if ((r = sys_page_alloc(0, PFTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("mmap: sys_page_alloc: %e", r);
+		memmove(PFTEMP, (void *) va, PGSIZE);
+		if ((r = sys_page_map(0, PFTEMP, 0, (void *) va, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("mmap: sys_page_map: %e", r);
+		sys_page_unmap(0, PFTEMP);
+		return;
+	}
+
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+	mmapipc.map.req_fileid = fd->fd_file.id;
+	mmapipc.map.req_offset = m->m_offset + (va - base);
+	ipc_send(fsenv, FSREQ_MAP, &mmapipc, PTE_P | PTE_W | PTE_U);
+	if ((r = ipc_recv(NULL, (void *) va, NULL)) < 0)
+		panic("mmap: page at %08x (file offset %08x): %e", va, mmapipc.map.req_offset, r);
+	if (m->m_flags == MAP_PRIVATE
+	    && (r = sys_page_map(0, (void *) va, 0, (void *) va, PTE_P|PTE_U|PTE_COW)) < 0)
+		panic("mmap: sys_page_map: %e", r);
+}
+
+// Map 'len' bytes of the file open as 'fdnum', from the page-aligned
+// 'offset', and set *addr_store to where the mapping starts.  flags is
+// MAP_SHARED (read-only) or MAP_PRIVATE (copy-on-write).  Pages past
+// the end of the file can't be touched.
+// Returns 0 on success, < 0 on error.
+int
+mmap(int fdnum, off_t offset, size_t len, int flags, void **addr_store)
+{
+	struct Fd *fd;
+	int i, r;
+	static bool mmap_ready;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id || (fd->fd_omode & O_ACCMODE) == O_WRONLY)
+		return -E_INVAL;
+	if (offset < 0 || PGOFF(offset) != 0 || len == 0 || len > MMAPSLOT
+	    || (flags != MAP_SHARED && flags != MAP_PRIVATE))
+		return -E_INVAL;
+
+	for (i = 0; i < NMMAP; i++)
+		if (mmaps[i].m_len == 0)
+			break;
+	if (i == NMMAP)
+		return -E_NO_MEM;
+
+	if (!mmap_ready) {
+		if ((r = add_pgfault_range((void *) MMAPBASE, (void *) (MMAPBASE + NMMAP * MMAPSLOT), mmap_pgfault)) < 0)
+			return r;
+		mmap_ready = 1;
+	}
+	if ((r = sys_page_map(0, fd, 0, (void *) (MMAPFDVA + i * PGSIZE), uvpt[PGNUM(fd)] & PTE_SYSCALL)) < 0)
+		return r;
+
+	mmaps[i].m_len = len;
+	mmaps[i].m_offset = offset;
+	mmaps[i].m_flags = flags;
+	*addr_store = (void *) (MMAPBASE + i * MMAPSLOT);
+	return 0;
+}
+
+// Remove the mapping that starts at 'addr'.
+int
+munmap(void *addr)
+{
+	uintptr_t va = (uintptr_t) addr, end;
+	int i;
+
+	if (va < MMAPBASE || va >= MMAPBASE + NMMAP * MMAPSLOT || (va - MMAPBASE) % MMAPSLOT != 0)
+		return -E_INVAL;
+	i = (va - MMAPBASE) / MMAPSLOT;
+	if (mmaps[i].m_len == 0)
+		return -E_INVAL;
+
+	for (end = va + ROUNDUP(mmaps[i].m_len, PGSIZE); va < end; va += PGSIZE) {
+		if (!(uvpd[PDX(va)] & PTE_P)) {
+			va = ROUNDDOWN(va, PTSIZE) + PTSIZE - PGSIZE;
+			continue;
+		}
+		if (uvpt[PGNUM(va)] & PTE_P)
+			sys_page_unmap(0, (void *) va);
+	}
+	sys_page_unmap(0, (void *) (MMAPFDVA + i * PGSIZE));
+	mmaps[i].m_len = 0;
+	return 0;
+}
@@ -3,10 +3,6 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
@@ -218,10 +214,92 @@ fork(void)
 	
 }
 
-// Challenge!
+//
+// Map our virtual page pn into the target envid at the same virtual address,
+// so that both environments see each other's writes. 
+// A copy-on-write page is first replaced by a private copy (as in pgfault), 
+// since a write to a COW page would otherwise split it again. 
+//
+static int
+sharepage(envid_t envid, unsigned pn)
+{
+	void * addr = (void *) (pn * PGSIZE); 
+	int r;
+	
+	if ((uvpt[pn] & PTE_AVAIL) == PTE_COW) {
+		if ((r = sys_page_alloc(0, PFTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sharepage: sys_page_alloc: %e", r);
+		memmove(PFTEMP, addr, PGSIZE);
+		if ((r = sys_page_map(0, PFTEMP, 0, addr, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sharepage: sys_page_map: %e", r);
+		if ((r = sys_page_unmap(0, PFTEMP)) < 0)
+			panic("sharepage: sys_page_unmap: %e", r);
+	}
+	
+	// Same permissions as ours (writable pages stay writable in both). 
+	if ((r = sys_page_map(0, addr, envid, addr, uvpt[pn] & PTE_SYSCALL)) < 0)
+		panic("sharepage: sys_page_map: %e", r);
+	return 0;
+}
+
+//
+// Shared-memory fork.
+// The parent and child share all of their memory pages, except for the 
+// stack area (the page table below USTACKTOP), which is copy-on-write as in fork(). 
+// Each gets its own exception stack and its own per-environment page at UTLS, which 
+// is where thisenv lives. 
+//
+// The environments still have separate page tables: only the pages mapped at the time 
+// of the sfork are shared, and pages mapped later are private to the environment 
+// that maps them. malloc_share() therefore maps the heap up front, so that blocks
+// malloc'd by either environment can be used by both. 
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
 int
 sfork(void)
 {
-	panic("sfork not implemented");
-	return -E_INVAL;
+	envid_t envid;
+	unsigned pn; 
+	uintptr_t va; 
+	int r;
+	
+	set_pgfault_handler(pgfault);
+	if ((r = malloc_share()) < 0)
+		return r; 
+	
+	envid = sys_exofork();
+	if (envid < 0)
+		return envid; 
+	if (envid == 0) {
+		// We're the child. Our UTLS page is a fresh one, so set thisenv. 
+		thisenv = &envs[ENVX(sys_getenvid())];
+		return 0;
+	}
+	
+	for (pn = 0; pn < PGNUM(USTACKTOP); pn++) {
+		va = pn * PGSIZE; 
+		if (!(uvpd[PDX(va)] & PTE_P) || !(uvpt[pn] & PTE_P))
+			continue; 
+		if (va == UTLS)
+			continue; 
+		if (va >= UTLS)
+			duppage(envid, pn); 
+		else
+			sharepage(envid, pn); 
+	}
+	
+	// Fresh exception stack and per-environment page for the child. 
+	if ((r = sys_page_alloc(envid, (void *) (UXSTACKTOP-PGSIZE), PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sfork: sys_page_alloc: %e", r);
+	if ((r = sys_page_alloc(envid, (void *) UTLS, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sfork: sys_page_alloc: %e", r);
+	
+	extern void _pgfault_upcall();
+	sys_env_set_pgfault_upcall(envid, _pgfault_upcall);
+	
+	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
+		panic("sfork: sys_env_set_status: %e", r);
+
+	return envid;
 }
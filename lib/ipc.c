@@ -55,10 +55,31 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 	return thisenv->env_ipc_value;
 }
 
+// How many times 'to_env' has started to receive (see ipc_send).
+static uint32_t
+ipc_nrecv(envid_t to_env)
+{
+	return envs[ENVX(to_env)].env_ipc_nrecv;
+}
+
+// Sleep until 'to_env' starts to receive again, after ipc_nrecv
+// returned 'nrecv'.  Wakeups can be spurious: the caller tries again.
+static void
+ipc_wait_recv(envid_t to_env, uint32_t nrecv)
+{
+	if (sys_futex_wait((volatile uint32_t *) &envs[ENVX(to_env)].env_ipc_nrecv, nrecv, 0) < 0)
+		sys_yield();
+}
+
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
 // This function keeps trying until it succeeds.
 // It should panic() on any error other than -E_IPC_NOT_RECV.
 //
+// While the target isn't receiving, ipc_send sleeps on the target's
+// env_ipc_nrecv, which the kernel bumps (and wakes) each time the target
+// starts to receive, and when it dies.  Reading the counter before
+// trying means a receive that starts in between isn't missed.
+//
 // Hint:
 //   Use sys_yield() to be CPU-friendly.
 //   If 'pg' is null, pass sys_ipc_try_send a value that it will understand
@@ -68,6 +89,7 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 {
 	// LAB 4: Your code here.
 	int r; 
+	uint32_t nrecv; 
 	
 	// Page related variables to send. 
 	int perm_send = perm; 
@@ -81,6 +103,7 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	
 	
 	for(;;) {
+		nrecv = ipc_nrecv(to_env); 
 		r = sys_ipc_try_send(to_env, val, srcva_send, perm_send); 
 		
 		if (r == 0) {
@@ -89,13 +112,60 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 			panic("ipc_send received error: %e", r); 
 		}
 		
-		//Yield after each send attempt. 
-		sys_yield();
+		//Sleep until the target receives again. 
+		ipc_wait_recv(to_env, nrecv);
 	}
 	
 	return;
 }
 
+// Like ipc_send, but sends the 'npages' consecutive pages at 'pg'.
+void
+ipc_send_pages(envid_t to_env, uint32_t val, void *pg, size_t npages, int perm)
+{
+	uint32_t nrecv;
+	int r;
+
+	if (!pg) {
+		pg = (void *) 0xFFFFFFFF;
+		perm = 0;
+	}
+
+	for (;;) {
+		nrecv = ipc_nrecv(to_env);
+		if ((r = sys_ipc_try_send_pages(to_env, val, pg, npages, perm)) == 0)
+			break;
+		if (r != -E_IPC_NOT_RECV)
+			panic("ipc_send_pages received error: %e", r);
+		ipc_wait_recv(to_env, nrecv);
+	}
+}
+
+// Like ipc_recv, but accepts up to *npages pages, mapped at
+// consecutive addresses from 'pg', and sets *npages to the number
+// of pages received.
+int32_t
+ipc_recv_pages(envid_t *from_env_store, void *pg, size_t *npages, int *perm_store)
+{
+	int r;
+
+	if ((r = sys_ipc_recv_pages(pg ? pg : (void *) 0xFFFFFFFF, *npages)) < 0) {
+		if (from_env_store)
+			*from_env_store = 0;
+		if (perm_store)
+			*perm_store = 0;
+		*npages = 0;
+		return r;
+	}
+
+	if (from_env_store)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+	*npages = thisenv->env_ipc_npages;
+	return thisenv->env_ipc_value;
+}
+
 // Find the first environment of the given type.  We'll use this to
 // find special environments.
 // Returns 0 if no such environment exists.
@@ -5,8 +5,6 @@
 
 extern void umain(int argc, char **argv);
 
-// Creates a global variable that stores the environment information within the user space. 
-const volatile struct Env *thisenv;
 const char *binaryname = "<unknown>";
 
 void
@@ -24,6 +22,10 @@ libmain(int argc, char **argv)
 		panic("libmain (should be warning): Possibly referring to a non-initialized environment or 'curenv'. All enviornments are initialized to 0. \n");
 	}
 	
+	// thisenv lives in our per-environment page (see struct Tls). 
+	if (sys_page_alloc(0, (void *) UTLS, PTE_P|PTE_U|PTE_W) < 0) {
+		panic("libmain: Can't allocate the per-environment page at UTLS. \n");
+	}
 	thisenv = &envs[ENVX(envid)];
 	if (thisenv->env_status == ENV_FREE || thisenv->env_id != envid) {
 		panic("libmain: Environment is either not-active, or we pulled an outdated environment from the envs array (look at the unique identifier of the envid => see envc). \n");
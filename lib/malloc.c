@@ -1,140 +1,565 @@
-
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 /*
- * Simple malloc/free.
+ * Size-class malloc/free.
+ *
+ * The heap lives in the address space from mbegin to mend.  A bitmap
+ * (mused) says which of its pages are in use; runs of pages are handed
+ * out next-fit, starting where the last search ended.
+ *
+ * Requests of up to SMALLMAX bytes are rounded up to one of NCLASS
+ * size classes and carved out of slabs: single pages holding a struct
+ * Slab header followed by equal-sized chunks.  Each slab keeps its free
+ * chunks on a list, and each class keeps the slabs that have free
+ * chunks on a list (mclass), so malloc and free of small objects take
+ * constant time.  A slab whose chunks are all free goes back to the
+ * address space, unless it is the only one its class has left.
  *
- * Uses the address space to do most of the hard work.
- * The address space from mbegin to mend is scanned
- * in order.  Pages are allocated, used to fill successive
- * malloc requests, and then left alone.  Free decrements
- * a ref count maintained in the page; the page is freed
- * when the ref count hits zero.
+ * Larger requests get a run of pages of their own, with the header at
+ * the start of the first page.  Either way the header of a block is at
+ * the start of the page the block starts in, which is how free finds
+ * it.  The pages of a large block come straight from sys_page_alloc, so
+ * they are already zero (calloc doesn't clear them again), and realloc
+ * moves them by remapping instead of copying.
  *
- * If we need to allocate a large amount (more than a page)
- * we can't put a ref count at the end of each page,
- * so we mark the pte entry with the bit PTE_CONTINUED.
+ * Environments made with sfork share the heap.  Everything above is
+ * protected by a lock (mlock), but small blocks usually don't take it:
+ * each environment keeps a cache of free chunks of every class (struct
+ * MCache, found through its per-environment page), which it refills
+ * from the slabs and flushes back to them a batch of chunks at a time.
+ * Since sfork'd environments only share the pages that were mapped
+ * when they were made, malloc_share maps the first MSHARED bytes of the
+ * heap before an sfork, and from then on blocks are only carved out of
+ * those pages, which are never unmapped again.
  */
-enum
-{
-	MAXMALLOC = 1024*1024	/* max size of one allocated chunk */
+
+#define NPAGES		((mend - mbegin) / PGSIZE)
+#define SMALLMAX	2032	/* largest small chunk */
+#define NCLASS		(sizeof(class_size) / sizeof(class_size[0]))
+#define LARGE		0xffff	/* s_class of a large block */
+#define MSHARED		(4*1024*1024)	/* heap mapped by malloc_share */
+#define BATCH(c)	MAX((PGSIZE / 2) / class_size[c], 1)	/* chunks moved at a time */
+
+struct Chunk {
+	struct Chunk *c_next;
 };
 
-#define PTE_CONTINUED 0x200
+struct Slab {
+	uint16_t s_class;	/* size class, or LARGE */
+	uint16_t s_nfree;	/* free chunks */
+	uint32_t s_npages;	/* pages in a large block */
+	struct Chunk *s_free;	/* free chunks of a slab */
+	struct Slab *s_next;	/* slabs of the class with free chunks */
+	struct Slab *s_prev;
+	uint32_t s_pad[3];	/* keep chunks 16-byte aligned */
+};
+
+/* Chunk sizes: multiples of 16, chosen to waste little of a slab */
+static const uint16_t class_size[] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 336, 448, 672, 1008, 1344, SMALLMAX
+};
+
+/* An environment's free chunks */
+struct MCache {
+	struct Chunk *mc_free[NCLASS];
+	uint16_t mc_count[NCLASS];
+};
 
 static uint8_t *mbegin = (uint8_t*) 0x08000000;
 static uint8_t *mend   = (uint8_t*) 0x10000000;
-static uint8_t *mptr;
 
-static int
-isfree(void *v, size_t n)
+static uint32_t mused[(0x10000000 - 0x08000000) / PGSIZE / 32];
+static uint32_t mnext;				/* page to search from */
+static struct Slab *mclass[NCLASS];		/* slabs with free chunks */
+static uint8_t class_of[SMALLMAX / 16 + 1];	/* size class of (n+15)/16 */
+static volatile uint32_t mlock;
+static bool mshared;				/* heap shared with sfork'd environments */
+
+static void
+heap_lock(void)
 {
-	uintptr_t va, end_va = (uintptr_t) v + n;
+	while (xchg(&mlock, 1) != 0)
+		sys_yield();
+}
 
-	for (va = (uintptr_t) v; va < end_va; va += PGSIZE)
-		if (va >= (uintptr_t) mend
-		    || ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P)))
-			return 0;
-	return 1;
+static void
+heap_unlock(void)
+{
+	xchg(&mlock, 0);
 }
 
-void*
-malloc(size_t n)
+/* Pages of the heap that blocks may be carved out of */
+static uint32_t
+heap_npages(void)
 {
-	int i, cont;
-	int nwrap;
-	uint32_t *ref;
-	void *v;
+	return mshared ? MSHARED / PGSIZE : NPAGES;
+}
 
-	if (mptr == 0)
-		mptr = mbegin;
+static bool
+page_used(uint32_t pn)
+{
+	return mused[pn / 32] & (1 << (pn % 32));
+}
 
-	n = ROUNDUP(n, 4);
+static void
+mark_pages(uint32_t pn, size_t npages, bool used)
+{
+	for (; npages > 0; pn++, npages--)
+		if (used)
+			mused[pn / 32] |= 1 << (pn % 32);
+		else
+			mused[pn / 32] &= ~(1 << (pn % 32));
+}
 
-	if (n >= MAXMALLOC)
-		return 0;
+/*
+ * Reserve npages consecutive pages of address space.
+ * Returns their address, or 0 if there is no such run.
+ */
+static uint8_t *
+va_alloc(size_t npages)
+{
+	uint32_t pn, start, n, tries, limit = heap_npages();
 
-	if ((uintptr_t) mptr % PGSIZE){
-		/*
-		 * we're in the middle of a partially
-		 * allocated page - can we add this chunk?
-		 * the +4 below is for the ref count.
-		 */
-		ref = (uint32_t*) (ROUNDUP(mptr, PGSIZE) - 4);
-		if ((uintptr_t) mptr / PGSIZE == (uintptr_t) (mptr + n - 1 + 4) / PGSIZE) {
-			(*ref)++;
-			v = mptr;
-			mptr += n;
-			return v;
+	start = mnext;
+	n = 0;
+	for (tries = 0; tries < limit + npages; tries++) {
+		pn = (start + tries) % limit;
+		if (pn == 0)
+			n = 0;	/* runs don't wrap around */
+		if (n == 0 && pn % 32 == 0 && mused[pn / 32] == ~0U) {
+			tries += 31;
+			continue;
+		}
+		if (page_used(pn)) {
+			n = 0;
+			continue;
+		}
+		if (++n == npages) {
+			pn -= npages - 1;
+			mark_pages(pn, npages, 1);
+			mnext = (pn + npages) % limit;
+			return mbegin + pn * PGSIZE;
 		}
-		/*
-		 * stop working on this page and move on.
-		 */
-		free(mptr);	/* drop reference to this page */
-		mptr = ROUNDDOWN(mptr + PGSIZE, PGSIZE);
 	}
+	return 0;
+}
 
-	/*
-	 * now we need to find some address space for this chunk.
-	 * if it's less than a page we leave it open for allocation.
-	 * runs of more than a page can't have ref counts so we
-	 * flag the PTE entries instead.
-	 */
-	nwrap = 0;
-	while (1) {
-		if (isfree(mptr, n + 4))
-			break;
-		mptr += PGSIZE;
-		if (mptr == mend) {
-			mptr = mbegin;
-			if (++nwrap == 2)
-				return 0;	/* out of address space */
+static void
+va_free(uint8_t *va, size_t npages)
+{
+	mark_pages((va - mbegin) / PGSIZE, npages, 0);
+}
+
+/*
+ * Map fresh pages at [va, va + npages*PGSIZE), unless the heap is
+ * shared and they are mapped already.
+ * On failure unmaps whatever it mapped and returns < 0.
+ */
+static int
+pages_alloc(uint8_t *va, size_t npages)
+{
+	size_t i;
+	int r;
+
+	if (mshared)
+		return 0;
+
+	for (i = 0; i < npages; i++)
+		if ((r = sys_page_alloc(0, va + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0) {
+			while (i-- > 0)
+				sys_page_unmap(0, va + i * PGSIZE);
+			return r;
 		}
+	return 0;
+}
+
+static void
+pages_free(uint8_t *va, size_t npages)
+{
+	size_t i;
+
+	if (mshared)
+		return;
+	for (i = 0; i < npages; i++)
+		sys_page_unmap(0, va + i * PGSIZE);
+}
+
+/* Number of pages of a large block of n bytes, header included. */
+static size_t
+large_pages(size_t n)
+{
+	return ROUNDUP(n + sizeof(struct Slab), PGSIZE) / PGSIZE;
+}
+
+static int
+size_class(size_t n)
+{
+	static bool init;
+	int c, i;
+
+	if (!init) {
+		for (c = 0, i = 0; c < NCLASS; c++)
+			for (; i <= class_size[c] / 16; i++)
+				class_of[i] = c;
+		init = 1;
+	}
+	return class_of[(n + 15) / 16];
+}
+
+static void
+slab_link(struct Slab *s)
+{
+	s->s_prev = 0;
+	s->s_next = mclass[s->s_class];
+	if (s->s_next)
+		s->s_next->s_prev = s;
+	mclass[s->s_class] = s;
+}
+
+static void
+slab_unlink(struct Slab *s)
+{
+	if (s->s_prev)
+		s->s_prev->s_next = s->s_next;
+	else
+		mclass[s->s_class] = s->s_next;
+	if (s->s_next)
+		s->s_next->s_prev = s->s_prev;
+}
+
+/* Make a new slab for class c and put it on the class's list. */
+static struct Slab *
+slab_alloc(int c)
+{
+	struct Slab *s;
+	struct Chunk *ch;
+	uint8_t *p;
+
+	if ((s = (struct Slab *) va_alloc(1)) == 0)
+		return 0;
+	if (pages_alloc((uint8_t *) s, 1) < 0) {
+		va_free((uint8_t *) s, 1);
+		return 0;
+	}
+
+	s->s_class = c;
+	s->s_nfree = 0;
+	s->s_npages = 1;
+	s->s_free = 0;
+	for (p = (uint8_t *) (s + 1); p + class_size[c] <= (uint8_t *) s + PGSIZE; p += class_size[c]) {
+		ch = (struct Chunk *) p;
+		ch->c_next = s->s_free;
+		s->s_free = ch;
+		s->s_nfree++;
+	}
+	slab_link(s);
+	return s;
+}
+
+static void *
+large_alloc(size_t n)
+{
+	struct Slab *s;
+	size_t npages = large_pages(n);
+
+	if ((s = (struct Slab *) va_alloc(npages)) == 0)
+		return 0;
+	if (pages_alloc((uint8_t *) s, npages) < 0) {
+		va_free((uint8_t *) s, npages);
+		return 0;
+	}
+	s->s_class = LARGE;
+	s->s_npages = npages;
+	return s + 1;
+}
+
+static struct Slab *
+block_slab(void *v)
+{
+	struct Slab *s = ROUNDDOWN(v, PGSIZE);
+
+	assert(mbegin <= (uint8_t*) v && (uint8_t*) v < mend);
+	assert(s->s_class == LARGE ? v == s + 1 : s->s_class < NCLASS);
+	return s;
+}
+
+static void
+large_free(struct Slab *s)
+{
+	size_t npages = s->s_npages;	/* the header goes with the pages */
+
+	pages_free((uint8_t *) s, npages);
+	va_free((uint8_t *) s, npages);
+}
+
+/* Take a chunk of class c from the slabs. */
+static struct Chunk *
+chunk_alloc(int c)
+{
+	struct Slab *s;
+	struct Chunk *ch;
+
+	if ((s = mclass[c]) == 0 && (s = slab_alloc(c)) == 0)
+		return 0;
+	ch = s->s_free;
+	s->s_free = ch->c_next;
+	if (--s->s_nfree == 0)
+		slab_unlink(s);
+	return ch;
+}
+
+/* Put a chunk back in its slab. */
+static void
+chunk_free(struct Chunk *ch)
+{
+	struct Slab *s = (struct Slab *) ROUNDDOWN(ch, PGSIZE);
+
+	ch->c_next = s->s_free;
+	s->s_free = ch;
+	if (s->s_nfree++ == 0)
+		slab_link(s);
+
+	/* Give back an empty slab, unless it's the class's last one. */
+	if (s->s_nfree == (PGSIZE - sizeof(struct Slab)) / class_size[s->s_class]
+	    && (s->s_prev || s->s_next)) {
+		slab_unlink(s);
+		pages_free((uint8_t *) s, 1);
+		va_free((uint8_t *) s, 1);
 	}
+}
+
+/* Our environment's cache, made on first use. */
+static struct MCache *
+mcache(void)
+{
+	struct MCache *mc;
 
-	/*
-	 * allocate at mptr - the +4 makes sure we allocate a ref count.
-	 */
-	for (i = 0; i < n + 4; i += PGSIZE){
-		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED : 0;
-		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont) < 0){
-			for (; i >= 0; i -= PGSIZE)
-				sys_page_unmap(0, mptr + i);
-			return 0;	/* out of physical memory */
+	if ((mc = tls->tls_mcache) == 0) {
+		heap_lock();
+		mc = (struct MCache *) chunk_alloc(size_class(sizeof(struct MCache)));
+		heap_unlock();
+		if (mc) {
+			memset(mc, 0, sizeof(struct MCache));
+			tls->tls_mcache = mc;
 		}
 	}
+	return mc;
+}
 
-	ref = (uint32_t*) (mptr + i - 4);
-	*ref = 2;	/* reference for mptr, reference for returned block */
-	v = mptr;
-	mptr += n;
-	return v;
+/* Move a batch of chunks of class c from the slabs to the cache. */
+static void
+cache_fill(struct MCache *mc, int c)
+{
+	struct Chunk *ch;
+	int i;
+
+	heap_lock();
+	for (i = 0; i < BATCH(c) && (ch = chunk_alloc(c)) != 0; i++) {
+		ch->c_next = mc->mc_free[c];
+		mc->mc_free[c] = ch;
+		mc->mc_count[c]++;
+	}
+	heap_unlock();
+}
+
+/* Move a batch of chunks of class c from the cache back to the slabs. */
+static void
+cache_flush(struct MCache *mc, int c)
+{
+	struct Chunk *ch;
+	int i;
+
+	heap_lock();
+	for (i = 0; i < BATCH(c) && (ch = mc->mc_free[c]) != 0; i++) {
+		mc->mc_free[c] = ch->c_next;
+		mc->mc_count[c]--;
+		chunk_free(ch);
+	}
+	heap_unlock();
+}
+
+void*
+malloc(size_t n)
+{
+	struct MCache *mc;
+	struct Chunk *ch;
+	void *v;
+	int c;
+
+	if (n > SMALLMAX) {
+		if (n >= (size_t) (mend - mbegin))
+			return 0;
+		heap_lock();
+		v = large_alloc(n);
+		heap_unlock();
+		return v;
+	}
+
+	c = size_class(n);
+	if ((mc = mcache()) == 0)
+		return 0;
+	if (mc->mc_free[c] == 0)
+		cache_fill(mc, c);
+	if ((ch = mc->mc_free[c]) == 0)
+		return 0;
+	mc->mc_free[c] = ch->c_next;
+	mc->mc_count[c]--;
+	return ch;
 }
 
 void
 free(void *v)
 {
-	uint8_t *c;
-	uint32_t *ref;
+	struct MCache *mc;
+	struct Slab *s;
+	struct Chunk *ch = v;
+	int c;
 
 	if (v == 0)
 		return;
-	assert(mbegin <= (uint8_t*) v && (uint8_t*) v < mend);
+	s = block_slab(v);
+
+	if (s->s_class == LARGE || (mc = mcache()) == 0) {
+		heap_lock();
+		if (s->s_class == LARGE)
+			large_free(s);
+		else
+			chunk_free(ch);
+		heap_unlock();
+		return;
+	}
+
+	c = s->s_class;
+	ch->c_next = mc->mc_free[c];
+	mc->mc_free[c] = ch;
+	if (++mc->mc_count[c] > 2 * BATCH(c))
+		cache_flush(mc, c);
+}
+
+void*
+calloc(size_t nmemb, size_t size)
+{
+	void *v;
+	size_t n = nmemb * size;
+
+	if (size != 0 && n / size != nmemb)
+		return 0;
+	/* fresh pages of a large block are zero, unless the heap is shared */
+	if ((v = malloc(n)) != 0 && (n <= SMALLMAX || mshared))
+		memset(v, 0, n);
+	return v;
+}
+
+/*
+ * Make the heap shareable with sfork'd environments (see above).
+ * Called by sfork.  Returns < 0 if there is no memory for the pages.
+ */
+int
+malloc_share(void)
+{
+	uint8_t *va;
+	int r = 0;
+
+	heap_lock();
+	for (va = mbegin; !mshared && va < mbegin + MSHARED; va += PGSIZE)
+		if (!((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P))
+		    && (r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W)) < 0)
+			break;
+	if (r == 0)
+		mshared = 1;
+	heap_unlock();
+	return r;
+}
+
+/*
+ * Grow or shrink the large block s to npages pages: in place if the
+ * pages after it are free, otherwise by moving its pages to a new run
+ * of address space (which other environments wouldn't see if the heap
+ * is shared).  Returns the (possibly moved) header, or 0.
+ */
+static struct Slab *
+large_resize(struct Slab *s, size_t npages)
+{
+	uint8_t *va = (uint8_t *) s, *nva;
+	uint32_t pn = (va - mbegin) / PGSIZE;
+	size_t i;
+	int r;
 
-	c = ROUNDDOWN(v, PGSIZE);
+	if (npages <= s->s_npages) {
+		pages_free(va + npages * PGSIZE, s->s_npages - npages);
+		va_free(va + npages * PGSIZE, s->s_npages - npages);
+		s->s_npages = npages;
+		return s;
+	}
 
-	while (uvpt[PGNUM(c)] & PTE_CONTINUED) {
-		sys_page_unmap(0, c);
-		c += PGSIZE;
-		assert(mbegin <= c && c < mend);
+	for (i = s->s_npages; i < npages; i++)
+		if (pn + i >= heap_npages() || page_used(pn + i))
+			break;
+	if (i == npages) {
+		if (pages_alloc(va + s->s_npages * PGSIZE, npages - s->s_npages) < 0)
+			return 0;
+		mark_pages(pn + s->s_npages, npages - s->s_npages, 1);
+		s->s_npages = npages;
+		return s;
 	}
 
-	/*
-	 * c is just a piece of this page, so dec the ref count
-	 * and maybe free the page.
-	 */
-	ref = (uint32_t*) (c + PGSIZE - 4);
-	if (--(*ref) == 0)
-		sys_page_unmap(0, c);
+	if (mshared || (nva = va_alloc(npages)) == 0)
+		return 0;
+	if (pages_alloc(nva + s->s_npages * PGSIZE, npages - s->s_npages) < 0)
+		goto fail;
+	for (i = 0; i < s->s_npages; i++)
+		if ((r = sys_page_map(0, va + i * PGSIZE, 0, nva + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0) {
+			pages_free(nva, npages);
+			goto fail;
+		}
+	i = s->s_npages;
+	pages_free(va, i);
+	va_free(va, i);
+	s = (struct Slab *) nva;
+	s->s_npages = npages;
+	return s;
+
+    fail:
+	va_free(nva, npages);
+	return 0;
 }
 
+void*
+realloc(void *v, size_t n)
+{
+	struct Slab *s, *ns;
+	void *nv;
+	size_t old;
+
+	if (v == 0)
+		return malloc(n);
+	if (n == 0) {
+		free(v);
+		return 0;
+	}
+	s = block_slab(v);
+
+	if (s->s_class == LARGE) {
+		if (n >= (size_t) (mend - mbegin))
+			return 0;
+		if (n > SMALLMAX) {
+			heap_lock();
+			ns = large_resize(s, large_pages(n));
+			heap_unlock();
+			if (ns)
+				return ns + 1;
+		}
+		old = s->s_npages * PGSIZE - sizeof(struct Slab);
+	} else {
+		if (n <= SMALLMAX && size_class(n) == s->s_class)
+			return v;
+		old = class_size[s->s_class];
+	}
+
+	if ((nv = malloc(n)) == 0)
+		return 0;
+	memmove(nv, v, MIN(old, n));
+	free(v);
+	return nv;
+}
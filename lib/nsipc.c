@@ -8,35 +8,68 @@
 #define REQVA		0x0ffff000
 union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 
-// Send an IP request to the network server, and wait for a reply.
+// Environments of the network server shards (see inc/ns.h), found on
+// the first request.
+static envid_t ns_shards[NS_MAXSHARDS];
+static int ns_nshards;
+
+static void
+nsipc_init(void)
+{
+	envid_t nsenv;
+	int n;
+
+	if (ns_nshards > 0)
+		return;
+	nsenv = ipc_find_env(ENV_TYPE_NS);
+	ipc_send(nsenv, NSREQ_SHARDS, &nsipcbuf, PTE_P|PTE_W|PTE_U);
+	n = ipc_recv(NULL, NULL, NULL);
+	if (n > 0 && n <= NS_MAXSHARDS)
+		memmove(ns_shards, nsipcbuf.shardsRet.ret_shards, n * sizeof(envid_t));
+	else {
+		ns_shards[0] = nsenv;
+		n = 1;
+	}
+	ns_nshards = n;
+}
+
+// Number of network server shards.
+int
+nsipc_nshards(void)
+{
+	nsipc_init();
+	return ns_nshards;
+}
+
+// Send an IP request to network server shard 'shard', and wait for a reply.
 // The request body should be in nsipcbuf, and parts of the response
 // may be written back to nsipcbuf.
 // type: request code, passed as the simple integer IPC value.
 // Returns 0 if successful, < 0 on failure.
 static int
-nsipc(unsigned type)
+nsipc(int shard, unsigned type)
 {
-	static envid_t nsenv;
-	if (nsenv == 0)
-		nsenv = ipc_find_env(ENV_TYPE_NS);
-
 	static_assert(sizeof(nsipcbuf) == PGSIZE);
 
+	nsipc_init();
+	if (shard < 0 || shard >= ns_nshards)
+		return -E_INVAL;
+
 	if (debug)
-		cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
+		cprintf("[%08x] nsipc %d to shard %d\n", thisenv->env_id, type, shard);
 
-	ipc_send(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
+	ipc_send(ns_shards[shard], type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
 	return ipc_recv(NULL, NULL, NULL);
 }
 
 int
-nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen)
+nsipc_accept(int shard, int s, struct sockaddr *addr, socklen_t *addrlen)
 {
 	int r;
 
 	nsipcbuf.accept.req_s = s;
 	nsipcbuf.accept.req_addrlen = *addrlen;
-	if ((r = nsipc(NSREQ_ACCEPT)) >= 0) {
+	if ((r = nsipc(shard, NSREQ_ACCEPT)) >= 0) {
 		struct Nsret_accept *ret = &nsipcbuf.acceptRet;
 		memmove(addr, &ret->ret_addr, ret->ret_addrlen);
 		*addrlen = ret->ret_addrlen;
@@ -45,48 +78,48 @@ nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 }
 
 int
-nsipc_bind(int s, struct sockaddr *name, socklen_t namelen)
+nsipc_bind(int shard, int s, struct sockaddr *name, socklen_t namelen)
 {
 	nsipcbuf.bind.req_s = s;
 	memmove(&nsipcbuf.bind.req_name, name, namelen);
 	nsipcbuf.bind.req_namelen = namelen;
-	return nsipc(NSREQ_BIND);
+	return nsipc(shard, NSREQ_BIND);
 }
 
 int
-nsipc_shutdown(int s, int how)
+nsipc_shutdown(int shard, int s, int how)
 {
 	nsipcbuf.shutdown.req_s = s;
 	nsipcbuf.shutdown.req_how = how;
-	return nsipc(NSREQ_SHUTDOWN);
+	return nsipc(shard, NSREQ_SHUTDOWN);
 }
 
 int
-nsipc_close(int s)
+nsipc_close(int shard, int s)
 {
 	nsipcbuf.close.req_s = s;
-	return nsipc(NSREQ_CLOSE);
+	return nsipc(shard, NSREQ_CLOSE);
 }
 
 int
-nsipc_connect(int s, const struct sockaddr *name, socklen_t namelen)
+nsipc_connect(int shard, int s, const struct sockaddr *name, socklen_t namelen)
 {
 	nsipcbuf.connect.req_s = s;
 	memmove(&nsipcbuf.connect.req_name, name, namelen);
 	nsipcbuf.connect.req_namelen = namelen;
-	return nsipc(NSREQ_CONNECT);
+	return nsipc(shard, NSREQ_CONNECT);
 }
 
 int
-nsipc_listen(int s, int backlog)
+nsipc_listen(int shard, int s, int backlog)
 {
 	nsipcbuf.listen.req_s = s;
 	nsipcbuf.listen.req_backlog = backlog;
-	return nsipc(NSREQ_LISTEN);
+	return nsipc(shard, NSREQ_LISTEN);
 }
 
 int
-nsipc_recv(int s, void *mem, int len, unsigned int flags)
+nsipc_recv(int shard, int s, void *mem, int len, unsigned int flags)
 {
 	int r;
 
@@ -94,7 +127,7 @@ nsipc_recv(int s, void *mem, int len, unsigned int flags)
 	nsipcbuf.recv.req_len = len;
 	nsipcbuf.recv.req_flags = flags;
 
-	if ((r = nsipc(NSREQ_RECV)) >= 0) {
+	if ((r = nsipc(shard, NSREQ_RECV)) >= 0) {
 		assert(r < 1600 && r <= len);
 		memmove(mem, nsipcbuf.recvRet.ret_buf, r);
 	}
@@ -103,21 +136,43 @@ nsipc_recv(int s, void *mem, int len, unsigned int flags)
 }
 
 int
-nsipc_send(int s, const void *buf, int size, unsigned int flags)
+nsipc_send(int shard, int s, const void *buf, int size, unsigned int flags)
 {
 	nsipcbuf.send.req_s = s;
 	assert(size < 1600);
 	memmove(&nsipcbuf.send.req_buf, buf, size);
 	nsipcbuf.send.req_size = size;
 	nsipcbuf.send.req_flags = flags;
-	return nsipc(NSREQ_SEND);
+	return nsipc(shard, NSREQ_SEND);
 }
 
 int
-nsipc_socket(int domain, int type, int protocol)
+nsipc_socket(int shard, int domain, int type, int protocol)
 {
 	nsipcbuf.socket.req_domain = domain;
 	nsipcbuf.socket.req_type = type;
 	nsipcbuf.socket.req_protocol = protocol;
-	return nsipc(NSREQ_SOCKET);
+	return nsipc(shard, NSREQ_SOCKET);
+}
+
+int
+nsipc_poll(int shard, struct pollfd *fds, int nfds, int timeout)
+{
+	int r, i;
+
+	if (nfds < 0 || nfds > NSPOLL_MAX)
+		return -E_INVAL;
+
+	nsipcbuf.poll.req_nfds = nfds;
+	nsipcbuf.poll.req_timeout = timeout;
+	for (i = 0; i < nfds; i++) {
+		nsipcbuf.poll.req_fds[i].fd = fds[i].fd;
+		nsipcbuf.poll.req_fds[i].events = fds[i].events & (POLLIN | POLLOUT);
+	}
+
+	if ((r = nsipc(shard, NSREQ_POLL)) >= 0)
+		for (i = 0; i < nfds; i++)
+			fds[i].revents = nsipcbuf.poll.req_fds[i].revents;
+
+	return r;
 }
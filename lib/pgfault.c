@@ -14,13 +14,85 @@ extern void _pgfault_upcall(void);
 // Pointer to currently installed C-language pgfault handler.
 void (*_pgfault_handler)(struct UTrapframe *utf);
 
-//
-// Set the page fault handler function.
-// If there isn't one yet, _pgfault_handler will be 0.
+// Handlers for faults in particular address ranges (see mmap in file.c).
+// While there are any, _pgfault_handler is pgfault_dispatch, which
+// passes other faults on to the handler set with set_pgfault_handler.
+#define NPGFAULTRANGE	4
+
+struct PgfaultRange {
+	uintptr_t pr_start;
+	uintptr_t pr_end;
+	void (*pr_handler)(struct UTrapframe *utf);
+};
+
+static struct PgfaultRange pgfault_ranges[NPGFAULTRANGE];
+static void (*pgfault_default)(struct UTrapframe *utf);
+
+static void
+pgfault_dispatch(struct UTrapframe *utf)
+{
+	int i;
+
+	for (i = 0; i < NPGFAULTRANGE; i++)
+		if (pgfault_ranges[i].pr_handler && utf->utf_fault_va >= pgfault_ranges[i].pr_start
+		    && utf->utf_fault_va < pgfault_ranges[i].pr_end) {
+			pgfault_ranges[i].pr_handler(utf);
+			return;
+		}
+	if (!pgfault_default)
+		panic("unhandled page fault at va %08x, ip %08x", utf->utf_fault_va, utf->utf_eip);
+	pgfault_default(utf);
+}
+
+// Called by _pgfault_upcall.  The fault may have hit memset or memmove
+// halfway through, with the SSE registers full of data (lib/string.c),
+// and the handler probably calls them itself (to copy a page on write,
+// say).  So save the registers they use around the handler.
+void
+_pgfault_call(struct UTrapframe *utf)
+{
+	uint8_t xmm[8 * 16];
+	int simd = memsimd(-1);
+
+	if (simd)
+		asm volatile("movdqu %%xmm0, 0(%0); movdqu %%xmm1, 16(%0)\n\t"
+			"movdqu %%xmm2, 32(%0); movdqu %%xmm3, 48(%0)\n\t"
+			"movdqu %%xmm4, 64(%0); movdqu %%xmm5, 80(%0)\n\t"
+			"movdqu %%xmm6, 96(%0); movdqu %%xmm7, 112(%0)\n"
+			: : "r" (xmm) : "memory");
+	_pgfault_handler(utf);
+	if (simd)
+		asm volatile("movdqu 0(%0), %%xmm0; movdqu 16(%0), %%xmm1\n\t"
+			"movdqu 32(%0), %%xmm2; movdqu 48(%0), %%xmm3\n\t"
+			"movdqu 64(%0), %%xmm4; movdqu 80(%0), %%xmm5\n\t"
+			"movdqu 96(%0), %%xmm6; movdqu 112(%0), %%xmm7\n"
+			: : "r" (xmm) : "memory");
+}
+
 // The first time we register a handler, we need to
 // allocate an exception stack (one page of memory with its top
 // at UXSTACKTOP), and tell the kernel to call the assembly-language
 // _pgfault_upcall routine when a page fault occurs.
+static void
+pgfault_init(void)
+{
+	int r;
+
+	r = sys_page_alloc(thisenv->env_id, (void *) (UXSTACKTOP-PGSIZE), PTE_U | PTE_W | PTE_P); 
+	if (r < 0 ) {
+		panic("set_pgfault_handler: could not allocate user exception stack. \n");
+	}
+	
+	// Tell kernel to call _pgfault_upcall routine (which is a global variable). In that routine, then call the _pgfault_handler. 
+	r =  sys_env_set_pgfault_upcall(thisenv->env_id, _pgfault_upcall); 
+	if (r < 0 ) {
+		panic("set_pgfault_handler: could not set pgfault_upcall. \n");
+	}
+}
+
+//
+// Set the page fault handler function.
+// If there isn't one yet, _pgfault_handler will be 0.
 //
 
 // To redirect a user exception page fault: 1) tell kernel which function to call with _pgfault_upcall (stored in env)
@@ -28,28 +100,41 @@ void (*_pgfault_handler)(struct UTrapframe *utf);
 void
 set_pgfault_handler(void (*handler)(struct UTrapframe *utf))
 {
-	int r;
-	
-	
 	if (_pgfault_handler == 0) {
 		// First time through!
-		// LAB 4: Your code here.
-		r = sys_page_alloc(thisenv->env_id, (void *) (UXSTACKTOP-PGSIZE), PTE_U | PTE_W | PTE_P); 
-		if (r < 0 ) {
-			panic("set_pgfault_handler: could not allocate user exception stack. \n");
-		}
-		
-		// Tell kernel to call _pgfault_upcall routine (which is a global variable). In that routine, then call the _pgfault_handler. 
-		r =  sys_env_set_pgfault_upcall(thisenv->env_id, _pgfault_upcall); 
-		if (r < 0 ) {
-			panic("set_pgfault_handler: could not set pgfault_upcall. \n");
-		}
-		
-		
+		pgfault_init();
 	}
 
 	// Save handler pointer for assembly to call.
 	// _pgfault_handler is a global variable, and will be called in pfentry.S. 
-	_pgfault_handler = handler;
-	
+	// With range handlers installed, faults go through pgfault_dispatch first. 
+	pgfault_default = handler;
+	if (_pgfault_handler != pgfault_dispatch)
+		_pgfault_handler = handler;
+}
+
+// Handle page faults in [start, end) with 'handler', ahead of the
+// handler set with set_pgfault_handler.
+// Returns 0 on success, -E_NO_MEM if there are too many ranges.
+int
+add_pgfault_range(void *start, void *end, void (*handler)(struct UTrapframe *utf))
+{
+	int i;
+
+	for (i = 0; i < NPGFAULTRANGE; i++)
+		if (!pgfault_ranges[i].pr_handler)
+			break;
+	if (i == NPGFAULTRANGE)
+		return -E_NO_MEM;
+
+	if (_pgfault_handler == 0)
+		pgfault_init();
+	else if (_pgfault_handler != pgfault_dispatch)
+		pgfault_default = _pgfault_handler;
+
+	pgfault_ranges[i].pr_start = (uintptr_t) start;
+	pgfault_ranges[i].pr_end = (uintptr_t) end;
+	pgfault_ranges[i].pr_handler = handler;
+	_pgfault_handler = pgfault_dispatch;
+	return 0;
 }
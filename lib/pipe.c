@@ -1,4 +1,5 @@
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 #define debug 0
 
@@ -6,6 +7,7 @@ static ssize_t devpipe_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devpipe_write(struct Fd *fd, const void *buf, size_t n);
 static int devpipe_stat(struct Fd *fd, struct Stat *stat);
 static int devpipe_close(struct Fd *fd);
+static int devpipe_poll(struct Fd *fd, int events);
 
 struct Dev devpipe =
 {
@@ -15,16 +17,43 @@ struct Dev devpipe =
 	.dev_write =	devpipe_write,
 	.dev_close =	devpipe_close,
 	.dev_stat =	devpipe_stat,
+	.dev_poll =	devpipe_poll,
 };
 
+// Pipes normally fill the rest of their page.  Build with PIPE_SMALLBUF
+// to get a tiny buffer that provokes races in the pipe tests.
+#ifdef PIPE_SMALLBUF
 #define PIPEBUFSIZ 32		// small to provoke races
-
+#else
+#define PIPEBUFSIZ (PGSIZE - 4 * sizeof(uint32_t))
+#endif
+
+// Give up on a futex wait after this long and look at the pipe again.
+// Closing the other end normally wakes us right away (unmapping the
+// pipe page wakes its waiters); this only covers the other end going
+// away just before we go to sleep.
+#define PIPE_WAIT_MS	100
+
+// Positions run from 0 to 2*PIPEBUFSIZ-1, so a full pipe (wpos is
+// PIPEBUFSIZ ahead of rpos) can be told apart from an empty one.
+// Readers sleep on p_wpos and writers on p_rpos; p_rwait and p_wwait
+// say that somebody may be asleep, so the other side only makes a
+// system call to wake them when needed.
 struct Pipe {
-	off_t p_rpos;		// read position
-	off_t p_wpos;		// write position
+	volatile uint32_t p_rpos;	// read position
+	volatile uint32_t p_wpos;	// write position
+	volatile uint32_t p_rwait;	// a reader may be waiting for data
+	volatile uint32_t p_wwait;	// a writer may be waiting for room
 	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
 };
 
+// Number of bytes in the pipe.
+static size_t
+pipe_used(struct Pipe *p)
+{
+	return (p->p_wpos + 2 * PIPEBUFSIZ - p->p_rpos) % (2 * PIPEBUFSIZ);
+}
+
 int
 pipe(int pfd[2])
 {
@@ -105,7 +134,8 @@ static ssize_t
 devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 {
 	uint8_t *buf;
-	size_t i;
+	size_t i, m, used, pos;
+	uint32_t wpos;
 	struct Pipe *p;
 
 	p = (struct Pipe*)fd2data(fd);
@@ -114,8 +144,8 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 			thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
 	buf = vbuf;
-	for (i = 0; i < n; i++) {
-		while (p->p_rpos == p->p_wpos) {
+	for (i = 0; i < n; i += m) {
+		while ((used = pipe_used(p)) == 0) {
 			// pipe is empty
 			// if we got any data, return it
 			if (i > 0)
@@ -123,15 +153,22 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 			// if all the writers are gone, note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// sleep until a writer moves wpos
 			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
+				cprintf("devpipe_read wait\n");
+			wpos = p->p_wpos;
+			xchg(&p->p_rwait, 1);
+			if (wpos == p->p_rpos)
+				sys_futex_wait(&p->p_wpos, wpos, PIPE_WAIT_MS);
 		}
-		// there's a byte.  take it.
-		// wait to increment rpos until the byte is taken!
-		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
-		p->p_rpos++;
+		// take as much as is there, up to the end of the buffer;
+		// wait to advance rpos until the bytes are taken!
+		pos = p->p_rpos % PIPEBUFSIZ;
+		m = MIN(MIN(n - i, used), PIPEBUFSIZ - pos);
+		memmove(buf + i, p->p_buf + pos, m);
+		p->p_rpos = (p->p_rpos + m) % (2 * PIPEBUFSIZ);
+		if (xchg(&p->p_wwait, 0))
+			sys_futex_wake(&p->p_rpos, NENV);
 	}
 	return i;
 }
@@ -140,7 +177,8 @@ static ssize_t
 devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 {
 	const uint8_t *buf;
-	size_t i;
+	size_t i, m, room, pos;
+	uint32_t rpos;
 	struct Pipe *p;
 
 	p = (struct Pipe*) fd2data(fd);
@@ -149,23 +187,30 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 			thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
 	buf = vbuf;
-	for (i = 0; i < n; i++) {
-		while (p->p_wpos >= p->p_rpos + sizeof(p->p_buf)) {
+	for (i = 0; i < n; i += m) {
+		while ((room = PIPEBUFSIZ - pipe_used(p)) == 0) {
 			// pipe is full
 			// if all the readers are gone
 			// (it's only writers like us now),
 			// note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// sleep until a reader moves rpos
 			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+				cprintf("devpipe_write wait\n");
+			rpos = p->p_rpos;
+			xchg(&p->p_wwait, 1);
+			if (rpos == p->p_rpos && pipe_used(p) == PIPEBUFSIZ)
+				sys_futex_wait(&p->p_rpos, rpos, PIPE_WAIT_MS);
 		}
-		// there's room for a byte.  store it.
-		// wait to increment wpos until the byte is stored!
-		p->p_buf[p->p_wpos % PIPEBUFSIZ] = buf[i];
-		p->p_wpos++;
+		// store as much as fits, up to the end of the buffer;
+		// wait to advance wpos until the bytes are stored!
+		pos = p->p_wpos % PIPEBUFSIZ;
+		m = MIN(MIN(n - i, room), PIPEBUFSIZ - pos);
+		memmove(p->p_buf + pos, buf + i, m);
+		p->p_wpos = (p->p_wpos + m) % (2 * PIPEBUFSIZ);
+		if (xchg(&p->p_rwait, 0))
+			sys_futex_wake(&p->p_wpos, NENV);
 	}
 
 	return i;
@@ -176,7 +221,7 @@ devpipe_stat(struct Fd *fd, struct Stat *stat)
 {
 	struct Pipe *p = (struct Pipe*) fd2data(fd);
 	strcpy(stat->st_name, "<pipe>");
-	stat->st_size = p->p_wpos - p->p_rpos;
+	stat->st_size = pipe_used(p);
 	stat->st_isdir = 0;
 	stat->st_dev = &devpipe;
 	return 0;
@@ -189,3 +234,19 @@ devpipe_close(struct Fd *fd)
 	return sys_page_unmap(0, fd2data(fd));
 }
 
+
+static int
+devpipe_poll(struct Fd *fd, int events)
+{
+	struct Pipe *p = (struct Pipe*) fd2data(fd);
+	int revents = 0;
+
+	if ((events & POLLIN) && pipe_used(p) > 0)
+		revents |= POLLIN;
+	if ((events & POLLOUT) && pipe_used(p) < PIPEBUFSIZ)
+		revents |= POLLOUT;
+	// the other end is gone: reads return eof, writes return 0
+	if (_pipeisclosed(fd, p))
+		revents |= POLLHUP;
+	return revents;
+}
@@ -1,6 +1,18 @@
 #include <inc/lib.h>
 #include <lwip/sockets.h>
 
+// The network server is split into shards (see inc/ns.h), and a socket
+// lives in one of them.  TCP sockets are spread over the shards; all
+// others live in shard 0, which gets every packet that is not TCP.  A
+// listening TCP socket gets a copy in every shard, since connections to
+// its port are spread over the shards by remote address; accept() and
+// poll() look at all copies.
+
+// A blocking accept() or poll() on sockets in several shards can only
+// wait in one shard at a time: it waits in slices of SOCK_POLL_SLICE
+// msec, one shard after the other, checking all of them in between.
+#define SOCK_POLL_SLICE	10
+
 static ssize_t devsock_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devsock_write(struct Fd *fd, const void *buf, size_t n);
 static int devsock_close(struct Fd *fd);
@@ -17,7 +29,7 @@ struct Dev devsock =
 };
 
 static int
-fd2sockid(int fd)
+fd2sock(int fd, struct Fd **sfd_store)
 {
 	struct Fd *sfd;
 	int r;
@@ -26,93 +38,321 @@ fd2sockid(int fd)
 		return r;
 	if (sfd->fd_dev_id != devsock.dev_id)
 		return -E_NOT_SUPP;
-	return sfd->fd_sock.sockid;
+	*sfd_store = sfd;
+	return 0;
+}
+
+// Port of sin, in host order (without ntohs, which is in liblwip)
+static uint16_t
+sin_port(const struct sockaddr_in *sin)
+{
+	const uint8_t *b = (const uint8_t *) &sin->sin_port;
+
+	return (b[0] << 8) | b[1];
 }
 
 static int
-alloc_sockfd(int sockid)
+alloc_sockfd(int shard, int sockid, int domain, int type, int protocol)
 {
 	struct Fd *sfd;
 	int r;
 
 	if ((r = fd_alloc(&sfd)) < 0
 	    || (r = sys_page_alloc(0, sfd, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0) {
-		nsipc_close(sockid);
+		nsipc_close(shard, sockid);
 		return r;
 	}
 
 	sfd->fd_dev_id = devsock.dev_id;
 	sfd->fd_omode = O_RDWR;
 	sfd->fd_sock.sockid = sockid;
+	sfd->fd_sock.shard = shard;
+	sfd->fd_sock.domain = domain;
+	sfd->fd_sock.type = type;
+	sfd->fd_sock.protocol = protocol;
+	sfd->fd_sock.namelen = 0;
+	sfd->fd_sock.nlisten = 0;
 	return fd2num(sfd);
 }
 
+// Close the copies of listening socket sfd in the shards other than its own.
+static void
+close_copies(struct Fd *sfd)
+{
+	int i;
+
+	for (i = 0; i < sfd->fd_sock.nlisten; i++)
+		if (i != sfd->fd_sock.shard && sfd->fd_sock.lsockids[i] >= 0)
+			nsipc_close(i, sfd->fd_sock.lsockids[i]);
+	sfd->fd_sock.nlisten = 0;
+}
+
+// Take a connection from listening socket sfd, which has a copy in
+// every shard: from whichever shard has one first.
+static int
+accept_copies(struct Fd *sfd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	struct pollfd pfd;
+	int i, n, r, turn = 0;
+
+	while (1) {
+		for (n = 0; n < sfd->fd_sock.nlisten; n++) {
+			i = (turn + n) % sfd->fd_sock.nlisten;
+			pfd.fd = sfd->fd_sock.lsockids[i];
+			pfd.events = POLLIN;
+			if ((r = nsipc_poll(i, &pfd, 1, 0)) < 0)
+				return r;
+			if (pfd.revents & (POLLIN | POLLNVAL)) {
+				if ((r = nsipc_accept(i, pfd.fd, addr, addrlen)) < 0)
+					return r;
+				return alloc_sockfd(i, r, sfd->fd_sock.domain,
+						    sfd->fd_sock.type, sfd->fd_sock.protocol);
+			}
+		}
+		// Nothing pending anywhere: wait a slice in one shard.
+		turn = (turn + 1) % sfd->fd_sock.nlisten;
+		pfd.fd = sfd->fd_sock.lsockids[turn];
+		pfd.events = POLLIN;
+		if ((r = nsipc_poll(turn, &pfd, 1, SOCK_POLL_SLICE)) < 0)
+			return r;
+	}
+}
+
 int
 accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 {
+	struct Fd *sfd;
 	int r;
-	if ((r = fd2sockid(s)) < 0)
+
+	if ((r = fd2sock(s, &sfd)) < 0)
 		return r;
-	if ((r = nsipc_accept(r, addr, addrlen)) < 0)
+	if (sfd->fd_sock.nlisten > 0)
+		return accept_copies(sfd, addr, addrlen);
+	if ((r = nsipc_accept(sfd->fd_sock.shard, sfd->fd_sock.sockid, addr, addrlen)) < 0)
 		return r;
-	return alloc_sockfd(r);
+	return alloc_sockfd(sfd->fd_sock.shard, r, sfd->fd_sock.domain,
+			    sfd->fd_sock.type, sfd->fd_sock.protocol);
 }
 
 int
 bind(int s, struct sockaddr *name, socklen_t namelen)
 {
-	int r;
-	if ((r = fd2sockid(s)) < 0)
+	struct sockaddr_in *sin = (struct sockaddr_in *) name;
+	struct Fd *sfd;
+	int r, shard;
+
+	if ((r = fd2sock(s, &sfd)) < 0)
 		return r;
-	return nsipc_bind(r, name, namelen);
+
+	// A TCP socket bound to an ephemeral port has to live in the shard
+	// that owns the port (see ns_tcp_shard): replace it with a new
+	// socket there.
+	if (sfd->fd_sock.type == SOCK_STREAM && namelen >= sizeof(*sin)
+	    && sin->sin_family == AF_INET && ns_port_ephemeral(sin_port(sin))) {
+		shard = ns_tcp_shard(0, 0, sin_port(sin), nsipc_nshards());
+		if (shard != sfd->fd_sock.shard) {
+			if ((r = nsipc_socket(shard, sfd->fd_sock.domain, sfd->fd_sock.type,
+					      sfd->fd_sock.protocol)) < 0)
+				return r;
+			nsipc_close(sfd->fd_sock.shard, sfd->fd_sock.sockid);
+			sfd->fd_sock.shard = shard;
+			sfd->fd_sock.sockid = r;
+		}
+	}
+
+	if ((r = nsipc_bind(sfd->fd_sock.shard, sfd->fd_sock.sockid, name, namelen)) < 0)
+		return r;
+	if (namelen <= sizeof(sfd->fd_sock.name)) {
+		memmove(sfd->fd_sock.name, name, namelen);
+		sfd->fd_sock.namelen = namelen;
+	}
+	return r;
 }
 
 int
 shutdown(int s, int how)
 {
-	int r;
-	if ((r = fd2sockid(s)) < 0)
+	struct Fd *sfd;
+	int r, i;
+
+	if ((r = fd2sock(s, &sfd)) < 0)
 		return r;
-	return nsipc_shutdown(r, how);
+	for (i = 0; i < sfd->fd_sock.nlisten; i++)
+		if (i != sfd->fd_sock.shard)
+			nsipc_shutdown(i, sfd->fd_sock.lsockids[i], how);
+	return nsipc_shutdown(sfd->fd_sock.shard, sfd->fd_sock.sockid, how);
 }
 
 static int
 devsock_close(struct Fd *fd)
 {
-	if (pageref(fd) == 1)
-		return nsipc_close(fd->fd_sock.sockid);
-	else
+	if (pageref(fd) == 1) {
+		close_copies(fd);
+		return nsipc_close(fd->fd_sock.shard, fd->fd_sock.sockid);
+	} else
 		return 0;
 }
 
 int
 connect(int s, const struct sockaddr *name, socklen_t namelen)
 {
+	struct Fd *sfd;
 	int r;
-	if ((r = fd2sockid(s)) < 0)
+
+	if ((r = fd2sock(s, &sfd)) < 0)
 		return r;
-	return nsipc_connect(r, name, namelen);
+	return nsipc_connect(sfd->fd_sock.shard, sfd->fd_sock.sockid, name, namelen);
 }
 
 int
 listen(int s, int backlog)
 {
-	int r;
-	if ((r = fd2sockid(s)) < 0)
+	struct sockaddr_in *sin;
+	struct Fd *sfd;
+	int r, i, id, nshards;
+
+	if ((r = fd2sock(s, &sfd)) < 0)
+		return r;
+	if ((r = nsipc_listen(sfd->fd_sock.shard, sfd->fd_sock.sockid, backlog)) < 0)
+		return r;
+
+	// Connections to a port that isn't ephemeral are spread over all
+	// shards, so each needs a copy of the socket, bound to the same address.
+	sin = (struct sockaddr_in *) sfd->fd_sock.name;
+	nshards = nsipc_nshards();
+	if (sfd->fd_sock.type != SOCK_STREAM || nshards == 1 || sfd->fd_sock.nlisten > 0
+	    || sfd->fd_sock.namelen < sizeof(*sin) || sin->sin_family != AF_INET
+	    || sin->sin_port == 0 || ns_port_ephemeral(sin_port(sin)))
 		return r;
-	return nsipc_listen(r, backlog);
+
+	for (i = 0; i < nshards; i++)
+		sfd->fd_sock.lsockids[i] = -1;
+	sfd->fd_sock.lsockids[sfd->fd_sock.shard] = sfd->fd_sock.sockid;
+	sfd->fd_sock.nlisten = nshards;
+	for (i = 0; i < nshards; i++) {
+		if (i == sfd->fd_sock.shard)
+			continue;
+		if ((id = nsipc_socket(i, sfd->fd_sock.domain, sfd->fd_sock.type,
+				       sfd->fd_sock.protocol)) < 0) {
+			close_copies(sfd);
+			return id;
+		}
+		sfd->fd_sock.lsockids[i] = id;
+		if ((r = nsipc_bind(i, id, (struct sockaddr *) sfd->fd_sock.name,
+				    sfd->fd_sock.namelen)) < 0
+		    || (r = nsipc_listen(i, id, backlog)) < 0) {
+			close_copies(sfd);
+			return r;
+		}
+	}
+	return 0;
+}
+
+// Poll the sockets in fds (file descriptor numbers, all sockets) like
+// poll().  The sockets of each shard are checked with a single request;
+// if they are all in one shard, that request also does the waiting.
+int
+sockpoll(struct pollfd *fds, int nfds, int timeout)
+{
+	struct pollfd *pf;
+	struct Fd *sfd;
+	int *from, count[NS_MAXSHARDS], off[NS_MAXSHARDS + 1];
+	int i, j, k, n, r, nshards, nused, nready, turn, remaining, wait;
+	uint32_t start = sys_time_msec();
+
+	// One entry per socket, or per copy of a listening socket, grouped
+	// by shard.  from[] is the fds index of each.
+	nshards = nsipc_nshards();
+	memset(count, 0, sizeof(count));
+	for (i = 0, n = 0; i < nfds; i++) {
+		if ((r = fd2sock(fds[i].fd, &sfd)) < 0)
+			return r;
+		if (sfd->fd_sock.nlisten > 0) {
+			for (j = 0; j < sfd->fd_sock.nlisten; j++)
+				count[j]++;
+			n += sfd->fd_sock.nlisten;
+		} else {
+			count[sfd->fd_sock.shard]++;
+			n++;
+		}
+	}
+	for (j = 0, off[0] = 0, nused = 0; j < nshards; j++) {
+		if (count[j] > NSPOLL_MAX)
+			return -E_INVAL;
+		if (count[j] > 0)
+			nused++;
+		off[j + 1] = off[j] + count[j];
+	}
+	if (n == 0)
+		return 0;
+	if (!(pf = malloc(n * (sizeof(*pf) + sizeof(*from)))))
+		return -E_NO_MEM;
+	from = (int *) (pf + n);
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < nfds; i++) {
+		fd2sock(fds[i].fd, &sfd);
+		for (j = 0; j < nshards; j++) {
+			if (sfd->fd_sock.nlisten == 0 && j != sfd->fd_sock.shard)
+				continue;
+			k = off[j] + count[j]++;
+			pf[k].fd = sfd->fd_sock.nlisten ? sfd->fd_sock.lsockids[j] : sfd->fd_sock.sockid;
+			pf[k].events = fds[i].events;
+			from[k] = i;
+		}
+	}
+
+	turn = 0;
+	while (1) {
+		for (i = 0; i < nfds; i++)
+			fds[i].revents = 0;
+
+		// With a single shard, wait in it; otherwise check them all first.
+		wait = (nused == 1) ? timeout : 0;
+		for (j = 0; j < nshards; j++) {
+			if (count[j] == 0)
+				continue;
+			if ((r = nsipc_poll(j, pf + off[j], count[j], wait)) < 0)
+				goto out;
+			for (k = off[j]; k < off[j + 1]; k++)
+				fds[from[k]].revents |= pf[k].revents;
+		}
+		for (i = 0, nready = 0; i < nfds; i++)
+			if (fds[i].revents)
+				nready++;
+
+		remaining = timeout;
+		if (timeout > 0 && (remaining = timeout - (sys_time_msec() - start)) < 0)
+			remaining = 0;
+		if (nready > 0 || nused == 1 || remaining == 0) {
+			r = nready;
+			goto out;
+		}
+
+		// Nothing ready: wait a slice in the next shard, then check again.
+		do
+			turn = (turn + 1) % nshards;
+		while (count[turn] == 0);
+		wait = (remaining < 0 || remaining > SOCK_POLL_SLICE) ? SOCK_POLL_SLICE : remaining;
+		if ((r = nsipc_poll(turn, pf + off[turn], count[turn], wait)) < 0)
+			goto out;
+	}
+
+out:
+	free(pf);
+	return r;
 }
 
 static ssize_t
 devsock_read(struct Fd *fd, void *buf, size_t n)
 {
-	return nsipc_recv(fd->fd_sock.sockid, buf, n, 0);
+	return nsipc_recv(fd->fd_sock.shard, fd->fd_sock.sockid, buf, n, 0);
 }
 
 static ssize_t
 devsock_write(struct Fd *fd, const void *buf, size_t n)
 {
-	return nsipc_send(fd->fd_sock.sockid, buf, n, 0);
+	return nsipc_send(fd->fd_sock.shard, fd->fd_sock.sockid, buf, n, 0);
 }
 
 static int
@@ -125,8 +365,12 @@ devsock_stat(struct Fd *fd, struct Stat *stat)
 int
 socket(int domain, int type, int protocol)
 {
-	int r;
-	if ((r = nsipc_socket(domain, type, protocol)) < 0)
+	static int next;
+	int shard = 0, r;
+
+	if (type == SOCK_STREAM)
+		shard = (ENVX(thisenv->env_id) + next++) % nsipc_nshards();
+	if ((r = nsipc_socket(shard, domain, type, protocol)) < 0)
 		return r;
-	return alloc_sockfd(r);
+	return alloc_sockfd(shard, r, domain, type, protocol);
 }
@@ -49,6 +49,7 @@ spawn(const char *prog, const char **argv)
 	//
 	//	* If the ELF flags do not include ELF_PROG_FLAG_WRITE,
 	//	  then the segment contains text and read-only data.
+	//	  (We map it from the file server's text cache with map_text.)
 	//	  Use read_map() to read the contents of this segment,
 	//	  and map the pages it returns directly into the child
 	//        so that multiple instances of the same program
@@ -260,12 +261,18 @@ error:
 	return r;
 }
 
+// Map a segment into the child.  Pages of a read-only segment (text,
+// rodata) come from the file server's text cache (see map_text), up
+// to FSBULK_MAXPAGES per request, so they are never copied and all
+// instances of a program share them.  Pages of a writable segment,
+// and read-only pages that need zero-filling past filesz, are read
+// into fresh pages.
 static int
 map_segment(envid_t child, uintptr_t va, size_t memsz,
 	int fd, size_t filesz, off_t fileoffset, int perm)
 {
-	int i, r;
-	void *blk;
+	int i, j, n, r;
+	size_t nshared = 0;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -276,7 +283,22 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
-	for (i = 0; i < memsz; i += PGSIZE) {
+	if (!(perm & PTE_W))
+		nshared = memsz <= filesz ? ROUNDUP(filesz, PGSIZE) : ROUNDDOWN(filesz, PGSIZE);
+
+	for (i = 0; i < nshared; i += n * PGSIZE) {
+		// Fall back to reading the rest if the text cache can't help.
+		if ((n = map_text(fd, fileoffset + i, nshared - i, UTEMP)) <= 0)
+			break;
+		for (j = 0; j < n; j++) {
+			r = sys_page_map(0, UTEMP + j * PGSIZE, child, (void*) (va + i + j * PGSIZE), perm);
+			sys_page_unmap(0, UTEMP + j * PGSIZE);
+			if (r < 0)
+				return r;
+		}
+	}
+
+	for (; i < memsz; i += PGSIZE) {
 		if (i >= filesz) {
 			// allocate a blank page
 			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
@@ -134,6 +134,198 @@ strfind(const char *s, char c)
 	return (char *) s;
 }
 
+// In user environments, memset and memmove of big blocks use the SSE2
+// registers when the CPU has them: 16 bytes per load or store, with
+// aligned stores (and aligned loads too when the source lines up).
+// Whole pages get an unrolled loop of their own, and blocks too big
+// for the cache are written with non-temporal stores.  The kernel
+// keeps its own copy of these routines to the string instructions:
+// it doesn't save its SSE registers, only environments' (kern/fpu.c).
+#if ASM && defined(JOS_USER)
+#define SIMD 1
+#else
+#define SIMD 0
+#endif
+
+#if SIMD
+#include <inc/x86.h>
+#include <inc/mmu.h>
+
+#define SIMD_MIN	128		// smaller blocks use the string instructions
+#define SIMD_STREAM	(256*1024)	// bigger ones go around the cache
+
+#define SSE2	__attribute__((target("sse2")))
+
+// 1 if the SSE2 paths are on, 0 if not, -1 until simd_probe has looked.
+static int simd_on = -1;
+
+static int
+simd_probe(void)
+{
+	uint32_t edx;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	simd_on = (edx & CPUID_SSE2) && (edx & CPUID_FXSR);
+	return simd_on;
+}
+
+#define SIMD_ON()	(simd_on >= 0 ? simd_on : simd_probe())
+
+static void
+rep_stosb(void *v, int c, size_t n)
+{
+	asm volatile("cld; rep stosb\n"
+		: "+D" (v), "+c" (n) : "a" (c) : "cc", "memory");
+}
+
+static void
+rep_movsb(void *d, const void *s, size_t n)
+{
+	asm volatile("cld; rep movsb\n"
+		: "+D" (d), "+S" (s), "+c" (n) : : "cc", "memory");
+}
+
+// Stores xmm0 to the %1 bytes at %0 (both multiples of 64).
+#define SIMD_FILL64(store)			\
+	"1:\t" store " %%xmm0, (%0)\n\t"	\
+	store " %%xmm0, 16(%0)\n\t"		\
+	store " %%xmm0, 32(%0)\n\t"		\
+	store " %%xmm0, 48(%0)\n\t"		\
+	"addl $64, %0\n\t"			\
+	"subl $64, %1\n\t"			\
+	"jnz 1b\n\t"
+
+static SSE2 void
+simd_memset(char *p, int c, size_t n)
+{
+	uint32_t c4 = (c & 0xFF) * 0x01010101;
+	size_t body;
+
+	body = -(uintptr_t) p & 15;
+	rep_stosb(p, c, body);
+	p += body;
+	n -= body;
+
+	if ((body = n & ~63) >= SIMD_STREAM)
+		asm volatile("movd %2, %%xmm0\n\t"
+			"pshufd $0, %%xmm0, %%xmm0\n"
+			SIMD_FILL64("movntdq")
+			"sfence\n"
+			: "+r" (p), "+r" (body) : "r" (c4) : "cc", "memory", "xmm0");
+	else if (body)
+		asm volatile("movd %2, %%xmm0\n\t"
+			"pshufd $0, %%xmm0, %%xmm0\n"
+			SIMD_FILL64("movdqa")
+			: "+r" (p), "+r" (body) : "r" (c4) : "cc", "memory", "xmm0");
+	rep_stosb(p, c, n & 63);
+}
+
+// Copies the %2 bytes at %1 to %0 (%2 a multiple of 64).  Each round
+// loads all its bytes before storing any, so the destination may
+// overlap the source if it is below it.
+#define SIMD_COPY64(load, store)		\
+	"1:\t" load " (%1), %%xmm0\n\t"		\
+	load " 16(%1), %%xmm1\n\t"		\
+	load " 32(%1), %%xmm2\n\t"		\
+	load " 48(%1), %%xmm3\n\t"		\
+	store " %%xmm0, (%0)\n\t"		\
+	store " %%xmm1, 16(%0)\n\t"		\
+	store " %%xmm2, 32(%0)\n\t"		\
+	store " %%xmm3, 48(%0)\n\t"		\
+	"addl $64, %1\n\t"			\
+	"addl $64, %0\n\t"			\
+	"subl $64, %2\n\t"			\
+	"jnz 1b\n\t"
+
+#define SIMD_COPY64_ASM(load, store)					\
+	asm volatile(SIMD_COPY64(load, store)				\
+		: "+r" (d), "+r" (s), "+r" (body) : : "cc", "memory",	\
+		  "xmm0", "xmm1", "xmm2", "xmm3")
+
+// Copy whole, page-aligned pages: 128 bytes per round, no checks.
+static SSE2 void
+simd_copy_pages(char *d, const char *s, size_t n)
+{
+	asm volatile("1:\tmovdqa (%1), %%xmm0\n\t"
+		"movdqa 16(%1), %%xmm1\n\t"
+		"movdqa 32(%1), %%xmm2\n\t"
+		"movdqa 48(%1), %%xmm3\n\t"
+		"movdqa 64(%1), %%xmm4\n\t"
+		"movdqa 80(%1), %%xmm5\n\t"
+		"movdqa 96(%1), %%xmm6\n\t"
+		"movdqa 112(%1), %%xmm7\n\t"
+		"movdqa %%xmm0, (%0)\n\t"
+		"movdqa %%xmm1, 16(%0)\n\t"
+		"movdqa %%xmm2, 32(%0)\n\t"
+		"movdqa %%xmm3, 48(%0)\n\t"
+		"movdqa %%xmm4, 64(%0)\n\t"
+		"movdqa %%xmm5, 80(%0)\n\t"
+		"movdqa %%xmm6, 96(%0)\n\t"
+		"movdqa %%xmm7, 112(%0)\n\t"
+		"addl $128, %1\n\t"
+		"addl $128, %0\n\t"
+		"subl $128, %2\n\t"
+		"jnz 1b\n"
+		: "+r" (d), "+r" (s), "+r" (n) : : "cc", "memory",
+		  "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7");
+}
+
+// Copy n bytes from s to d, front to back.  'stream' says that d and s
+// don't overlap, so big blocks may use non-temporal stores.
+static SSE2 void
+simd_memcpy(char *d, const char *s, size_t n, int stream)
+{
+	size_t body;
+
+	if (((uintptr_t) d | (uintptr_t) s | n) % PGSIZE == 0 && n < SIMD_STREAM) {
+		simd_copy_pages(d, s, n);
+		return;
+	}
+
+	body = -(uintptr_t) d & 15;
+	rep_movsb(d, s, body);
+	d += body;
+	s += body;
+	n -= body;
+
+	body = n & ~63;
+	stream = stream && body >= SIMD_STREAM;
+	if (body == 0)
+		;
+	else if ((uintptr_t) s % 16 == 0 && stream) {
+		SIMD_COPY64_ASM("movdqa", "movntdq");
+		asm volatile("sfence" ::: "memory");
+	} else if (stream) {
+		SIMD_COPY64_ASM("movdqu", "movntdq");
+		asm volatile("sfence" ::: "memory");
+	} else if ((uintptr_t) s % 16 == 0)
+		SIMD_COPY64_ASM("movdqa", "movdqa");
+	else
+		SIMD_COPY64_ASM("movdqu", "movdqa");
+	rep_movsb(d, s, n & 63);
+}
+#endif
+
+// Turn the SSE2 paths of memset and memmove on (1, if the CPU has
+// SSE2) or off (0), or leave them be (-1).  Returns whether they were
+// on.  For benchmarks, and for code that must save the registers the
+// paths use (see lib/pgfault.c).
+int
+memsimd(int on)
+{
+#if SIMD
+	int was = SIMD_ON();
+
+	if (on == 0)
+		simd_on = 0;
+	else if (on > 0)
+		simd_probe();
+	return was;
+#else
+	return 0;
+#endif
+}
+
 #if ASM
 void *
 memset(void *v, int c, size_t n)
@@ -142,6 +334,12 @@ memset(void *v, int c, size_t n)
 
 	if (n == 0)
 		return v;
+#if SIMD
+	if (n >= SIMD_MIN && SIMD_ON()) {
+		simd_memset(v, c, n);
+		return v;
+	}
+#endif
 	if ((int)v%4 == 0 && n%4 == 0) {
 		c &= 0xFF;
 		c = (c<<24)|(c<<16)|(c<<8)|c;
@@ -174,6 +372,10 @@ memmove(void *dst, const void *src, size_t n)
 				:: "D" (d-1), "S" (s-1), "c" (n) : "cc", "memory");
 		// Some versions of GCC rely on DF being clear
 		asm volatile("cld" ::: "cc");
+#if SIMD
+	} else if (n >= SIMD_MIN && SIMD_ON()) {
+		simd_memcpy(d, s, n, d + n <= s || s + n <= d);
+#endif
 	} else {
 		if ((int)s%4 == 0 && (int)d%4 == 0 && n%4 == 0)
 			asm volatile("cld; rep movsl\n"
@@ -149,3 +149,81 @@ sys_get_mac_addr(uint16_t * mac_addr)
 {
 	return syscall(SYS_get_mac_addr, 1, (uint32_t) mac_addr, 0, 0, 0, 0);
 }
+
+int
+sys_net_rx_wait(void)
+{
+	return syscall(SYS_net_rx_wait, 1, 0, 0, 0, 0, 0);
+}
+
+int
+sys_net_stats(struct NicStats *stats)
+{
+	return syscall(SYS_net_stats, 1, (uint32_t) stats, 0, 0, 0, 0);
+}
+
+int
+sys_transmit_sg(struct TxSeg *segs, int nsegs)
+{
+	return syscall(SYS_transmit_sg, 1, (uint32_t) segs, nsegs, 0, 0, 0);
+}
+
+int
+sys_transmit_tso(struct TxSeg *segs, int nsegs, size_t hdrlen, size_t mss)
+{
+	return syscall(SYS_transmit_tso, 1, (uint32_t) segs, nsegs, hdrlen, mss, 0);
+}
+
+int
+sys_page_phys(void *va)
+{
+	return syscall(SYS_page_phys, 0, (uint32_t) va, 0, 0, 0, 0);
+}
+
+int
+sys_ide_dma_init(void)
+{
+	return syscall(SYS_ide_dma_init, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_ide_wait(void)
+{
+	return syscall(SYS_ide_wait, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_fs_timer(unsigned msec)
+{
+	return syscall(SYS_fs_timer, 0, msec, 0, 0, 0, 0);
+}
+
+int
+sys_ipc_try_send_pages(envid_t envid, uint32_t value, void *srcva, size_t npages, int perm)
+{
+	return syscall(SYS_ipc_try_send_pages, 0, envid, value, (uint32_t) srcva, npages, perm);
+}
+
+int
+sys_ipc_recv_pages(void *dstva, size_t maxpages)
+{
+	return syscall(SYS_ipc_recv_pages, 1, (uint32_t) dstva, maxpages, 0, 0, 0);
+}
+
+int
+sys_futex_wait(volatile uint32_t *addr, uint32_t val, unsigned msec)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t) addr, val, msec, 0, 0);
+}
+
+int
+sys_futex_wake(volatile uint32_t *addr, int n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t) addr, n, 0, 0, 0);
+}
+
+int
+sys_ncpu(void)
+{
+	return syscall(SYS_ncpu, 0, 0, 0, 0, 0, 0);
+}
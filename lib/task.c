@@ -0,0 +1,306 @@
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+/*
+ * Task runtime.
+ *
+ * task_init sforks worker environments (by default one per CPU); the
+ * environment that called it is worker 0.  Workers share the heap and
+ * the global variables, so tasks can be handed around as pointers, but
+ * each worker has its own stack.
+ *
+ * Every worker has a work-stealing deque of tasks (Chase and Lev):
+ * task_spawn pushes at the bottom of the spawning worker's deque, the
+ * owner pops from the bottom (newest first, which keeps its working set
+ * small), and idle workers steal from the top of the others' deques
+ * (oldest first, which tends to be the biggest piece of work).  Only a
+ * steal, or a pop racing a steal for the last task, takes an atomic
+ * compare-and-swap.
+ *
+ * Workers that find nothing to do sleep on rt_seq with sys_futex_wait;
+ * task_spawn bumps rt_seq and wakes one of them if any are asleep.
+ * task_wait doesn't sleep: the waiting worker runs tasks (its own or
+ * stolen ones) until the group is done.
+ */
+
+#define DEQUE_SIZE	1024	/* tasks per deque, a power of 2 */
+
+struct Task {
+	void (*t_fn)(void *);
+	void *t_arg;
+	struct TaskGroup *t_group;
+};
+
+struct Deque {
+	volatile uint32_t d_top;	/* next task to steal */
+	volatile uint32_t d_bottom;	/* next free slot */
+	struct Task *volatile d_tasks[DEQUE_SIZE];
+};
+
+static struct Deque rt_deques[TASK_MAXWORKERS];
+static envid_t rt_envs[TASK_MAXWORKERS];
+static int rt_nworkers;
+static volatile uint32_t rt_stop;
+static volatile uint32_t rt_seq;	/* bumped when work shows up */
+static volatile uint32_t rt_nsleep;	/* workers asleep on rt_seq */
+
+/* Push t on our deque.  Returns < 0 if the deque is full. */
+static int
+deque_push(struct Deque *d, struct Task *t)
+{
+	uint32_t b = d->d_bottom;
+
+	if (b - d->d_top >= DEQUE_SIZE)
+		return -E_NO_MEM;
+	d->d_tasks[b % DEQUE_SIZE] = t;
+	/* x86 keeps the stores in order: thieves see the task first */
+	d->d_bottom = b + 1;
+	return 0;
+}
+
+/* Pop the newest task off our deque. */
+static struct Task *
+deque_pop(struct Deque *d)
+{
+	uint32_t b, t;
+	struct Task *task;
+
+	if (d->d_bottom == d->d_top)
+		return 0;
+	b = d->d_bottom - 1;
+	xchg(&d->d_bottom, b);	/* store, then load d_top: needs a fence */
+	t = d->d_top;
+	if ((int32_t) (b - t) < 0) {
+		d->d_bottom = b + 1;	/* a thief got it */
+		return 0;
+	}
+	task = d->d_tasks[b % DEQUE_SIZE];
+	if (b != t)
+		return task;
+	/* the last one: race the thieves for it */
+	if (cmpxchg(&d->d_top, t, t + 1) != t)
+		task = 0;
+	d->d_bottom = t + 1;
+	return task;
+}
+
+/* Steal the oldest task of another worker's deque. */
+static struct Task *
+deque_steal(struct Deque *d)
+{
+	uint32_t t = d->d_top, b = d->d_bottom;
+	struct Task *task;
+
+	if ((int32_t) (b - t) <= 0)
+		return 0;
+	task = d->d_tasks[t % DEQUE_SIZE];
+	if (cmpxchg(&d->d_top, t, t + 1) != t)
+		return 0;
+	return task;
+}
+
+/* Find a task: ours first, then the others'. */
+static struct Task *
+task_find(void)
+{
+	int me = tls->tls_worker, i;
+	struct Task *t;
+
+	if ((t = deque_pop(&rt_deques[me])) != 0)
+		return t;
+	for (i = 1; i < rt_nworkers; i++)
+		if ((t = deque_steal(&rt_deques[(me + i) % rt_nworkers])) != 0)
+			return t;
+	return 0;
+}
+
+static void
+task_run(struct Task *t)
+{
+	struct TaskGroup *g = t->t_group;
+
+	t->t_fn(t->t_arg);
+	free(t);
+	xadd(&g->tg_pending, -1);
+}
+
+static void
+worker_loop(void)
+{
+	struct Task *t;
+	uint32_t seq;
+
+	while (!rt_stop) {
+		if ((t = task_find()) != 0) {
+			task_run(t);
+			continue;
+		}
+		/* nothing to do: sleep until task_spawn bumps rt_seq */
+		seq = rt_seq;
+		xadd(&rt_nsleep, 1);
+		if (!rt_stop && (t = task_find()) == 0)
+			sys_futex_wait(&rt_seq, seq, 0);
+		xadd(&rt_nsleep, -1);
+		if (t)
+			task_run(t);
+	}
+	/* not exit(): the file descriptors are shared with worker 0 */
+	sys_env_destroy(0);
+}
+
+/*
+ * Start the runtime with nworkers workers (one per CPU if nworkers is
+ * 0 or less), counting the caller.
+ * Returns the number of workers, or < 0 on error.
+ */
+int
+task_init(int nworkers)
+{
+	envid_t envid;
+	int w, r;
+
+	if (rt_nworkers)
+		return -E_INVAL;
+	if (nworkers <= 0)
+		nworkers = sys_ncpu();
+	nworkers = MIN(MAX(nworkers, 1), TASK_MAXWORKERS);
+
+	rt_stop = 0;
+	rt_nworkers = nworkers;
+	tls->tls_worker = 0;
+	rt_envs[0] = thisenv->env_id;
+	for (w = 1; w < nworkers; w++) {
+		if ((envid = sfork()) < 0) {
+			r = envid;
+			rt_nworkers = w;
+			task_shutdown();
+			return r;
+		}
+		if (envid == 0) {
+			tls->tls_worker = w;
+			worker_loop();
+		}
+		rt_envs[w] = envid;
+	}
+	return nworkers;
+}
+
+/* Stop the workers and wait for them to go away.  Called by worker 0. */
+void
+task_shutdown(void)
+{
+	int w;
+
+	rt_stop = 1;
+	xadd(&rt_seq, 1);
+	sys_futex_wake(&rt_seq, TASK_MAXWORKERS);
+	for (w = 1; w < rt_nworkers; w++)
+		wait(rt_envs[w]);
+	rt_nworkers = 0;
+}
+
+int
+task_nworkers(void)
+{
+	return MAX(rt_nworkers, 1);
+}
+
+/*
+ * Run fn(arg) as a task of group g.  Runs it right away if the runtime
+ * isn't started, or if it can't be queued.
+ */
+void
+task_spawn(struct TaskGroup *g, void (*fn)(void *), void *arg)
+{
+	struct Task *t;
+
+	if (rt_nworkers == 0 || (t = malloc(sizeof(struct Task))) == 0) {
+		fn(arg);
+		return;
+	}
+	t->t_fn = fn;
+	t->t_arg = arg;
+	t->t_group = g;
+	xadd(&g->tg_pending, 1);
+	if (deque_push(&rt_deques[tls->tls_worker], t) < 0) {
+		task_run(t);
+		return;
+	}
+	/* bump rt_seq before looking for sleepers (see worker_loop) */
+	xadd(&rt_seq, 1);
+	if (rt_nsleep)
+		sys_futex_wake(&rt_seq, 1);
+}
+
+/* Wait for the tasks of g, running tasks meanwhile. */
+void
+task_wait(struct TaskGroup *g)
+{
+	struct Task *t;
+
+	while (g->tg_pending) {
+		if (rt_nworkers && (t = task_find()) != 0)
+			task_run(t);
+		else
+			sys_yield();
+	}
+}
+
+struct Range {
+	int r_lo, r_hi, r_grain;
+	void (*r_body)(int lo, int hi, void *arg);
+	void *r_arg;
+};
+
+/* Split the range in halves, spawning the upper ones, down to r_grain. */
+static void
+range_run(void *v)
+{
+	struct Range *r = v, *right;
+	struct TaskGroup *g;
+	int mid;
+
+	if ((g = malloc(sizeof(struct TaskGroup))) == 0) {
+		r->r_body(r->r_lo, r->r_hi, r->r_arg);
+		free(r);
+		return;
+	}
+	g->tg_pending = 0;
+	while (r->r_hi - r->r_lo > r->r_grain) {
+		mid = r->r_lo + (r->r_hi - r->r_lo) / 2;
+		if ((right = malloc(sizeof(struct Range))) == 0)
+			break;
+		*right = *r;
+		right->r_lo = mid;
+		r->r_hi = mid;
+		task_spawn(g, range_run, right);
+	}
+	r->r_body(r->r_lo, r->r_hi, r->r_arg);
+	task_wait(g);
+	free(g);
+	free(r);
+}
+
+/*
+ * Call body(lo', hi', arg) on pieces of [lo, hi) of at most grain
+ * iterations, in parallel, and return when all of them are done.
+ */
+void
+task_parallel_for(int lo, int hi, int grain,
+		  void (*body)(int lo, int hi, void *arg), void *arg)
+{
+	struct Range *r;
+
+	if (hi <= lo)
+		return;
+	if ((r = malloc(sizeof(struct Range))) == 0) {
+		body(lo, hi, arg);
+		return;
+	}
+	r->r_lo = lo;
+	r->r_hi = hi;
+	r->r_grain = MAX(grain, 1);
+	r->r_body = body;
+	r->r_arg = arg;
+	range_run(r);
+}
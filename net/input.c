@@ -5,8 +5,44 @@
 
 extern union Nsipc nsipcbuf;
 
+// Shard of the network server (see net/serv.c) that gets the Ethernet frame pkt, or -1 for all of them. 
+// TCP segments go to the shard of their connection (ns_tcp_shard). 
+// ARP replies go to every shard, since each keeps its own ARP table; everything else (ARP requests, ICMP, UDP, fragments) goes to shard 0. 
+static int
+pkt_shard(const uint8_t *pkt, size_t len, int nshards)
+{
+	const uint8_t *ip, *tcp;
+	uint32_t raddr;
+	int type, hlen;
+
+	if (nshards == 1 || len < 14 + 20)
+		return 0;
+	type = (pkt[12] << 8) | pkt[13];
+	if (type == 0x0806)
+		// ARP: opcode 2 is a reply
+		return (pkt[14 + 7] == 2) ? -1 : 0;
+	if (type != 0x0800)
+		return 0;
+
+	ip = pkt + 14;
+	hlen = (ip[0] & 0xF) * 4;
+	// Only TCP, and only unfragmented (the other fragments have no ports)
+	if (ip[9] != 6 || (((ip[6] & 0x3F) << 8) | ip[7]) != 0 || len < 14 + hlen + 4)
+		return 0;
+	tcp = ip + hlen;
+	memmove(&raddr, ip + 12, sizeof(raddr));
+	return ns_tcp_shard(raddr, (tcp[0] << 8) | tcp[1], (tcp[2] << 8) | tcp[3], nshards);
+}
+
 void
 input(envid_t ns_envid)
+{
+	input_shards(&ns_envid, 1);
+}
+
+// Like input, for a network server of nshards shards, whose environments are in shards. 
+void
+input_shards(const envid_t *shards, int nshards)
 {
 	binaryname = "ns_input";
 
@@ -20,6 +56,7 @@ input(envid_t ns_envid)
 	// Variables
 	int r; 
 	int output; 
+	int i, s; 
 	// Va to page used with IPC calls. 
 	char * pci_pg = (char *) REQVA; 
 	size_t size = 0; 
@@ -52,10 +89,12 @@ input(envid_t ns_envid)
 				break; 
 			}
 			else if (r == -E_RX_BUFF_FULL) {
-				// Receive buffer is currently full. 
+				// Receive ring is currently empty. 
+				// Let the driver decide between polling again (packets are streaming in) and sleeping until a receive interrupt. 
 				// TODO: Debug
 				//cprintf("No data in NIC Buffer. Re-try. \n");
-				sys_yield(); 
+				if ((r = sys_net_rx_wait()) < 0)
+					panic("Error in net/input.c. Issue with sys_net_rx_wait. (%e) \n", r);
 				continue; 
 			} else if (r < 0) {
 				panic("Error in net/input.c. Issue with sys_transmit_packet. (%e) \n", r);
@@ -82,7 +121,12 @@ input(envid_t ns_envid)
 		/* Successfully Received packet from System Call */
 		// ipc_send puts sys_ipc_send into a while loop to continue to send data until it succeeds. 
 		// Blocks until succeeds or fails
-		ipc_send(ns_envid, NSREQ_INPUT, pci_pg, PTE_U | PTE_P); 
+		// The shards only read the page, so one that goes to all of them can be the same page. 
+		if ((s = pkt_shard((uint8_t *) net_pg, size, nshards)) >= 0)
+			ipc_send(shards[s], NSREQ_INPUT, pci_pg, PTE_U | PTE_P); 
+		else
+			for (i = 0; i < nshards; i++)
+				ipc_send(shards[i], NSREQ_INPUT, pci_pg, PTE_U | PTE_P); 
 		
 		// By 'sending' the page, two environments hold va to the same physical page. 
 		// We need to unmap the va in this env to ensure there is no race conditions. 
@@ -522,7 +522,12 @@ ip_output_if(struct pbuf *p, struct ip_addr *src, struct ip_addr *dest,
 
 #if IP_FRAG
   /* don't fragment if interface has mtu set to 0 [loopif] */
-  if (netif->mtu && (p->tot_len > netif->mtu))
+  if (netif->mtu && (p->tot_len > netif->mtu)
+#if TCP_TSO
+      /* the netif segments large TCP segments itself */
+      && !((netif->flags & NETIF_FLAG_TSO) && IPH_PROTO(iphdr) == IP_PROTO_TCP)
+#endif /* TCP_TSO */
+      )
     return ip_frag(p,netif,dest);
 #endif
 
@@ -450,6 +450,11 @@ tcp_new_port(void)
   if (++port > TCP_LOCAL_PORT_RANGE_END) {
     port = TCP_LOCAL_PORT_RANGE_START;
   }
+#ifdef TCP_LOCAL_PORT_OK
+  if (!TCP_LOCAL_PORT_OK(port)) {
+    goto again;
+  }
+#endif
   
   for(pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next) {
     if (pcb->local_port == port) {
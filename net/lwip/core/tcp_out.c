@@ -58,6 +58,10 @@
 
 /* Forward declarations.*/
 static void tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb);
+#if TCP_TSO
+static u16_t tcp_tso_batch(struct tcp_pcb *pcb, struct tcp_seg *seg, u32_t wnd);
+static u16_t tcp_output_segment_tso(struct tcp_seg *seg, struct tcp_pcb *pcb, u16_t nfollow);
+#endif /* TCP_TSO */
 
 /**
  * Called by tcp_close() to send a segment including flags but not data.
@@ -414,6 +418,11 @@ tcp_output(struct tcp_pcb *pcb)
   struct tcp_hdr *tcphdr;
   struct tcp_seg *seg, *useg;
   u32_t wnd;
+#if TCP_TSO
+  /* number of segments at the head of unsent that already went out as
+     part of an offloaded send */
+  u16_t tso_left = 0;
+#endif /* TCP_TSO */
 #if TCP_CWND_DEBUG
   s16_t i = 0;
 #endif /* TCP_CWND_DEBUG */
@@ -522,7 +531,11 @@ tcp_output(struct tcp_pcb *pcb)
      *   either seg->next != NULL or pcb->unacked == NULL;
      *   RST is no sent using tcp_enqueue/tcp_output.
      */
-    if((tcp_do_output_nagle(pcb) == 0) &&
+    if(
+#if TCP_TSO
+       (tso_left == 0) &&
+#endif /* TCP_TSO */
+       (tcp_do_output_nagle(pcb) == 0) &&
       ((pcb->flags & (TF_NAGLEMEMERR | TF_FIN)) == 0)){
       break;
     }
@@ -542,7 +555,17 @@ tcp_output(struct tcp_pcb *pcb)
       pcb->flags &= ~(TF_ACK_DELAY | TF_ACK_NOW);
     }
 
-    tcp_output_segment(seg, pcb);
+#if TCP_TSO
+    if (tso_left > 0) {
+      /* already on the wire as part of the previous offloaded send */
+      tso_left--;
+    } else if ((tso_left = tcp_tso_batch(pcb, seg, wnd)) > 0) {
+      tso_left = tcp_output_segment_tso(seg, pcb, tso_left);
+    } else
+#endif /* TCP_TSO */
+    {
+      tcp_output_segment(seg, pcb);
+    }
     pcb->snd_nxt = ntohl(seg->tcphdr->seqno) + TCP_TCPLEN(seg);
     if (TCP_SEQ_LT(pcb->snd_max, pcb->snd_nxt)) {
       pcb->snd_max = pcb->snd_nxt;
@@ -655,17 +678,218 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
     netif = ip_route(&pcb->remote_ip);
     if(netif != NULL){
       netif->addr_hint = &(pcb->addr_hint);
+      netif->tx_retained = 1;
       ip_output_if(seg->p, &(pcb->local_ip), &(pcb->remote_ip), pcb->ttl,
                    pcb->tos, IP_PROTO_TCP, netif);
+      netif->tx_retained = 0;
       netif->addr_hint = NULL;
     }
   }
 #else /* LWIP_NETIF_HWADDRHINT*/
-  ip_output(seg->p, &(pcb->local_ip), &(pcb->remote_ip), pcb->ttl, pcb->tos,
-      IP_PROTO_TCP);
+  netif = ip_route(&(pcb->remote_ip));
+  if (netif != NULL) {
+    /* seg stays on the unacked queue, untouched until it is acknowledged
+       (a retransmission only rewrites the headers) */
+    netif->tx_retained = 1;
+    ip_output_if(seg->p, &(pcb->local_ip), &(pcb->remote_ip), pcb->ttl,
+                 pcb->tos, IP_PROTO_TCP, netif);
+    netif->tx_retained = 0;
+  }
 #endif /* LWIP_NETIF_HWADDRHINT*/
 }
 
+#if TCP_TSO
+/**
+ * Called by tcp_output() to find out how many of the unsent segments
+ * following seg can go out together with seg in one offloaded send.
+ *
+ * Only plain data segments are merged, the run must fit in the send
+ * window and must not send anything the nagle algorithm would hold back.
+ *
+ * @param pcb the tcp_pcb for the TCP connection
+ * @param seg the first segment of the run (already removed from unsent)
+ * @param wnd the current send window
+ * @return the number of segments after seg to send with it (0: send alone)
+ */
+static u16_t
+tcp_tso_batch(struct tcp_pcb *pcb, struct tcp_seg *seg, u32_t wnd)
+{
+  struct netif *netif;
+  struct tcp_seg *next;
+  u32_t total;
+  u16_t nfollow, npbufs;
+
+  if (pcb->state == SYN_SENT || seg->len == 0 ||
+      (TCPH_FLAGS(seg->tcphdr) & (TCP_SYN | TCP_FIN | TCP_RST)) != 0) {
+    return 0;
+  }
+  netif = ip_route(&(pcb->remote_ip));
+  if (netif == NULL || (netif->flags & NETIF_FLAG_TSO) == 0) {
+    return 0;
+  }
+
+  total = seg->len;
+  npbufs = pbuf_clen(seg->p);
+  nfollow = 0;
+  for (next = seg->next; next != NULL && nfollow + 1 < TCP_TSO_MAX_SEGS;
+       next = next->next) {
+    if (next->len == 0 ||
+        (TCPH_FLAGS(next->tcphdr) & (TCP_SYN | TCP_FIN | TCP_RST)) != 0) {
+      break;
+    }
+    if (ntohl(next->tcphdr->seqno) - pcb->lastack + next->len > wnd) {
+      break;
+    }
+    /* a trailing short segment is left to the nagle check in tcp_output */
+    if (next->next == NULL && next->len < pcb->mss &&
+        (pcb->flags & (TF_NODELAY | TF_NAGLEMEMERR | TF_FIN)) == 0) {
+      break;
+    }
+    if (npbufs + pbuf_clen(next->p) > TCP_TSO_MAX_PBUFS) {
+      break;
+    }
+    total += next->len;
+    npbufs += pbuf_clen(next->p);
+    nfollow++;
+  }
+
+  /* nothing to gain if the run fits in a single frame anyway */
+  if (total <= pcb->mss) {
+    return 0;
+  }
+  return nfollow;
+}
+
+/**
+ * Called by tcp_output() to send seg and the nfollow segments after it
+ * on the unsent queue as one large TCP segment. The network interface
+ * cuts it back into frames of at most pcb->mss bytes (TCP segmentation
+ * offload) and computes the checksums.
+ *
+ * The data of the following segments is referenced (PBUF_REF), not
+ * copied, and the segments themselves stay untouched so that they can be
+ * retransmitted one by one.
+ *
+ * @param seg the first segment to send (its header is used for the run)
+ * @param pcb the tcp_pcb for the TCP connection
+ * @param nfollow number of unsent segments after seg to send with it
+ * @return the number of following segments that were actually sent
+ */
+static u16_t
+tcp_output_segment_tso(struct tcp_seg *seg, struct tcp_pcb *pcb, u16_t nfollow)
+{
+  struct netif *netif;
+  struct tcp_seg *next;
+  struct pbuf *extra, *q, *r, *last;
+  u16_t len, sent, off;
+
+  netif = ip_route(&(pcb->remote_ip));
+  if (netif == NULL) {
+    tcp_output_segment(seg, pcb);
+    return 0;
+  }
+
+  /* Reference the data of the following segments (without their TCP
+     headers) in a chain of PBUF_REF pbufs. */
+  extra = NULL;
+  sent = 0;
+  for (next = seg->next; sent < nfollow; next = next->next) {
+    struct pbuf *chain = NULL;
+
+    off = (u16_t)(((u8_t *)next->tcphdr + TCPH_HDRLEN(next->tcphdr) * 4) -
+                  (u8_t *)next->p->payload);
+    for (q = next->p; q != NULL; q = q->next) {
+      if (off >= q->len) {
+        off -= q->len;
+        continue;
+      }
+      if ((r = pbuf_alloc(PBUF_RAW, q->len - off, PBUF_REF)) == NULL) {
+        break;
+      }
+      r->payload = (u8_t *)q->payload + off;
+      off = 0;
+      if (chain == NULL) {
+        chain = r;
+      } else {
+        pbuf_cat(chain, r);
+      }
+    }
+    if (q != NULL || chain == NULL || chain->tot_len != next->len) {
+      /* out of pbufs: send what we have so far */
+      if (chain != NULL) {
+        pbuf_free(chain);
+      }
+      break;
+    }
+    if (extra == NULL) {
+      extra = chain;
+    } else {
+      pbuf_cat(extra, chain);
+    }
+    sent++;
+  }
+
+  if (extra == NULL) {
+    tcp_output_segment(seg, pcb);
+    return 0;
+  }
+
+  snmp_inc_tcpoutsegs();
+
+  /* Same header preparation as tcp_output_segment() */
+  seg->tcphdr->ackno = htonl(pcb->rcv_nxt);
+  seg->tcphdr->wnd = htons(pcb->rcv_ann_wnd);
+  if (ip_addr_isany(&(pcb->local_ip))) {
+    ip_addr_set(&(pcb->local_ip), &(netif->ip_addr));
+  }
+  if(pcb->rtime == -1)
+    pcb->rtime = 0;
+  if (pcb->rttest == 0) {
+    pcb->rttest = tcp_ticks;
+    pcb->rtseq = ntohl(seg->tcphdr->seqno);
+  }
+  LWIP_DEBUGF(TCP_OUTPUT_DEBUG, ("tcp_output_segment_tso: %"U32_F":%"U32_F" (%"U16_F" segments)\n",
+          htonl(seg->tcphdr->seqno), htonl(seg->tcphdr->seqno) +
+          seg->len + extra->tot_len, sent + 1));
+
+  len = (u16_t)((u8_t *)seg->tcphdr - (u8_t *)seg->p->payload);
+  seg->p->len -= len;
+  seg->p->tot_len -= len;
+  seg->p->payload = seg->tcphdr;
+
+  /* Temporarily append the data of the following segments. */
+  for (last = seg->p; last->next != NULL; last = last->next);
+  len = extra->tot_len;
+  pbuf_cat(seg->p, extra);
+
+  /* The netif computes the checksum of every frame it cuts out. */
+  seg->tcphdr->chksum = 0;
+  TCP_STATS_INC(tcp.xmit);
+
+  netif->tso_mss = pcb->mss;
+  netif->tx_retained = 1;
+#if LWIP_NETIF_HWADDRHINT
+  netif->addr_hint = &(pcb->addr_hint);
+#endif /* LWIP_NETIF_HWADDRHINT*/
+  ip_output_if(seg->p, &(pcb->local_ip), &(pcb->remote_ip), pcb->ttl,
+               pcb->tos, IP_PROTO_TCP, netif);
+#if LWIP_NETIF_HWADDRHINT
+  netif->addr_hint = NULL;
+#endif /* LWIP_NETIF_HWADDRHINT*/
+  netif->tso_mss = 0;
+  netif->tx_retained = 0;
+
+  /* Detach the borrowed data again, so seg is as tcp_enqueue() built it. */
+  for (q = seg->p; q != extra; q = q->next) {
+    q->tot_len -= len;
+  }
+  last->next = NULL;
+  pbuf_free(extra);
+
+  return sent;
+}
+#endif /* TCP_TSO */
+
 /**
  * Send a TCP RESET packet (empty segment with RST flag set) either to
  * abort a connection or to show that there is no matching local connection
@@ -80,6 +80,8 @@ extern "C" {
 #define NETIF_FLAG_ETHARP       0x20U
 /** if set, the netif has IGMP capability */
 #define NETIF_FLAG_IGMP         0x40U
+/** if set, the netif can segment large TCP segments itself (see TCP_TSO) */
+#define NETIF_FLAG_TSO          0x80U
 
 /** Generic data structure used for all lwIP network interfaces.
  *  The following fields should be filled in by the initialization
@@ -167,6 +169,15 @@ struct netif {
 #if LWIP_NETIF_HWADDRHINT
   u8_t *addr_hint;
 #endif /* LWIP_NETIF_HWADDRHINT */
+#if TCP_TSO
+  /** MSS to segment the packet being output with (set by tcp_output
+   *  around an offloaded send, 0 otherwise) */
+  u16_t tso_mss;
+#endif /* TCP_TSO */
+  /** Set by tcp_output around the send of a data segment: the packet
+   *  being output stays unchanged until the peer acknowledges it, so
+   *  the netif may transmit it without copying */
+  u8_t tx_retained;
 #if ENABLE_LOOPBACK
   /* List of packets to be queued for ourselves. */
   struct pbuf *loop_first;
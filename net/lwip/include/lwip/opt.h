@@ -725,6 +725,30 @@
 #define TCP_SND_QUEUELEN                (4 * (TCP_SND_BUF/TCP_MSS))
 #endif
 
+/**
+ * TCP_TSO==1: Hand runs of consecutive unsent segments down to netifs with
+ * NETIF_FLAG_TSO set as a single large segment, and let the network
+ * interface cut it into MSS sized frames (TCP segmentation offload).
+ */
+#ifndef TCP_TSO
+#define TCP_TSO                         0
+#endif
+
+/**
+ * TCP_TSO_MAX_SEGS: Maximum number of segments sent in one offloaded send.
+ */
+#ifndef TCP_TSO_MAX_SEGS
+#define TCP_TSO_MAX_SEGS                8
+#endif
+
+/**
+ * TCP_TSO_MAX_PBUFS: Maximum number of pbufs in the chain of one offloaded
+ * send (bounded by the scatter-gather capability of the netif).
+ */
+#ifndef TCP_TSO_MAX_PBUFS
+#define TCP_TSO_MAX_PBUFS               (2 * TCP_TSO_MAX_SEGS)
+#endif
+
 /**
  * TCP_SNDLOWAT: TCP writable space (bytes). This must be less than or equal
  * to TCP_SND_BUF. It is the amount of space which must be available in the
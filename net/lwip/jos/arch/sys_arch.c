@@ -9,8 +9,10 @@
 
 #define debug 0
 
-#define NSEM		256
-#define NMBOX		128
+// Every netconn holds a semaphore and a mailbox (which holds two
+// semaphores), plus what the threads and timers need.
+#define NSEM		(3 * MEMP_NUM_NETCONN + 256)
+#define NMBOX		(MEMP_NUM_NETCONN + 128)
 #define MBOXSLOTS	32
 
 struct sys_sem_entry {
@@ -45,6 +47,10 @@ struct sys_thread {
     LIST_ENTRY(sys_thread) link;
 };
 
+// Shard of the network server this stack runs in (see TCP_LOCAL_PORT_OK)
+int lwip_port_shard = 0;
+int lwip_port_nshards = 1;
+
 enum { thread_hash_size = 257 };
 static LIST_HEAD(thread_list, sys_thread) threads[thread_hash_size];
 
@@ -42,10 +42,16 @@
 #include "lwip/sys.h"
 #include <lwip/stats.h>
 
+#include "lwip/ip.h"
+#include "lwip/tcp.h"
+
 #include <netif/etharp.h>
 
 #define PKTMAP		0x10000000
 
+/* Largest frame we can send without segmentation offload */
+#define JIF_FRAME_MAX	(sizeof(struct eth_hdr) + 1500)
+
 struct jif {
     struct eth_addr *ethaddr;
     envid_t envid;
@@ -59,6 +65,11 @@ low_level_init(struct netif *netif)
     netif->hwaddr_len = 6;
     netif->mtu = 1500;
     netif->flags = NETIF_FLAG_BROADCAST;
+#if TCP_TSO
+    netif->flags |= NETIF_FLAG_TSO;
+    netif->tso_mss = 0;
+#endif
+    netif->tx_retained = 0;
     
 	// Get mac address from EEPROM 
 	char mac_addr[6];
@@ -73,6 +84,56 @@ low_level_init(struct netif *netif)
     netif->hwaddr[5] = mac_addr[5];
 }
 
+#if TCP_TSO
+/*
+ * low_level_output_tso():
+ *
+ * Transmit a TCP segment larger than a frame (built by tcp_output for
+ * a NETIF_FLAG_TSO interface). The E1000 cuts it into frames of
+ * netif->tso_mss payload bytes.
+ */
+static err_t
+low_level_output_tso(struct netif *netif, struct pbuf *p)
+{
+    struct TxSeg segs[E1000_TSO_MAX_SEGS];
+    int nsegs = 0;
+    struct pbuf *q;
+    u32_t flags = netif->tx_retained ? TXSEG_NOCOPY : 0;
+
+    /* tcp_output builds all headers in the first pbuf */
+    struct ip_hdr *iphdr = (struct ip_hdr *)((u8_t *)p->payload + sizeof(struct eth_hdr));
+    struct tcp_hdr *tcphdr = (struct tcp_hdr *)((u8_t *)iphdr + IPH_HL(iphdr) * 4);
+    size_t hdrlen = sizeof(struct eth_hdr) + IPH_HL(iphdr) * 4 + TCPH_HDRLEN(tcphdr) * 4;
+    if (IPH_PROTO(iphdr) != IP_PROTO_TCP || p->len < hdrlen)
+	panic("jif: oversized non-TCP packet, len %d", p->tot_len);
+
+    /* A packet queued by etharp may come back as one big pbuf, so cut
+       fragments to the page sized transmit buffers. */
+    for (q = p; q != NULL; q = q->next) {
+	u16_t off;
+	for (off = 0; off < q->len; off += PGSIZE) {
+	    if (nsegs == E1000_TSO_MAX_SEGS)
+		panic("jif: too many fragments for TSO");
+	    segs[nsegs].ts_addr = (u8_t *)q->payload + off;
+	    segs[nsegs].ts_len = MIN(q->len - off, PGSIZE);
+	    segs[nsegs].ts_flags = flags;
+	    nsegs++;
+	}
+    }
+
+    /* Packets re-sent from the etharp queue no longer carry the MSS
+       (nor tx_retained: the queue holds a copy, freed once sent) */
+    size_t mss = netif->tso_mss ? netif->tso_mss : TCP_MSS;
+
+    int r;
+    while ((r = sys_transmit_tso(segs, nsegs, hdrlen, mss)) == -E_TX_BUFF_FULL)
+	sys_yield();
+    if (r < 0)
+	panic("jif: sys_transmit_tso: %e", r);
+    return ERR_OK;
+}
+#endif
+
 /*
  * low_level_output():
  *
@@ -84,6 +145,42 @@ low_level_init(struct netif *netif)
 static err_t
 low_level_output(struct netif *netif, struct pbuf *p)
 {
+#if TCP_TSO
+    if (p->tot_len > JIF_FRAME_MAX)
+	return low_level_output_tso(netif, p);
+#endif
+
+    /* Fast path: hand the pbuf chain straight to the driver as a
+     * scatter-gather list, one descriptor per pbuf. This avoids
+     * coalescing the chain into a page and the IPC round trip to the
+     * output environment. TCP data stays put until it is acknowledged
+     * (netif->tx_retained), so the E1000 may read it in place. */
+    struct TxSeg segs[E1000_TX_MAX_SEGS];
+    int nsegs = 0;
+    struct pbuf *q;
+    u32_t flags = netif->tx_retained ? TXSEG_NOCOPY : 0;
+    for (q = p; q != NULL; q = q->next) {
+	if (q->len == 0)
+	    continue;
+	if (nsegs == E1000_TX_MAX_SEGS)
+	    break;
+	segs[nsegs].ts_addr = q->payload;
+	segs[nsegs].ts_len = q->len;
+	segs[nsegs].ts_flags = flags;
+	nsegs++;
+    }
+
+    if (q == NULL && nsegs > 0) {
+	int r;
+	while ((r = sys_transmit_sg(segs, nsegs)) == -E_TX_BUFF_FULL)
+	    sys_yield();
+	if (r < 0)
+	    panic("jif: sys_transmit_sg: %e", r);
+	return ERR_OK;
+    }
+
+    /* Too many fragments: linearize the chain and let the output
+     * environment transmit it. */
     int r = sys_page_alloc(0, (void *)PKTMAP, PTE_U|PTE_W|PTE_P);
     if (r < 0)
 	panic("jif: could not allocate page of memory");
@@ -94,7 +191,6 @@ low_level_output(struct netif *netif, struct pbuf *p)
 
     char *txbuf = pkt->jp_data;
     int txsize = 0;
-    struct pbuf *q;
     for (q = p; q != NULL; q = q->next) {
 	/* Send the data from the pbuf to the interface, one pbuf at a
 	   time. The size of the data in each pbuf is kept in the ->len
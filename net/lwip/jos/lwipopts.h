@@ -24,11 +24,13 @@ void *memcpy(void *dst, const void *src, size_t n);
 
 #define MEMP_NUM_PBUF		64
 #define MEMP_NUM_UDP_PCB	8
-#define MEMP_NUM_TCP_PCB	32
+// Sockets and TCP connections: enough for a thousand concurrent clients
+// (see MAXFD in lib/fd.c and NSPOLL_MAX in inc/ns.h)
+#define MEMP_NUM_TCP_PCB	1024
 #define MEMP_NUM_TCP_PCB_LISTEN	16
 #define MEMP_NUM_TCP_SEG	TCP_SND_QUEUELEN// at least as big as TCP_SND_QUEUELEN
 #define MEMP_NUM_NETBUF		128
-#define MEMP_NUM_NETCONN	32
+#define MEMP_NUM_NETCONN	1024
 #define MEMP_NUM_SYS_TIMEOUT    6
 
 #define PER_TCP_PCB_BUFFER	(16 * 4096)
@@ -44,6 +46,18 @@ void *memcpy(void *dst, const void *src, size_t n);
 // but 16 is faster.. 
 #define TCP_SND_QUEUELEN	(2 * TCP_SND_BUF/TCP_MSS)
 //#define TCP_SND_QUEUELEN	16
+// The network server runs several lwIP stacks behind one IP address
+// (shards, see net/serv.c).  Shard s only picks local ports p with
+// p % nshards == s, so that the input environment can tell which shard
+// a packet for a connection it made belongs to (see ns_tcp_shard).
+extern int lwip_port_shard, lwip_port_nshards;
+#define TCP_LOCAL_PORT_RANGE_START	4096
+#define TCP_LOCAL_PORT_RANGE_END	0x7fff
+#define TCP_LOCAL_PORT_OK(port)		((port) % lwip_port_nshards == lwip_port_shard)
+
+// Let the E1000 segment runs of up to 8 MSS sized segments (see jif.c)
+#define TCP_TSO			1
+#define TCP_TSO_MAX_SEGS	8
 
 // Print error messages when we run out of memory
 #define LWIP_DEBUG	1
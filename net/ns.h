@@ -8,14 +8,19 @@
 #define TIMER_INTERVAL 250
 
 // Virtual address at which to receive page mappings containing client requests.
-#define QUEUE_SIZE	20
-#define REQVA		(0x0ffff000 - QUEUE_SIZE * PGSIZE)
+// The request queue grows on demand, one page of address space per slot (only mapped while a request is served), 
+// up to REQLIM: far more requests than lwIP has sockets or threads for. 
+// The queue sits above the malloc heap (which ends at 0x10000000, see lib/malloc.c) and jif's PKTMAP page, 
+// since the server mallocs its thread stacks while requests are mapped. 
+#define REQVA		0x10001000
+#define REQLIM		0x20000000
 
 /* timer.c */
 void timer(envid_t ns_envid, uint32_t initial_to);
 
 /* input.c */
 void input(envid_t ns_envid);
+void input_shards(const envid_t *shards, int nshards);
 
 /* output.c */
 void output(envid_t ns_envid);
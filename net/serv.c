@@ -47,33 +47,78 @@ static envid_t timer_envid;
 static envid_t input_envid;
 static envid_t output_envid;
 
-static bool buse[QUEUE_SIZE];
-static int next_i(int i) { return (i+1) % QUEUE_SIZE; }
-static int prev_i(int i) { return (i ? i-1 : QUEUE_SIZE-1); }
+// Shards (see inc/ns.h): each runs its own lwIP stack in its own environment, behind the same IP address. 
+// The input env hands each packet to the shard of its connection (see input.c). 
+// shard is this environment's number; shard 0 also keeps the environments of all of them. 
+static int shard;
+static int nshards;
+static envid_t shard_envs[NS_MAXSHARDS];
+
+// Request queue: a stack of free slots, plus the number of slots handed out so far (the queue only grows when all of them are busy). 
+// The stack grows along with the queue. 
+static uint32_t *free_slots;
+static int free_cap;
+static int nfree;
+static int queue_len;
+// Requests in flight.
+static int queue_busy;
+// Requests turned away because the queue could not grow.
+static uint32_t queue_overflows;
+
+// Add a slot to the queue, making room for it in the free slot stack. 
+// Returns false if the queue reached REQLIM or there is no memory. 
+static bool
+queue_grow(void) {
+	uint32_t *slots;
+	int cap;
+
+	if (REQVA + (queue_len + 1) * PGSIZE > REQLIM)
+		return 0;
+	if (queue_len == free_cap) {
+		cap = free_cap ? 2 * free_cap : 64;
+		if (!(slots = realloc(free_slots, cap * sizeof(*slots))))
+			return 0;
+		free_slots = slots;
+		free_cap = cap;
+	}
+	queue_len++;
+	return 1;
+}
 
+// Returns a free request page, or 0 if the queue is full. 
 static void *
 get_buffer(void) {
-	void *va;
-
 	int i;
-	for (i = 0; i < QUEUE_SIZE; i++)
-		if (!buse[i]) break;
 
-	if (i == QUEUE_SIZE) {
-		panic("NS: buffer overflow");
+	if (nfree > 0)
+		i = free_slots[--nfree];
+	else if (queue_grow())
+		i = queue_len - 1;
+	else
 		return 0;
-	}
 
-	va = (void *)(REQVA + i * PGSIZE);
-	buse[i] = 1;
+	queue_busy++;
 
-	return va;
+	return (void *)(REQVA + i * PGSIZE);
 }
 
 static void
 put_buffer(void *va) {
 	int i = ((uint32_t)va - REQVA) / PGSIZE;
-	buse[i] = 0;
+	free_slots[nfree++] = i;
+	queue_busy--;
+}
+
+// Called instead of blocking the client forever when the queue can't grow. 
+// Packets from the input env are dropped (TCP will retransmit), clients are told to retry. 
+static void
+queue_full(int32_t reqno, envid_t whom) {
+	queue_overflows++;
+	if (debug)
+		cprintf("NS: request queue full (%d busy, %u overflows), dropping req %d from %08x\n",
+			queue_busy, queue_overflows, reqno, whom);
+	if (reqno != NSREQ_INPUT)
+		ipc_send(whom, -E_NO_MEM, 0, 0);
 }
 
 static void
@@ -149,15 +194,17 @@ serve_init(uint32_t ipaddr, uint32_t netmask, uint32_t gw)
 	start_timer(&t_tcps, &tcp_slowtmr, "tcp s timer", TCP_SLOW_INTERVAL);
 
 	struct in_addr ia = {ipaddr};
-	cprintf("ns: %02x:%02x:%02x:%02x:%02x:%02x"
-		" bound to static IP %s\n",
-		nif.hwaddr[0], nif.hwaddr[1], nif.hwaddr[2],
-		nif.hwaddr[3], nif.hwaddr[4], nif.hwaddr[5],
-		inet_ntoa(ia));
+	if (shard == 0)
+		cprintf("ns: %02x:%02x:%02x:%02x:%02x:%02x"
+			" bound to static IP %s\n",
+			nif.hwaddr[0], nif.hwaddr[1], nif.hwaddr[2],
+			nif.hwaddr[3], nif.hwaddr[4], nif.hwaddr[5],
+			inet_ntoa(ia));
 
 	lwip_core_unlock();
 
-	cprintf("NS: TCP/IP initialized.\n");
+	if (shard == 0)
+		cprintf("NS: TCP/IP initialized.\n");
 }
 
 static void
@@ -177,6 +224,63 @@ process_timer(envid_t envid) {
 	ipc_send(envid, to, 0, 0);
 }
 
+// Wait (in this thread) until one of the sockets in 'req' is ready or the timeout expires. 
+// lwip_select wakes us from its socket event callback, so the client gets readiness notification without polling. 
+static int
+serve_poll(struct Nsreq_poll *req)
+{
+	fd_set rset, wset;
+	struct timeval tv;
+	int i, s, r, maxfdp1 = 0, nready = 0;
+
+	if (req->req_nfds < 0 || req->req_nfds > NSPOLL_MAX)
+		return -E_INVAL;
+
+	FD_ZERO(&rset);
+	FD_ZERO(&wset);
+	for (i = 0; i < req->req_nfds; i++) {
+		s = req->req_fds[i].fd;
+		req->req_fds[i].revents = 0;
+		if (s < 0 || s >= FD_SETSIZE) {
+			req->req_fds[i].revents = POLLNVAL;
+			nready++;
+			continue;
+		}
+		if (req->req_fds[i].events & POLLIN)
+			FD_SET(s, &rset);
+		if (req->req_fds[i].events & POLLOUT)
+			FD_SET(s, &wset);
+		if (s >= maxfdp1)
+			maxfdp1 = s + 1;
+	}
+
+	// Don't block if there is already something to report. 
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	if (!nready && req->req_timeout > 0) {
+		tv.tv_sec = req->req_timeout / 1000;
+		tv.tv_usec = (req->req_timeout % 1000) * 1000;
+	}
+	// lwIP reports errors as -1 (with errno); poll() callers expect a JOS error code. 
+	r = lwip_select(maxfdp1, &rset, &wset, 0,
+			(!nready && req->req_timeout < 0) ? 0 : &tv);
+	if (r < 0)
+		return -E_INVAL;
+
+	for (i = 0; i < req->req_nfds; i++) {
+		s = req->req_fds[i].fd;
+		if (s < 0 || s >= FD_SETSIZE)
+			continue;
+		if (FD_ISSET(s, &rset))
+			req->req_fds[i].revents |= POLLIN;
+		if (FD_ISSET(s, &wset))
+			req->req_fds[i].revents |= POLLOUT;
+		if (req->req_fds[i].revents)
+			nready++;
+	}
+	return nready;
+}
+
 struct st_args {
 	int32_t reqno;
 	uint32_t whom;
@@ -230,6 +334,18 @@ serve_thread(uint32_t a) {
 		r = lwip_socket(req->socket.req_domain, req->socket.req_type,
 				req->socket.req_protocol);
 		break;
+	case NSREQ_POLL:
+		r = serve_poll(&req->poll);
+		break;
+	case NSREQ_SHARDS:
+		// Only shard 0 knows all of them.
+		if (shard != 0) {
+			r = -E_INVAL;
+			break;
+		}
+		memmove(req->shardsRet.ret_shards, shard_envs, sizeof(shard_envs));
+		r = nshards;
+		break;
 	case NSREQ_INPUT:
 		jif_input(&nif, (void *)&req->pkt);
 		r = 0;
@@ -270,7 +386,8 @@ serve(void) {
 
 		perm = 0;
 		va = get_buffer();
-		reqno = ipc_recv((int32_t *) &whom, (void *) va, &perm);
+		// If the queue is full, still receive (without a page) so the timer and input envs never block on us. 
+		reqno = ipc_recv((int32_t *) &whom, va, &perm);
 		if (debug) {
 			cprintf("ns req %d from %08x\n", reqno, whom);
 		}
@@ -278,13 +395,20 @@ serve(void) {
 		// first take care of requests that do not contain an argument page
 		if (reqno == NSREQ_TIMER) {
 			process_timer(whom);
-			put_buffer(va);
+			if (va)
+				put_buffer(va);
+			continue;
+		}
+
+		if (!va) {
+			queue_full(reqno, whom);
 			continue;
 		}
 
 		// All remaining requests must contain an argument page
 		if (!(perm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n", whom);
+			put_buffer(va);
 			continue; // just leave it hanging...
 		}
 
@@ -298,7 +422,14 @@ serve(void) {
 		args->whom = whom;
 		args->req = va;
 
-		thread_create(0, "serve_thread", serve_thread, (uint32_t)args);
+		if (thread_create(0, "serve_thread", serve_thread, (uint32_t)args) < 0) {
+			// Out of memory for thread stacks: same as a full queue. 
+			free(args);
+			sys_page_unmap(0, va);
+			put_buffer(va);
+			queue_full(reqno, whom);
+			continue;
+		}
 		thread_yield(); // let the thread created run
 	}
 }
@@ -315,10 +446,38 @@ void
 umain(int argc, char **argv)
 {
 	envid_t ns_envid = sys_getenvid();
+	int i, r;
 
 	binaryname = "ns";
 
-	// fork off the timer thread which will send us periodic messages
+	// fork off the output thread that will send the packets to the NIC
+	// driver (all shards share it)
+	output_envid = fork();
+	if (output_envid < 0)
+		panic("error forking");
+	else if (output_envid == 0) {
+		output(ns_envid);
+		return;
+	}
+
+	// fork off the other shards, one per CPU: copies of this environment
+	// that each run their own lwIP stack from here on
+	nshards = MIN(MAX(sys_ncpu(), 1), NS_MAXSHARDS);
+	shard_envs[0] = ns_envid;
+	for (i = 1; i < nshards; i++) {
+		if ((r = fork()) < 0)
+			panic("error forking");
+		else if (r == 0) {
+			shard = i;
+			ns_envid = sys_getenvid();
+			break;
+		}
+		shard_envs[i] = r;
+	}
+	lwip_port_shard = shard;
+	lwip_port_nshards = nshards;
+
+	// fork off the timer thread which will send us (this shard) periodic messages
 	timer_envid = fork();
 	if (timer_envid < 0)
 		panic("error forking");
@@ -328,23 +487,15 @@ umain(int argc, char **argv)
 	}
 
 	// fork off the input thread which will poll the NIC driver for input
-	// packets
-	input_envid = fork();
-	if (input_envid < 0)
-		panic("error forking");
-	else if (input_envid == 0) {
-		input(ns_envid);
-		return;
-	}
-
-	// fork off the output thread that will send the packets to the NIC
-	// driver
-	output_envid = fork();
-	if (output_envid < 0)
-		panic("error forking");
-	else if (output_envid == 0) {
-		output(ns_envid);
-		return;
+	// packets, once all shards exist
+	if (shard == 0) {
+		input_envid = fork();
+		if (input_envid < 0)
+			panic("error forking");
+		else if (input_envid == 0) {
+			input_shards(shard_envs, nshards);
+			return;
+		}
 	}
 
 	// lwIP requires a user threading library; start the library and jump
@@ -1,5 +1,8 @@
 #include "ns.h"
 
+// Nobody changes or wakes this: the timer sleeps on it with a timeout.
+static uint32_t timer_sleep_word;
+
 void
 timer(envid_t ns_envid, uint32_t initial_to) {
 	int r;
@@ -9,7 +12,10 @@ timer(envid_t ns_envid, uint32_t initial_to) {
 
 	while (1) {
 		while((r = sys_time_msec()) < stop && r >= 0) {
-			sys_yield();
+			// Sleep instead of spinning on sys_yield (the wait may
+			// end early, hence the loop).
+			if (sys_futex_wait(&timer_sleep_word, 0, stop - r) < 0)
+				sys_yield();
 		}
 		if (r < 0)
 			panic("sys_time_msec: %e", r);
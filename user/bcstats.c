@@ -0,0 +1,21 @@
+#include <inc/lib.h>
+
+// Print the file server's block cache counters (used to size BC_MAXBLOCKS in fs/fs.h).
+void
+umain(int argc, char **argv)
+{
+	struct BcStats st;
+	int r;
+
+	if ((r = fs_stats(&st)) < 0)
+		panic("fs_stats: %e", r);
+
+	cprintf("cached blocks:  %u / %u\n", st.bs_cached, st.bs_max);
+	cprintf("hits:           %u\n", st.bs_hits);
+	cprintf("misses:         %u\n", st.bs_misses);
+	cprintf("readahead:      %u\n", st.bs_readahead);
+	cprintf("evictions:      %u\n", st.bs_evictions);
+	cprintf("writebacks:     %u\n", st.bs_writebacks);
+	cprintf("name hits:      %u\n", st.bs_dhits);
+	cprintf("name misses:    %u\n", st.bs_dmisses);
+}
@@ -0,0 +1,111 @@
+// Concurrent-connection benchmark for httpd.
+//
+// Usage: httpbench <ip> <port> [nconns [rounds [url]]]
+//
+// Opens nconns connections to the web server at once, sends a GET on
+// each, and then uses poll() to read all the responses as they come in.
+// Repeats this 'rounds' times and reports the time taken.
+//
+// To benchmark the JOS httpd from inside JOS, start httpd in the
+// background and point httpbench at the QEMU gateway, which forwards
+// the host port (see 'make which-ports') back to JOS port 80:
+//	$ httpd &
+//	$ httpbench 10.0.2.2 <PORT80> 16
+
+#include <inc/lib.h>
+#include <lwip/sockets.h>
+#include <lwip/inet.h>
+
+#define MAXCONNS	1000	// Each connection holds an fd (see MAXFD)
+#define BUFFSIZE	512
+
+static void
+die(char *m)
+{
+	cprintf("%s\n", m);
+	exit();
+}
+
+// Runs one round. Returns the number of response bytes read.
+static int
+run_round(struct sockaddr_in *server, int nconns, const char *url)
+{
+	static struct pollfd pfds[MAXCONNS];
+	char req[128], buf[BUFFSIZE];
+	int i, r, nopen, total = 0;
+
+	snprintf(req, sizeof req, "GET %s HTTP/1.0\r\n\r\n", url);
+
+	// Open all the connections before reading any response, so the
+	// server has nconns clients in flight.
+	for (i = 0; i < nconns; i++) {
+		if ((pfds[i].fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+			die("Failed to create socket");
+		if (connect(pfds[i].fd, (struct sockaddr *) server, sizeof(*server)) < 0)
+			die("Failed to connect with server");
+		pfds[i].events = POLLIN;
+	}
+	for (i = 0; i < nconns; i++)
+		if (write(pfds[i].fd, req, strlen(req)) != strlen(req))
+			die("Mismatch in number of sent bytes");
+
+	// Collect the responses in whatever order they arrive.
+	for (nopen = nconns; nopen > 0; ) {
+		if ((r = poll(pfds, nconns, -1)) < 0)
+			die("Failed to poll");
+		for (i = 0; i < nconns; i++) {
+			if (pfds[i].fd < 0 || pfds[i].revents == 0)
+				continue;
+			if ((r = read(pfds[i].fd, buf, sizeof buf)) > 0) {
+				total += r;
+				continue;
+			}
+			// eof: the server closed the connection
+			close(pfds[i].fd);
+			pfds[i].fd = -1;
+			nopen--;
+		}
+	}
+	return total;
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct sockaddr_in server;
+	int nconns = 8, rounds = 4, i;
+	const char *url = "/index.html";
+	uint32_t start, ms;
+	uint64_t bytes = 0;
+
+	binaryname = "httpbench";
+
+	if (argc < 3)
+		die("usage: httpbench <ip> <port> [nconns [rounds [url]]]");
+	if (argc > 3)
+		nconns = strtol(argv[3], 0, 0);
+	if (argc > 4)
+		rounds = strtol(argv[4], 0, 0);
+	if (argc > 5)
+		url = argv[5];
+	if (nconns < 1 || nconns > MAXCONNS)
+		die("nconns out of range");
+
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_addr.s_addr = inet_addr(argv[1]);
+	server.sin_port = htons(strtol(argv[2], 0, 0));
+
+	cprintf("httpbench: %d rounds of %d concurrent GET %s\n", rounds, nconns, url);
+
+	start = sys_time_msec();
+	for (i = 0; i < rounds; i++)
+		bytes += run_round(&server, nconns, url);
+	ms = sys_time_msec() - start;
+
+	cprintf("httpbench: %d requests, %u bytes in %u ms", rounds * nconns,
+		(uint32_t) bytes, ms);
+	if (ms > 0)
+		cprintf(" (%u requests/sec)", rounds * nconns * 1000 / ms);
+	cprintf("\n");
+}
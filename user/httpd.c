@@ -12,11 +12,22 @@
 
 #define BUFFSIZE 512
 #define MAXPENDING 5	// Max connection requests
-
+#define MAXCLIENTS 1000	// Max accepted connections (each holds an fd, see MAXFD)
+#define SENDCHUNK 1460	// Bytes written per POLLOUT (one TCP segment)
+
+// A client connection. Its request is read once the socket is readable,
+// which builds the response headers in 'out'. The response is then sent
+// one chunk per POLLOUT: lwIP only reports POLLOUT while its send buffer
+// has room for more than TCP_SND_BUF/2 bytes, so no write blocks, and a
+// slow client does not hold up the others.
 struct http_request {
 	int sock;
 	char *url;
 	char *version;
+	int fd;			// File whose contents follow 'out' (-1: none)
+	char out[SENDCHUNK];	// Response bytes to send next
+	int outlen;		// Bytes in 'out'
+	int outoff;		// Bytes of 'out' already sent
 };
 
 struct responce_header {
@@ -52,6 +63,18 @@ req_free(struct http_request *req)
 {
 	free(req->url);
 	free(req->version);
+	req->url = req->version = 0;
+}
+
+// Queue 'len' bytes of response after what is already in req->out.
+static int
+send_out(struct http_request *req, const char *buf, int len)
+{
+	if (req->outlen + len > SENDCHUNK)
+		return -1;
+	memmove(req->out + req->outlen, buf, len);
+	req->outlen += len;
+	return 0;
 }
 
 static int
@@ -67,48 +90,41 @@ send_header(struct http_request *req, int code)
 	if (h->code == 0)
 		return -1;
 
-	int len = strlen(h->header);
-	if (write(req->sock, h->header, len) != len) {
-		die("Failed to send bytes to client");
-	}
-
-	return 0;
+	return send_out(req, h->header, strlen(h->header));
 }
 
+// Send the next chunk of the response: the rest of req->out, refilled
+// from the file once it has all been sent.
+// Returns 1 once the whole response is sent, 0 if there is more to send,
+// < 0 on error.
 static int
-send_data(struct http_request *req, int fd)
+send_data(struct http_request *req)
 {
-	// LAB 6: Your code here.
-	
-	// Get file info
-	struct Stat statbuf; 
 	int r;
-	if ((r = fstat(fd, &statbuf)) < 0) { 
-		panic("hhtpd.c in send_data(): error getting file data.");
-	}
-	
-	// Ensure the buffer is the size of the file. 
-	char buf[statbuf.st_size]; 
-	
-	// Send the data from the file over the socket in small packets
-	// Reasonable sized packets ensure that we don't run into PGSIZE file limit issues. 
-	// Also, each network packet is lilmited to slightly above 1500 bytes
-	int tot; 
-	int load = 1500; 
-	for (tot = 0; tot < statbuf.st_size; ) {
-
-		if ((r = 	read(fd, buf+tot, load)) < 0)
-			return -1; 
-	
 
-		if (write(req->sock, buf+tot, r) != r)
+	// LAB 6: Your code here.
+	
+	// Top up the chunk with file data, so the headers go out together
+	// with the start of the file.
+	if (req->outoff == req->outlen)
+		req->outoff = req->outlen = 0;
+	if (req->fd >= 0 && req->outlen < SENDCHUNK) {
+		if ((r = read(req->fd, req->out + req->outlen, SENDCHUNK - req->outlen)) < 0)
 			return -1;
-		
-		tot += r; 
-		
+		if (r == 0) {
+			close(req->fd);
+			req->fd = -1;
+		}
+		req->outlen += r;
 	}
+	if (req->outoff == req->outlen)
+		return 1;
 
-	return 0; 
+	// One write per POLLOUT; a short write is finished on the next one.
+	if ((r = write(req->sock, req->out + req->outoff, req->outlen - req->outoff)) < 0)
+		return -1;
+	req->outoff += r;
+	return 0;
 }
 
 static int
@@ -121,10 +137,7 @@ send_size(struct http_request *req, off_t size)
 	if (r > 63)
 		panic("buffer too small!");
 
-	if (write(req->sock, buf, r) != r)
-		return -1;
-
-	return 0;
+	return send_out(req, buf, r);
 }
 
 static const char*
@@ -149,10 +162,7 @@ send_content_type(struct http_request *req)
 	if (r > 127)
 		panic("buffer too small!");
 
-	if (write(req->sock, buf, r) != r)
-		return -1;
-
-	return 0;
+	return send_out(req, buf, r);
 }
 
 static int
@@ -161,10 +171,7 @@ send_header_fin(struct http_request *req)
 	const char *fin = "\r\n";
 	int fin_len = strlen(fin);
 
-	if (write(req->sock, fin, fin_len) != fin_len)
-		return -1;
-
-	return 0;
+	return send_out(req, fin, fin_len);
 }
 
 // given a request, this function creates a struct http_request
@@ -235,10 +242,7 @@ send_error(struct http_request *req, int code)
 			       "<html><body><p>%d - %s</p></body></html>\r\n",
 			       e->code, e->msg, e->code, e->msg);
 
-	if (write(req->sock, buf, r) != r)
-		return -1;
-
-	return 0;
+	return send_out(req, buf, r);
 }
 
 static int
@@ -269,6 +273,7 @@ send_file(struct http_request *req)
 	
 	// Return 404 if directory
 	if (statbuf.st_isdir) {
+		close(fd);
 		return send_error(req, 404);
 	}
 	
@@ -293,47 +298,48 @@ send_file(struct http_request *req)
 	if ((r = send_header_fin(req)) < 0)
 		goto end;
 
-	r = send_data(req, fd);
+	// The poll loop sends the headers and then the file (send_data).
+	req->fd = fd;
+	return 0;
 
 end:
 	close(fd);
 	return r;
 }
 
-static void
-handle_client(int sock)
+// The client's request is readable: read it and prepare the response.
+// Returns < 0 if the connection should just be closed.
+static int
+handle_client(struct http_request *req)
 {
-	struct http_request con_d;
 	int r;
 	char buffer[BUFFSIZE];
 	int received = -1;
-	struct http_request *req = &con_d;
-
-	while (1)
-	{
-		// Receive message
-		if ((received = read(sock, buffer, BUFFSIZE)) < 0)
-			panic("failed to read");
-
-		memset(req, 0, sizeof(*req));
 
-		req->sock = sock;
-
-		r = http_request_parse(req, buffer);
-		if (r == -E_BAD_REQ)
-			send_error(req, 400);
-		else if (r < 0)
-			panic("parse failed");
-		else
-			send_file(req);
+	// Receive message
+	if ((received = read(req->sock, buffer, BUFFSIZE - 1)) <= 0)
+		return -1;
+	buffer[received] = '\0';
 
-		req_free(req);
+	r = http_request_parse(req, buffer);
+	if (r == -E_BAD_REQ)
+		r = send_error(req, 400);
+	else if (r < 0)
+		panic("parse failed");
+	else
+		r = send_file(req);
 
-		// no keep alive
-		break;
-	}
+	req_free(req);
+	return r;
+}
 
-	close(sock);
+// No keep alive: the connection is closed once the response is sent.
+static void
+client_close(struct http_request *req)
+{
+	if (req->fd >= 0)
+		close(req->fd);
+	close(req->sock);
 }
 
 void
@@ -367,16 +373,61 @@ umain(int argc, char **argv)
 
 	cprintf("Waiting for http connections...\n");
 
+	// Event loop: pfds[0] is the server socket, pfds[i] (i >= 1) is the
+	// connection of clients[i - 1]. A client waits for POLLIN until its
+	// request arrives, then for POLLOUT while its response is sent.
+	static struct pollfd pfds[MAXCLIENTS + 1];
+	static struct http_request clients[MAXCLIENTS];
+	int nclients = 0, i, r;
+
+	pfds[0].fd = serversock;
+	pfds[0].events = POLLIN;
+
 	while (1) {
-		unsigned int clientlen = sizeof(client);
-		// Wait for client connection
-		if ((clientsock = accept(serversock,
-					 (struct sockaddr *) &client,
-					 &clientlen)) < 0)
-		{
-			die("Failed to accept client connection");
+		// Stop accepting while the client table is full
+		pfds[0].fd = (nclients < MAXCLIENTS) ? serversock : -1;
+		if (poll(pfds, nclients + 1, -1) < 0)
+			die("Failed to poll");
+
+		for (i = 1; i <= nclients; ) {
+			struct http_request *req = &clients[i - 1];
+
+			if (pfds[i].revents == 0) {
+				i++;
+				continue;
+			}
+			if (pfds[i].events == POLLIN) {
+				r = handle_client(req);
+				pfds[i].events = POLLOUT;
+			} else
+				r = send_data(req);
+			if (r == 0) {
+				i++;
+				continue;
+			}
+			// Done, or failed: drop the client and move the last one here
+			client_close(req);
+			*req = clients[nclients - 1];
+			pfds[i] = pfds[nclients--];
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			unsigned int clientlen = sizeof(client);
+			// Accept the new client connection
+			if ((clientsock = accept(serversock,
+						 (struct sockaddr *) &client,
+						 &clientlen)) < 0)
+			{
+				die("Failed to accept client connection");
+			}
+			nclients++;
+			pfds[nclients].fd = clientsock;
+			pfds[nclients].events = POLLIN;
+			pfds[nclients].revents = 0;
+			clients[nclients - 1].sock = clientsock;
+			clients[nclients - 1].fd = -1;
+			clients[nclients - 1].outlen = clients[nclients - 1].outoff = 0;
 		}
-		handle_client(clientsock);
 	}
 
 	close(serversock);
@@ -0,0 +1,128 @@
+// malloc throughput benchmark.
+//
+// Usage: mallocbench [rounds [nobjs [nworkers]]]
+//
+// Each round allocates 'nobjs' objects of random small sizes (up to
+// 512 bytes), frees them in random order, then does the same with a
+// few large blocks that are grown with realloc.  Reports the rate of
+// small and large operations.
+//
+// With nworkers > 1 the small rounds run in that many sfork'd
+// environments at once, sharing one heap.
+
+#include <inc/lib.h>
+
+#define MAXOBJS		8192
+#define NLARGE		16
+#define MAXWORKERS	8
+
+static void *mallocbench_objs[MAXWORKERS][MAXOBJS];
+
+static uint32_t
+rand(uint32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 8;
+}
+
+// Allocates and frees nobjs small objects, using worker w's slots.
+// Returns the number of operations.
+static int
+small_round(int w, int nobjs)
+{
+	void **objs = mallocbench_objs[w];
+	uint32_t seed = w + 1;
+	int i, j;
+	void *v;
+
+	for (i = 0; i < nobjs; i++) {
+		if ((objs[i] = malloc(1 + rand(&seed) % 512)) == 0)
+			panic("malloc failed");
+		*(uint32_t *) objs[i] = i;
+	}
+	// shuffle, so blocks are freed in a different order
+	for (i = nobjs - 1; i > 0; i--) {
+		j = rand(&seed) % (i + 1);
+		v = objs[i];
+		objs[i] = objs[j];
+		objs[j] = v;
+	}
+	for (i = 0; i < nobjs; i++)
+		free(objs[i]);
+	return 2 * nobjs;
+}
+
+// Allocates NLARGE large blocks, doubles each one twice with realloc,
+// and frees them. Returns the number of operations.
+static int
+large_round(void)
+{
+	void **objs = mallocbench_objs[0];
+	uint32_t seed = 1;
+	int i, k;
+	size_t n;
+
+	for (i = 0; i < NLARGE; i++) {
+		n = 4096 + rand(&seed) % 32768;
+		if ((objs[i] = calloc(1, n)) == 0)
+			panic("calloc failed");
+		for (k = 0; k < 2; k++) {
+			n *= 2;
+			if ((objs[i] = realloc(objs[i], n)) == 0)
+				panic("realloc failed");
+		}
+	}
+	for (i = 0; i < NLARGE; i++)
+		free(objs[i]);
+	return 4 * NLARGE;
+}
+
+void
+umain(int argc, char **argv)
+{
+	int rounds = 20, nobjs = 4096, nworkers = 1, i, w = 0, nsmall = 0, nlarge = 0;
+	envid_t kids[MAXWORKERS];
+	uint32_t start, small_ms, large_ms;
+
+	binaryname = "mallocbench";
+
+	if (argc > 1)
+		rounds = strtol(argv[1], 0, 0);
+	if (argc > 2)
+		nobjs = strtol(argv[2], 0, 0);
+	if (argc > 3)
+		nworkers = strtol(argv[3], 0, 0);
+	if (rounds < 1 || nobjs < 1 || nobjs > MAXOBJS || nworkers < 1 || nworkers > MAXWORKERS)
+		panic("usage: mallocbench [rounds [nobjs [nworkers]]]");
+
+	start = sys_time_msec();
+	// worker 0 is us; the others are sfork'd children that exit when done
+	for (w = 1; w < nworkers; w++)
+		if ((kids[w] = sfork()) == 0)
+			break;
+		else if (kids[w] < 0)
+			panic("sfork: %e", kids[w]);
+	if (w == nworkers)
+		w = 0;
+	for (i = 0; i < rounds; i++)
+		nsmall += small_round(w, nobjs);
+	if (w != 0)
+		exit();
+	for (w = 1; w < nworkers; w++)
+		wait(kids[w]);
+	nsmall *= nworkers;
+	small_ms = sys_time_msec() - start;
+
+	start = sys_time_msec();
+	for (i = 0; i < rounds; i++)
+		nlarge += large_round();
+	large_ms = sys_time_msec() - start;
+
+	cprintf("mallocbench: %d small ops in %u ms", nsmall, small_ms);
+	if (small_ms > 0)
+		cprintf(" (%u ops/ms)", nsmall / small_ms);
+	cprintf(", %d large ops in %u ms", nlarge, large_ms);
+	if (large_ms > 0)
+		cprintf(" (%u ops/ms)", nlarge / large_ms);
+	cprintf("\n");
+}
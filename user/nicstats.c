@@ -0,0 +1,23 @@
+#include <inc/lib.h>
+
+// Print the E1000 receive mode and counters (used to tune the interrupt moderation settings in kern/e1000.h).
+void
+umain(int argc, char **argv)
+{
+	struct NicStats st;
+	int r;
+
+	if ((r = sys_net_stats(&st)) < 0)
+		panic("sys_net_stats: %e", r);
+
+	cprintf("rx mode:        %s\n", st.ns_rx_mode == E1000_RX_MODE_POLL ? "polling" : "interrupt");
+	cprintf("rx packets:     %u\n", st.ns_rx_packets);
+	cprintf("rx interrupts:  %u\n", st.ns_rx_intrs);
+	cprintf("rx empty polls: %u\n", st.ns_rx_polls);
+	cprintf("rx sleeps:      %u\n", st.ns_rx_sleeps);
+	cprintf("intr -> poll:   %u\n", st.ns_rx_to_poll);
+	cprintf("poll -> intr:   %u\n", st.ns_rx_to_intr);
+	cprintf("tx packets:     %u\n", st.ns_tx_packets);
+	cprintf("tx tso sends:   %u\n", st.ns_tx_tso);
+	cprintf("tx zero-copy:   %u\n", st.ns_tx_zcopy);
+}
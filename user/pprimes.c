@@ -0,0 +1,113 @@
+// Parallel prime sieve, for the task runtime.
+//
+// Usage: pprimes [n [maxworkers]]
+//
+// Counts the primes below n (default 4000000) with a segmented sieve of
+// Eratosthenes: the primes up to sqrt(n) are found first, then
+// task_parallel_for sieves segments of SEGSIZE numbers in parallel.
+// Runs with 1, 2, 4, ... workers, up to maxworkers (default: one per
+// CPU), and reports the time and speedup of each.
+//
+// Compare with user/primes, which passes every number down a pipeline
+// of environments connected by IPC, one environment per prime.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define SEGSIZE		32768
+
+static uint32_t n = 4000000;
+static uint32_t *small;		// the primes up to sqrt(n)
+static int nsmall;
+static volatile uint32_t count;
+
+// Finds the primes up to sqrt(n), serially.
+static void
+sieve_small(void)
+{
+	uint32_t limit, i, j;
+	uint8_t *composite;
+
+	for (limit = 1; limit * limit < n; limit++)
+		;
+	if ((composite = calloc(limit + 1, 1)) == 0
+	    || (small = malloc((limit + 1) * sizeof(uint32_t))) == 0)
+		panic("malloc failed");
+	for (i = 2; i <= limit; i++) {
+		if (composite[i])
+			continue;
+		small[nsmall++] = i;
+		for (j = i * i; j <= limit; j += i)
+			composite[j] = 1;
+	}
+	free(composite);
+}
+
+// Sieves segments [lo, hi) and adds the primes found to count.
+static void
+sieve_segments(int lo, int hi, void *arg)
+{
+	uint8_t *composite;
+	uint32_t base, end, p, m, found;
+	int s, i;
+
+	if ((composite = malloc(SEGSIZE)) == 0)
+		panic("malloc failed");
+	for (s = lo; s < hi; s++) {
+		base = s * SEGSIZE;
+		end = MIN(base + SEGSIZE, n);
+		memset(composite, 0, SEGSIZE);
+		for (i = 0; i < nsmall && small[i] * small[i] < end; i++) {
+			p = small[i];
+			for (m = MAX(p * p, ROUNDUP(base, p)); m < end; m += p)
+				composite[m - base] = 1;
+		}
+		found = 0;
+		for (m = MAX(base, 2); m < end; m++)
+			if (!composite[m - base])
+				found++;
+		xadd(&count, found);
+	}
+	free(composite);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int maxworkers = 0, nw, r, nseg;
+	uint32_t start, ms, ms1 = 0;
+
+	binaryname = "pprimes";
+
+	if (argc > 1)
+		n = strtol(argv[1], 0, 0);
+	if (argc > 2)
+		maxworkers = strtol(argv[2], 0, 0);
+	if (n < 2)
+		panic("usage: pprimes [n [maxworkers]]");
+	if (maxworkers <= 0)
+		maxworkers = sys_ncpu();
+	maxworkers = MIN(maxworkers, TASK_MAXWORKERS);
+
+	sieve_small();
+	nseg = ROUNDUP(n, SEGSIZE) / SEGSIZE;
+
+	for (nw = 1; ; nw = MIN(2 * nw, maxworkers)) {
+		if ((r = task_init(nw)) < 0)
+			panic("task_init: %e", r);
+		count = 0;
+		start = sys_time_msec();
+		task_parallel_for(0, nseg, 1, sieve_segments, 0);
+		ms = sys_time_msec() - start;
+		task_shutdown();
+
+		if (nw == 1)
+			ms1 = ms;
+		cprintf("pprimes: %u primes below %u, %d workers: %u ms", count, n, r, ms);
+		if (ms > 0)
+			cprintf(" (speedup %u.%02u)", ms1 / ms, ms1 * 100 / ms % 100);
+		cprintf("\n");
+		if (nw == maxworkers)
+			break;
+	}
+}
@@ -0,0 +1,101 @@
+// Sequential-read throughput benchmark for the file server.
+//
+// Usage: readbench [file [rounds [bufsize]]]
+//
+// Reads the whole file 'rounds' times, 'bufsize' bytes per read()
+// (default 8192), and reports the throughput of the first (cold) pass,
+// which goes to the disk unless the file is already in the block
+// cache, and of the remaining (cached) passes.  Reads of more than a
+// page use bulk file server requests.  A bufsize of 0 maps the file
+// with mmap and touches every page instead of calling read().
+
+#include <inc/lib.h>
+
+#define BUFFSIZE	(FSBULK_MAXPAGES * PGSIZE)
+
+static char buf[BUFFSIZE];
+static size_t bufsize = 8192;
+
+// Maps the file and reads one word of every page. Returns the file size.
+static int
+map_pass(int fd)
+{
+	struct Stat st;
+	volatile uint32_t *p;
+	void *va;
+	int r, off;
+
+	if ((r = fstat(fd, &st)) < 0)
+		panic("fstat: %e", r);
+	if (st.st_size == 0)
+		return 0;
+	if ((r = mmap(fd, 0, st.st_size, MAP_SHARED, &va)) < 0)
+		panic("mmap: %e", r);
+	for (off = 0; off < st.st_size; off += PGSIZE) {
+		p = (volatile uint32_t *) ((char *) va + off);
+		(void) *p;
+	}
+	munmap(va);
+	return st.st_size;
+}
+
+// Reads the file once. Returns the number of bytes read.
+static int
+read_pass(const char *path)
+{
+	int fd, n, total = 0;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, fd);
+	if (bufsize == 0) {
+		total = map_pass(fd);
+		close(fd);
+		return total;
+	}
+	while ((n = read(fd, buf, bufsize)) > 0)
+		total += n;
+	if (n < 0)
+		panic("read %s: %e", path, n);
+	close(fd);
+	return total;
+}
+
+static void
+report(const char *what, uint32_t bytes, uint32_t ms)
+{
+	cprintf("readbench: %s: %u bytes in %u ms", what, bytes, ms);
+	if (ms > 0)
+		cprintf(" (%u KB/s)", bytes / ms * 1000 / 1024);
+	cprintf("\n");
+}
+
+void
+umain(int argc, char **argv)
+{
+	const char *path = "/sh";
+	int rounds = 8, i;
+	uint32_t start, ms, bytes;
+
+	binaryname = "readbench";
+
+	if (argc > 1)
+		path = argv[1];
+	if (argc > 2)
+		rounds = strtol(argv[2], 0, 0);
+	if (argc > 3)
+		bufsize = strtol(argv[3], 0, 0);
+	if (rounds < 1 || bufsize > BUFFSIZE)
+		panic("usage: readbench [file [rounds [bufsize]]]");
+
+	start = sys_time_msec();
+	bytes = read_pass(path);
+	report("cold", bytes, sys_time_msec() - start);
+
+	if (rounds == 1)
+		return;
+	start = sys_time_msec();
+	for (bytes = 0, i = 1; i < rounds; i++)
+		bytes += read_pass(path);
+	ms = sys_time_msec() - start;
+	report("cached", bytes, ms);
+}
@@ -0,0 +1,44 @@
+// Spawn benchmark.
+//
+// Usage: spawnbench [count [prog]]
+//
+// Spawns 'count' instances of 'prog' (default 100 of /hello), all
+// running at once, then waits for them and reports the time taken.
+// The read-only pages of the program come from the file server's text
+// cache, so only the first spawn reads them and every instance shares
+// them.
+
+#include <inc/lib.h>
+
+#define MAXSPAWN	512
+
+static envid_t kids[MAXSPAWN];
+
+void
+umain(int argc, char **argv)
+{
+	const char *prog = "/hello";
+	int count = 100, i, r;
+	uint32_t start, spawned, ms;
+
+	binaryname = "spawnbench";
+
+	if (argc > 1)
+		count = strtol(argv[1], 0, 0);
+	if (argc > 2)
+		prog = argv[2];
+	if (count < 1 || count > MAXSPAWN)
+		panic("usage: spawnbench [count [prog]]");
+
+	start = sys_time_msec();
+	for (i = 0; i < count; i++)
+		if ((kids[i] = r = spawnl(prog, prog, (char *) 0)) < 0)
+			panic("spawn %s: %e", prog, r);
+	spawned = sys_time_msec() - start;
+	for (i = 0; i < count; i++)
+		wait(kids[i]);
+	ms = sys_time_msec() - start;
+
+	cprintf("spawnbench: %d x %s: spawned in %u ms (%u us per spawn), all exited after %u ms\n",
+		count, prog, spawned, spawned * 1000 / count, ms);
+}